@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Background WAL checkpoints
+ */
+
+#include "config.h"
+#include "checkpoint.h"
+#include "meterd_types.h"
+#include "meterd_config.h"
+#include "meterd_log.h"
+#include "meterd_error.h"
+#include "db.h"
+#include "dbwriter.h"
+#include "utlist.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Database that is checkpointed in the background */
+typedef struct checkpoint_db
+{
+	char*			db_name;
+	void*			write_h;	/* Handle the database is written through */
+	void*			ckpt_h;		/* Separate handle for checkpoints */
+	long long		last_size;	/* WAL size at the last checkpoint */
+	time_t			last_run;
+
+	/* Statistics */
+	unsigned long long	count;
+	unsigned long long	forced;		/* Checkpoints because the WAL reached its size limit */
+	double			total_time;	/* Seconds */
+	double			max_time;	/* Seconds */
+	long long		max_size;	/* Largest WAL seen at a checkpoint */
+
+	struct checkpoint_db*	next;
+}
+checkpoint_db;
+
+/* Default minimum interval between checkpoints of a database (seconds) */
+#define CHECKPOINT_DEFAULT_INTERVAL	30
+
+/* Default size above which the WAL is checkpointed even if the writer is busy (KiB) */
+#define CHECKPOINT_DEFAULT_WAL_LIMIT	4096
+
+/* Interval at which the checkpoint thread looks for work (us) */
+#define CHECKPOINT_POLL_INTERVAL	250000
+
+/* Module variables */
+static pthread_t		checkpoint_thread;
+static int			checkpoint_run		= 0;
+static int			checkpoint_enabled	= 0;
+static checkpoint_db*		dbs			= NULL;
+static int			checkpoint_interval	= CHECKPOINT_DEFAULT_INTERVAL;
+static long long		wal_limit		= CHECKPOINT_DEFAULT_WAL_LIMIT * 1024LL;
+
+/* Initialise WAL checkpointing */
+meterd_rv meterd_checkpoint_init(void)
+{
+	int		wal_limit_kb	= CHECKPOINT_DEFAULT_WAL_LIMIT;
+	meterd_rv	rv		= MRV_OK;
+
+	if (((rv = meterd_conf_get_int("database", "checkpoint_interval", &checkpoint_interval, CHECKPOINT_DEFAULT_INTERVAL)) != MRV_OK) ||
+	    ((rv = meterd_conf_get_int("database", "wal_size_limit", &wal_limit_kb, CHECKPOINT_DEFAULT_WAL_LIMIT)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to retrieve WAL checkpoint configuration");
+
+		return rv;
+	}
+
+	if (checkpoint_interval <= 0)
+	{
+		INFO_MSG("Leaving WAL checkpoints to SQLite");
+
+		checkpoint_enabled = 0;
+
+		return MRV_OK;
+	}
+
+	if (wal_limit_kb <= 0)
+	{
+		ERROR_MSG("Invalid WAL size limit (%d KiB)", wal_limit_kb);
+
+		return MRV_CONFIG_ERROR;
+	}
+
+	wal_limit		= wal_limit_kb * 1024LL;
+	checkpoint_enabled	= 1;
+
+	INFO_MSG("Checkpointing the WAL when idle for %d second(s), or when it reaches %d KiB", checkpoint_interval, wal_limit_kb);
+
+	return MRV_OK;
+}
+
+/* Take over checkpointing of the specified database, which is written through the specified handle */
+meterd_rv meterd_checkpoint_add(const char* db_name, void* db_handle)
+{
+	checkpoint_db*	new_db	= NULL;
+
+	if (!checkpoint_enabled)
+	{
+		return MRV_OK;
+	}
+
+	new_db = (checkpoint_db*) malloc(sizeof(checkpoint_db));
+
+	if (new_db == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	memset(new_db, 0, sizeof(checkpoint_db));
+
+	/* Checkpoints run on a separate connection, so they do not hold up the writer */
+	if (meterd_db_open(db_name, 0, &new_db->ckpt_h) != MRV_OK)
+	{
+		ERROR_MSG("Failed to open %s for WAL checkpoints, leaving them to SQLite", db_name);
+
+		free(new_db);
+
+		return MRV_DB_ERROR;
+	}
+
+	if (meterd_db_manual_checkpoints(db_handle, wal_limit) != MRV_OK)
+	{
+		ERROR_MSG("Failed to disable automatic WAL checkpoints on %s", db_name);
+
+		meterd_db_close(new_db->ckpt_h);
+		free(new_db);
+
+		return MRV_DB_ERROR;
+	}
+
+	new_db->db_name		= strdup(db_name);
+	new_db->write_h		= db_handle;
+	new_db->last_run	= time(NULL);
+
+	LL_APPEND(dbs, new_db);
+
+	return MRV_OK;
+}
+
+/* Checkpoint the specified database if it is due */
+static void meterd_checkpoint_db(checkpoint_db* db, time_t now)
+{
+	long long	size		= meterd_db_wal_size(db->write_h);
+	long long	wal_size	= 0;
+	long long	checkpointed	= 0;
+	int		forced		= 0;
+	double		elapsed		= 0;
+	struct timespec	start;
+	struct timespec	end;
+	meterd_rv	rv		= MRV_OK;
+
+	/* Nothing was committed since the last checkpoint */
+	if (size == db->last_size)
+	{
+		return;
+	}
+
+	forced = (size >= wal_limit);
+
+	if (!forced && (((now - db->last_run) < checkpoint_interval) || !meterd_dbwriter_idle()))
+	{
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rv = meterd_db_checkpoint(db->ckpt_h, &wal_size, &checkpointed);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (rv == MRV_DB_BUSY)
+	{
+		DEBUG_MSG("Database %s is busy, retrying WAL checkpoint later", db->db_name);
+
+		return;
+	}
+
+	db->last_size	= size;
+	db->last_run	= now;
+
+	if (rv != MRV_OK)
+	{
+		return;
+	}
+
+	elapsed = (double) (end.tv_sec - start.tv_sec) + ((double) (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+
+	db->count++;
+	db->forced	+= forced;
+	db->total_time	+= elapsed;
+
+	if (elapsed > db->max_time) db->max_time = elapsed;
+	if (wal_size > db->max_size) db->max_size = wal_size;
+
+	DEBUG_MSG("Checkpointed %lld of %lld WAL bytes of %s in %.1fms%s", checkpointed, wal_size, db->db_name, elapsed * 1000.0, forced ? " (size limit reached)" : "");
+}
+
+/* Main thread procedure */
+void* meterd_checkpoint_threadproc(void* param)
+{
+	checkpoint_db*	db_it	= NULL;
+	sigset_t	signals;
+
+	/* Signals are handled by the measurement loop */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	INFO_MSG("Entering WAL checkpoint thread");
+
+	while (__atomic_load_n(&checkpoint_run, __ATOMIC_RELAXED))
+	{
+		time_t	now	= time(NULL);
+
+		LL_FOREACH(dbs, db_it)
+		{
+			meterd_checkpoint_db(db_it, now);
+		}
+
+		usleep(CHECKPOINT_POLL_INTERVAL);
+	}
+
+	INFO_MSG("Leaving WAL checkpoint thread");
+
+	return NULL;
+}
+
+/* Start the checkpoint thread */
+void meterd_checkpoint_start(void)
+{
+	pthread_attr_t	checkpoint_t_attr;
+
+	if (dbs == NULL)
+	{
+		return;
+	}
+
+	checkpoint_run = 1;
+
+	pthread_attr_init(&checkpoint_t_attr);
+	pthread_attr_setdetachstate(&checkpoint_t_attr, PTHREAD_CREATE_JOINABLE);
+
+	if (pthread_create(&checkpoint_thread, &checkpoint_t_attr, meterd_checkpoint_threadproc, NULL) != 0)
+	{
+		ERROR_MSG("Failed to start WAL checkpoint thread, the WAL will grow until meterd is stopped");
+
+		checkpoint_run = 0;
+	}
+}
+
+/* Stop the checkpoint thread */
+void meterd_checkpoint_stop(void)
+{
+	if (checkpoint_run)
+	{
+		__atomic_store_n(&checkpoint_run, 0, __ATOMIC_RELAXED);
+
+		pthread_join(checkpoint_thread, NULL);
+	}
+}
+
+/* Uninitialise WAL checkpointing */
+meterd_rv meterd_checkpoint_finalize(void)
+{
+	checkpoint_db*	db_it	= NULL;
+	checkpoint_db*	db_tmp	= NULL;
+
+	LL_FOREACH_SAFE(dbs, db_it, db_tmp)
+	{
+		LL_DELETE(dbs, db_it);
+
+		if (db_it->count > 0)
+		{
+			INFO_MSG("Checkpointed the WAL of %s %llu time(s) (%llu at the size limit), taking %.1fms on average and at most %.1fms; the WAL was at most %lld bytes",
+				db_it->db_name, db_it->count, db_it->forced, (db_it->total_time * 1000.0) / db_it->count, db_it->max_time * 1000.0, db_it->max_size);
+		}
+
+		meterd_db_close(db_it->ckpt_h);
+
+		free(db_it->db_name);
+		free(db_it);
+	}
+
+	return MRV_OK;
+}
+
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Background WAL checkpoints
+ */
+
+#ifndef _METERD_CHECKPOINT_H
+#define _METERD_CHECKPOINT_H
+
+#include "config.h"
+#include "meterd_types.h"
+
+/* Initialise WAL checkpointing */
+meterd_rv meterd_checkpoint_init(void);
+
+/* Take over checkpointing of the specified database, which is written through the specified handle */
+meterd_rv meterd_checkpoint_add(const char* db_name, void* db_handle);
+
+/* Start the checkpoint thread */
+void meterd_checkpoint_start(void);
+
+/* Stop the checkpoint thread */
+void meterd_checkpoint_stop(void);
+
+/* Uninitialise WAL checkpointing */
+meterd_rv meterd_checkpoint_finalize(void);
+
+#endif /* !_METERD_CHECKPOINT_H */
+
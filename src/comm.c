@@ -35,6 +35,7 @@
 #include "meterd_error.h"
 #include "meterd_config.h"
 #include "meterd_log.h"
+#include "comm.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -45,10 +46,106 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
-#include "utlist.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* Telegram ring; the number of slots must be a power of two */
+#define COMM_SLOTS		8
+#define COMM_SLOT_MASK		(COMM_SLOTS - 1)
+#define COMM_SLOT_SIZE		8192	/* Longest telegram that can be received */
+
+/* Number of bytes read from the serial terminal at a time */
+#define COMM_READ_SIZE		1024
+
+/* Interval at which the reader thread checks if it needs to stop (ms) */
+#define COMM_STOP_CHECK		500
+
+/* States of the telegram framer */
+#define FRAME_IDLE		0	/* Waiting for the start of a telegram ('/') */
+#define FRAME_DATA		1	/* Receiving telegram lines */
+#define FRAME_END		2	/* Receiving the last line ('!' with the CRC) */
+
+/* Telegram received by the reader thread */
+typedef struct comm_slot
+{
+	char		data[COMM_SLOT_SIZE];
+	size_t		len;
+	struct timespec	started;	/* Arrival of the first byte */
+	struct timespec	framed;		/* Arrival of the last byte */
+}
+comm_slot;
+
+/* Latency statistics of a stage */
+typedef struct comm_latency
+{
+	unsigned long long	count;
+	double			total;		/* Seconds */
+	double			max;		/* Seconds */
+}
+comm_latency;
 
 /* Module variables*/
-static int	comm_fd	= 0;
+static int		comm_fd		= 0;
+#ifdef HAVE_SYS_EPOLL_H
+static int		comm_epoll_fd	= -1;
+#endif /* HAVE_SYS_EPOLL_H */
+static int		notify_fd[2]	= { -1, -1 };
+static volatile sig_atomic_t comm_interrupted = 0;
+
+/*
+ * Framed telegrams are passed from the reader thread to the measurement
+ * loop in a ring of preallocated slots; positions are free running
+ * counters that are masked on access. Only the reader thread advances
+ * the head and only the measurement loop advances the tail.
+ */
+static comm_slot	comm_ring[COMM_SLOTS];
+static size_t		comm_head	= 0;	/* Slot the next telegram is framed in */
+static size_t		comm_tail	= 0;	/* Oldest telegram that was not released */
+static size_t		comm_consumed	= 0;	/* Bytes of the oldest telegram that were consumed */
+static int		comm_have_slot	= 0;	/* Whether the oldest telegram was returned */
+static struct timespec	comm_dequeued;		/* Time the oldest telegram was returned */
+
+/* Reader thread */
+static pthread_t	reader_thread;
+static int		reader_run	= 0;
+static int		reader_stopped	= 0;
+static int		reader_started	= 0;
+static int		frame_state	= FRAME_IDLE;
+static int		frame_copy	= 0;	/* Whether the current telegram is kept */
+static char		frame_last	= '\n';	/* Last byte that was framed */
+
+/* Statistics */
+static unsigned long long	dropped		= 0;	/* Updated by the reader thread */
+static unsigned long long	oversized	= 0;	/* Updated by the reader thread */
+static comm_latency		lat_receive;		/* First to last byte */
+static comm_latency		lat_queue;		/* Last byte until taken up by the measurement loop */
+static comm_latency		lat_process;		/* Taken up until done */
+
+/* Return the number of seconds between two points in time */
+static double meterd_comm_elapsed(const struct timespec* from, const struct timespec* to)
+{
+	return (double) (to->tv_sec - from->tv_sec) + ((double) (to->tv_nsec - from->tv_nsec) / 1000000000.0);
+}
+
+/* Add a sample to the latency statistics of a stage */
+static void meterd_comm_latency_add(comm_latency* lat, double elapsed)
+{
+	lat->count++;
+	lat->total += elapsed;
+
+	if (elapsed > lat->max)
+	{
+		lat->max = elapsed;
+	}
+}
+
+static meterd_rv meterd_comm_start(int priority);
 
 /* Initialise communication */
 meterd_rv meterd_comm_init(void)
@@ -59,6 +156,7 @@ meterd_rv meterd_comm_init(void)
 	char*		parity_cfg	= NULL;
 	int		rts_cts_cfg	= 0;
 	int		xon_xoff_cfg	= 0;
+	int		priority_cfg	= 0;
 	struct termios	tsettings;
 
 	memset(&tsettings, 0, sizeof(struct termios));
@@ -168,10 +266,15 @@ meterd_rv meterd_comm_init(void)
 	}
 
 	tsettings.c_cflag |= CLOCAL | CREAD;
-	tsettings.c_lflag = ICANON;
+
+	/* Raw mode; telegrams are decoded from the byte stream as it arrives */
+	tsettings.c_lflag = 0;
+	tsettings.c_oflag = 0;
+	tsettings.c_cc[VMIN] = 1;
+	tsettings.c_cc[VTIME] = 0;
 
 	/* Open the serial terminal */
-	comm_fd = open(tty, O_RDWR | O_NOCTTY);
+	comm_fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
 	if (comm_fd < 0)
 	{
@@ -197,92 +300,513 @@ meterd_rv meterd_comm_init(void)
 		return MRV_COMM_ERROR;
 	}
 
+#ifdef HAVE_SYS_EPOLL_H
+	/* Set up event notification for incoming data */
+	if ((comm_epoll_fd = epoll_create1(0)) < 0)
+	{
+		ERROR_MSG("Failed to create epoll instance: %s", strerror(errno));
+
+		close(comm_fd);
+
+		return MRV_COMM_ERROR;
+	}
+	else
+	{
+		struct epoll_event	ev;
+
+		memset(&ev, 0, sizeof(ev));
+
+		ev.events	= EPOLLIN;
+		ev.data.fd	= comm_fd;
+
+		if (epoll_ctl(comm_epoll_fd, EPOLL_CTL_ADD, comm_fd, &ev) != 0)
+		{
+			ERROR_MSG("Failed to register serial terminal for events: %s", strerror(errno));
+
+			close(comm_epoll_fd);
+			close(comm_fd);
+
+			return MRV_COMM_ERROR;
+		}
+	}
+#endif /* HAVE_SYS_EPOLL_H */
+
+	/* Set up the notification of framed telegrams to the measurement loop */
+	if ((pipe(notify_fd) != 0) ||
+	    (fcntl(notify_fd[0], F_SETFL, O_NONBLOCK) != 0) ||
+	    (fcntl(notify_fd[1], F_SETFL, O_NONBLOCK) != 0))
+	{
+		ERROR_MSG("Failed to create notification pipe: %s", strerror(errno));
+
+		meterd_comm_finalize();
+
+		return MRV_COMM_ERROR;
+	}
+
+	comm_head	= 0;
+	comm_tail	= 0;
+	comm_consumed	= 0;
+	comm_have_slot	= 0;
+	frame_state	= FRAME_IDLE;
+
+	if (meterd_conf_get_int("meter", "reader_priority", &priority_cfg, 0) != MRV_OK)
+	{
+		WARNING_MSG("Failed to retrieve the priority of the reader thread from the configuration");
+	}
+
+	if (meterd_comm_start(priority_cfg) != MRV_OK)
+	{
+		meterd_comm_finalize();
+
+		return MRV_COMM_ERROR;
+	}
+
 	return MRV_OK;
 }
 
-/* Free space held by the telegram */
-void meterd_comm_telegram_free(telegram_ll* telegram)
+/* Wait until data is available on the serial terminal, or until it is time to check if the reader needs to stop */
+static meterd_rv meterd_comm_wait(void)
 {
-	telegram_ll*	tel_it	= NULL;
-	telegram_ll*	tel_tmp	= NULL;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event	ev;
 
-	LL_FOREACH_SAFE(telegram, tel_it, tel_tmp)
+	if (epoll_wait(comm_epoll_fd, &ev, 1, COMM_STOP_CHECK) < 0)
+#else
+	struct pollfd		pfd;
+
+	pfd.fd		= comm_fd;
+	pfd.events	= POLLIN;
+	pfd.revents	= 0;
+
+	if (poll(&pfd, 1, COMM_STOP_CHECK) < 0)
+#endif /* HAVE_SYS_EPOLL_H */
 	{
-		free(tel_it->t_line);
-		free(tel_it);
+		if (errno == EINTR)
+		{
+			return MRV_OK;
+		}
+
+		ERROR_MSG("Failed to wait for data on the serial terminal: %s", strerror(errno));
+
+		return MRV_COMM_ERROR;
 	}
+
+	return MRV_OK;
 }
 
-/* Wait for a new P1 telegram */
-meterd_rv meterd_comm_recv_p1(telegram_ll** telegram)
+/* Hand the telegram in the head slot to the measurement loop */
+static void meterd_comm_publish(const struct timespec* now)
 {
-	assert(telegram != NULL);
+	comm_ring[comm_head & COMM_SLOT_MASK].framed = *now;
 
-	char 	buf[4096] 	= { 0 };	/* Note: we assume telegram lines are smaller than 6Kbytes */
-	int	res		= 0;
+	__atomic_store_n(&comm_head, comm_head + 1, __ATOMIC_RELEASE);
 
-	/* Read data until we encounter a '/' character, that starts a telegram */
-	do
+	/* If the pipe is full the measurement loop has not caught up yet and is notified already */
+	if (write(notify_fd[1], "", 1) < 0)
 	{
-		res = read(comm_fd, buf, 4095);
+		/* Do nothing */
+	}
+}
 
-		if (res <= 0)
+/*
+ * Split the received bytes into telegrams; a telegram starts with a line
+ * that starts with '/' and ends with a line that starts with '!' (followed
+ * by the CRC for DSMR 4 and up). Telegrams are copied into the head slot,
+ * unless the ring is full or the telegram does not fit, in which case it
+ * is discarded and the measurement loop never sees it.
+ */
+static void meterd_comm_frame(const char* buf, size_t len, const struct timespec* now)
+{
+	while (len > 0)
+	{
+		comm_slot*	slot	= &comm_ring[comm_head & COMM_SLOT_MASK];
+		const char*	mark	= NULL;
+		const char*	start	= NULL;
+		size_t		chunk	= 0;
+
+		switch(frame_state)
 		{
-			if (errno == EINTR)
+		case FRAME_IDLE:
+			/* Discard everything up to the start of the next telegram; a '/' elsewhere is data */
+			for (mark = buf; (mark = memchr(mark, '/', len - (mark - buf))) != NULL; mark++)
 			{
-				return MRV_COMM_INTR;
+				if (((mark == buf) ? frame_last : mark[-1]) == '\n') break;
 			}
 
-			return MRV_COMM_ERROR;
+			if (mark == NULL)
+			{
+				frame_last = buf[len - 1];
+
+				return;
+			}
+
+			len -= (mark - buf);
+			buf = mark;
+
+			/* Drop the telegram if the measurement loop has not taken up the previous ones */
+			frame_copy = ((comm_head - __atomic_load_n(&comm_tail, __ATOMIC_ACQUIRE)) < COMM_SLOTS);
+
+			if (frame_copy)
+			{
+				slot->len	= 0;
+				slot->started	= *now;
+			}
+			else
+			{
+				dropped++;
+			}
+
+			frame_state	= FRAME_DATA;
+			chunk		= 1;
+
+			break;
+		case FRAME_DATA:
+			/* The telegram ends with a line that starts with '!'; a '!' elsewhere is data */
+			for (mark = buf; (mark = memchr(mark, '!', len - (mark - buf))) != NULL; mark++)
+			{
+				if (((mark == buf) ? frame_last : mark[-1]) == '\n') break;
+			}
+
+			/* Start over if a new telegram starts before this one ended */
+			for (start = buf; (start = memchr(start, '/', len - (start - buf))) != NULL; start++)
+			{
+				if (((start == buf) ? frame_last : start[-1]) == '\n') break;
+			}
+
+			if ((start != NULL) && ((mark == NULL) || (start < mark)))
+			{
+				chunk		= start - buf;
+				mark		= NULL;
+				frame_state	= FRAME_IDLE;
+			}
+			else if (mark != NULL)
+			{
+				chunk		= mark - buf + 1;
+				frame_state	= FRAME_END;
+			}
+			else
+			{
+				chunk		= len;
+			}
+
+			break;
+		case FRAME_END:
+			if ((mark = memchr(buf, '\n', len)) != NULL)
+			{
+				chunk		= mark - buf + 1;
+				frame_state	= FRAME_IDLE;
+			}
+			else
+			{
+				chunk		= len;
+			}
+
+			break;
+		}
+
+		if (chunk == 0)
+		{
+			continue;
+		}
+
+		if (frame_copy && ((slot->len + chunk) > COMM_SLOT_SIZE))
+		{
+			WARNING_MSG("Telegram longer than %d bytes received, discarding it", COMM_SLOT_SIZE);
+
+			oversized++;
+			frame_copy = 0;
+		}
+
+		if (frame_copy)
+		{
+			memcpy(&slot->data[slot->len], buf, chunk);
+
+			slot->len += chunk;
+
+			/* The telegram is complete when the last line has been received */
+			if ((frame_state == FRAME_IDLE) && (mark != NULL) && (*mark == '\n'))
+			{
+				meterd_comm_publish(now);
+			}
 		}
 
-		buf[res] = '\0';
+		frame_last = buf[chunk - 1];
+
+		buf += chunk;
+		len -= chunk;
 	}
-	while(buf[0] != '/');
+}
+
+/* Reader thread procedure; frames telegrams until stopped */
+static void* meterd_comm_threadproc(void* param)
+{
+	char		buf[COMM_READ_SIZE];
+	sigset_t	signals;
 
-	/* Now, read the telegram, which ends with a '!' character */
-	do
+	/* Signals are handled by the measurement loop */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	INFO_MSG("Entering serial reader thread");
+
+	while (__atomic_load_n(&reader_run, __ATOMIC_RELAXED))
 	{
-		telegram_ll* new_tel_line	= (telegram_ll*) malloc(sizeof(telegram_ll));
+		if (meterd_comm_wait() != MRV_OK)
+		{
+			break;
+		}
+
+		/* Read everything that is available */
+		while (__atomic_load_n(&reader_run, __ATOMIC_RELAXED))
+		{
+			ssize_t		res	= read(comm_fd, buf, COMM_READ_SIZE);
+			struct timespec	now;
+
+			if (res < 0)
+			{
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				{
+					break;
+				}
+
+				ERROR_MSG("Failed to read from the serial terminal: %s", strerror(errno));
+
+				__atomic_store_n(&reader_run, 0, __ATOMIC_RELAXED);
+			}
+			else if (res == 0)
+			{
+				ERROR_MSG("Serial terminal was closed");
+
+				__atomic_store_n(&reader_run, 0, __ATOMIC_RELAXED);
+			}
+			else
+			{
+				clock_gettime(CLOCK_MONOTONIC, &now);
+
+				meterd_comm_frame(buf, (size_t) res, &now);
+			}
+		}
+	}
+
+	/* Let the measurement loop know that no more telegrams will arrive */
+	__atomic_store_n(&reader_stopped, 1, __ATOMIC_RELEASE);
+
+	if (write(notify_fd[1], "", 1) < 0)
+	{
+		/* Do nothing */
+	}
+
+	INFO_MSG("Leaving serial reader thread");
 
-		/* Remove \r and \n */
-		if (strchr(buf, '\r') != NULL) *strchr(buf, '\r') = '\0';
-		if (strchr(buf, '\n') != NULL) *strchr(buf, '\n') = '\0';
+	return NULL;
+}
+
+/* Start the reader thread, with real-time priority if priority is non-zero */
+static meterd_rv meterd_comm_start(int priority)
+{
+	pthread_attr_t		reader_t_attr;
+	struct sched_param	param;
+
+	reader_run	= 1;
+	reader_stopped	= 0;
 
-		new_tel_line->t_line = strdup(buf);
+	pthread_attr_init(&reader_t_attr);
+	pthread_attr_setdetachstate(&reader_t_attr, PTHREAD_CREATE_JOINABLE);
 
-		DEBUG_MSG("tel_dbg: '%s'", buf);
+	if (priority > 0)
+	{
+		memset(&param, 0, sizeof(struct sched_param));
+
+		param.sched_priority = priority;
 
-		LL_APPEND(*telegram, new_tel_line);
+		if (param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+		{
+			param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		}
 
-		res = read(comm_fd, buf, 4095);
+		pthread_attr_setinheritsched(&reader_t_attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&reader_t_attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&reader_t_attr, &param);
 
-		if (res <= 0)
+		if (pthread_create(&reader_thread, &reader_t_attr, meterd_comm_threadproc, NULL) == 0)
 		{
-			meterd_comm_telegram_free(*telegram);
+			INFO_MSG("Started serial reader thread with real-time priority %d", param.sched_priority);
+
+			reader_started = 1;
+
+			return MRV_OK;
+		}
+
+		WARNING_MSG("Failed to start serial reader thread with real-time priority, using normal priority");
+
+		pthread_attr_setinheritsched(&reader_t_attr, PTHREAD_INHERIT_SCHED);
+	}
+
+	if (pthread_create(&reader_thread, &reader_t_attr, meterd_comm_threadproc, NULL) != 0)
+	{
+		ERROR_MSG("Failed to start serial reader thread");
+
+		reader_run = 0;
+
+		return MRV_COMM_ERROR;
+	}
+
+	reader_started = 1;
+
+	return MRV_OK;
+}
+
+/* Wait for a telegram from the reader thread; returns the bytes of the oldest telegram that were not consumed yet */
+meterd_rv meterd_comm_recv(const char** data, size_t* len)
+{
+	assert(data != NULL);
+	assert(len != NULL);
+
+	comm_slot*	slot	= &comm_ring[comm_tail & COMM_SLOT_MASK];
+	struct timespec	now;
+	char		buf[64];
+
+	/* Release the previous telegram once it has been consumed and processed */
+	if (comm_have_slot && (comm_consumed >= slot->len))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
 
+		meterd_comm_latency_add(&lat_process, meterd_comm_elapsed(&comm_dequeued, &now));
+
+		DEBUG_MSG("Telegram of %zu bytes received in %.3fs, queued for %.3fs, processed in %.3fs", slot->len,
+			meterd_comm_elapsed(&slot->started, &slot->framed),
+			meterd_comm_elapsed(&slot->framed, &comm_dequeued),
+			meterd_comm_elapsed(&comm_dequeued, &now));
+
+		comm_have_slot	= 0;
+		comm_consumed	= 0;
+
+		__atomic_store_n(&comm_tail, comm_tail + 1, __ATOMIC_RELEASE);
+
+		slot = &comm_ring[comm_tail & COMM_SLOT_MASK];
+	}
+
+	while (comm_tail == __atomic_load_n(&comm_head, __ATOMIC_ACQUIRE))
+	{
+		struct pollfd	pfd;
+
+		if (__atomic_load_n(&reader_stopped, __ATOMIC_ACQUIRE))
+		{
+			return MRV_COMM_ERROR;
+		}
+
+		/* A signal may be delivered to another thread, which then wakes us up */
+		if (comm_interrupted)
+		{
+			comm_interrupted = 0;
+
+			return MRV_COMM_INTR;
+		}
+
+		pfd.fd		= notify_fd[0];
+		pfd.events	= POLLIN;
+		pfd.revents	= 0;
+
+		if (poll(&pfd, 1, -1) < 0)
+		{
 			if (errno == EINTR)
 			{
 				return MRV_COMM_INTR;
 			}
 
+			ERROR_MSG("Failed to wait for telegrams: %s", strerror(errno));
+
 			return MRV_COMM_ERROR;
 		}
 
-		buf[res] = '\0';
+		while (read(notify_fd[0], buf, sizeof(buf)) > 0);
+	}
+
+	if (!comm_have_slot)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &comm_dequeued);
+
+		meterd_comm_latency_add(&lat_receive, meterd_comm_elapsed(&slot->started, &slot->framed));
+		meterd_comm_latency_add(&lat_queue, meterd_comm_elapsed(&slot->framed, &comm_dequeued));
+
+		comm_have_slot = 1;
 	}
-	while(buf[0] != '!');
+
+	*data	= &slot->data[comm_consumed];
+	*len	= slot->len - comm_consumed;
 
 	return MRV_OK;
 }
 
+/* Make meterd_comm_recv return MRV_COMM_INTR; may be called from a signal handler */
+void meterd_comm_interrupt(void)
+{
+	comm_interrupted = 1;
+
+	if ((notify_fd[1] >= 0) && (write(notify_fd[1], "", 1) < 0))
+	{
+		/* Do nothing */
+	}
+}
+
+/* Release the specified number of bytes returned by meterd_comm_recv */
+void meterd_comm_consume(size_t len)
+{
+	assert(comm_have_slot);
+	assert(len <= (comm_ring[comm_tail & COMM_SLOT_MASK].len - comm_consumed));
+
+	comm_consumed += len;
+}
+
+/* Log the latency statistics of a stage */
+static void meterd_comm_latency_log(const char* stage, const comm_latency* lat)
+{
+	if (lat->count > 0)
+	{
+		INFO_MSG("Telegram %s took %.1fms on average, at most %.1fms", stage, (lat->total * 1000.0) / lat->count, lat->max * 1000.0);
+	}
+}
+
 /* Uninitialise communication */
 meterd_rv meterd_comm_finalize(void)
 {
+	/* Stop the reader thread */
+	if (reader_started)
+	{
+		__atomic_store_n(&reader_run, 0, __ATOMIC_RELAXED);
+
+		pthread_join(reader_thread, NULL);
+
+		reader_started = 0;
+
+		INFO_MSG("Dropped %llu telegram(s) that were not taken up in time and %llu that were too long", dropped, oversized);
+
+		meterd_comm_latency_log("reception", &lat_receive);
+		meterd_comm_latency_log("queueing", &lat_queue);
+		meterd_comm_latency_log("processing", &lat_process);
+	}
+
+	if (notify_fd[0] >= 0)
+	{
+		close(notify_fd[0]);
+		close(notify_fd[1]);
+
+		notify_fd[0] = -1;
+		notify_fd[1] = -1;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (comm_epoll_fd >= 0)
+	{
+		close(comm_epoll_fd);
+
+		comm_epoll_fd = -1;
+	}
+#endif /* HAVE_SYS_EPOLL_H */
+
 	close(comm_fd);
 
 	INFO_MSG("Disconnected from serial terminal");
 
 	return MRV_OK;
 }
-
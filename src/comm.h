@@ -36,16 +36,23 @@
 #include "config.h"
 #include "meterd_types.h"
 
-/* Initialise communication */
+/* Initialise communication and start the reader thread */
 meterd_rv meterd_comm_init(void);
 
-/* Wait for a new P1 telegram */
-meterd_rv meterd_comm_recv_p1(telegram_ll** telegram);
+/*
+ * Wait for a telegram from the reader thread; returns the bytes of the
+ * oldest telegram that were not consumed yet. The telegram is released
+ * to the reader thread on the next call once it has been consumed.
+ */
+meterd_rv meterd_comm_recv(const char** data, size_t* len);
+
+/* Make meterd_comm_recv return MRV_COMM_INTR; may be called from a signal handler */
+void meterd_comm_interrupt(void);
 
-/* Free space held by the telegram */
-void meterd_comm_telegram_free(telegram_ll* telegram);
+/* Release the specified number of bytes returned by meterd_comm_recv */
+void meterd_comm_consume(size_t len);
 
-/* Uninitialise communication */
+/* Stop the reader thread and uninitialise communication */
 meterd_rv meterd_comm_finalize(void);
 
 #endif /* !_METERD_COMM_H */
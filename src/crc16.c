@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * DSMR telegram CRC16
+ */
+
+#include "config.h"
+#include "crc16.h"
+
+/* Reflected polynomial x^16 + x^15 + x^2 + 1 */
+#define CRC16_POLY	0xA001
+
+/*
+ * Slice-by-4 lookup tables; crc16_table[0] is the regular byte-wise
+ * table, crc16_table[n] advances a byte over n additional zero bytes
+ */
+static uint16_t	crc16_table[4][256];
+static int	crc16_ready	= 0;
+
+/* Set up the lookup tables; must be called before the first update */
+void meterd_crc16_init(void)
+{
+	int	i	= 0;
+	int	j	= 0;
+
+	if (crc16_ready) return;
+
+	for (i = 0; i < 256; i++)
+	{
+		uint16_t	crc	= i;
+
+		for (j = 0; j < 8; j++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC16_POLY) : (crc >> 1);
+		}
+
+		crc16_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		for (j = 1; j < 4; j++)
+		{
+			uint16_t	prev	= crc16_table[j - 1][i];
+
+			crc16_table[j][i] = (prev >> 8) ^ crc16_table[0][prev & 0xff];
+		}
+	}
+
+	crc16_ready = 1;
+}
+
+/* Continue the CRC16 (CRC-16/ARC, as used by DSMR 4 and up) over the specified data */
+uint16_t meterd_crc16_update(uint16_t crc, const char* data, size_t len)
+{
+	const unsigned char*	it	= (const unsigned char*) data;
+
+	/* Process four bytes per step */
+	while (len >= 4)
+	{
+		crc ^= it[0] | (it[1] << 8);
+
+		crc =	crc16_table[3][crc & 0xff] ^
+			crc16_table[2][crc >> 8] ^
+			crc16_table[1][it[2]] ^
+			crc16_table[0][it[3]];
+
+		it	+= 4;
+		len	-= 4;
+	}
+
+	while (len-- > 0)
+	{
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ *it++) & 0xff];
+	}
+
+	return crc;
+}
@@ -35,7 +35,10 @@
 #include "meterd_error.h"
 #include "meterd_log.h"
 #include "db.h"
+#include "obis.h"
+#include "fixed.h"
 #include "utlist.h"
+#include "uthash.h"
 #include <pthread.h>
 #include <sqlite3.h>
 #include <assert.h>
@@ -45,8 +48,81 @@
 #include <stdlib.h>
 #include <time.h>
 
+/* Cached prepared INSERT statement for a table */
+typedef struct meterd_db_stmt
+{
+	char*			table_name;
+	sqlite3_stmt*		stmt;
+	int			has_unit;	/* Table has a unit column (schema version 1) */
+	int			has_twa;	/* Aggregate table has duration and time-weighted average columns (windows) */
+	int			unit;		/* Unit last stored in the configuration table, -1 if unknown */
+	UT_hash_handle		hh;
+}
+meterd_db_stmt;
+
+/* Database handle; the opaque handle passed to callers points to this */
+typedef struct meterd_db_ctx
+{
+	sqlite3*		db;
+	meterd_db_stmt*		stmts;
+	int			in_txn;
+	int			wal_pages;	/* Size of the WAL after the last commit, if checkpointed manually */
+	int			page_size;
+	char*			staging_name;	/* Staging database measurements are written to, if any */
+}
+meterd_db_ctx;
+
+#define DB_SQLITE(h)	(((meterd_db_ctx*) (h))->db)
+
+/* Schema measurements are written to */
+#define DB_STAGING_PREFIX(ctx)	(((ctx)->staging_name != NULL) ? "staging." : "")
+
+/*
+ * Schema of the data tables; version 1 stored the unit in each row of the
+ * data tables, as of version 2 it is stored once in the configuration table
+ */
+#define DB_SCHEMA_VERSION	2
+#define DB_DATA_COLUMNS		"(timestamp INTEGER, value DOUBLE)"
+
+/* Schema of the daily and monthly aggregate tables; one row per period, keyed on its start */
+#define DB_AGGREGATE_COLUMNS	"(timestamp INTEGER PRIMARY KEY, count INTEGER, sum DOUBLE, min DOUBLE, max DOUBLE, first DOUBLE, last DOUBLE)"
+
+/* Schema of the window aggregate tables; the aggregate columns plus the time-weighted average */
+#define DB_WINDOW_COLUMNS	"(timestamp INTEGER PRIMARY KEY, count INTEGER, sum DOUBLE, min DOUBLE, max DOUBLE, first DOUBLE, last DOUBLE, duration INTEGER, twa DOUBLE)"
+
+/* Check if a table type holds aggregates */
+#define DB_IS_AGGREGATE(type)	(((type) == COUNTER_TYPE_DAILY) || ((type) == COUNTER_TYPE_MONTHLY) || ((type) == COUNTER_TYPE_WINDOW))
+
+/* Time to wait for a lock held by another process (ms) */
+#define DB_BUSY_TIMEOUT		5000
+#define DB_MIGRATE_TIMEOUT	60000
+
 static pthread_mutex_t meterd_db_mutex;
 
+/* Allocate a database handle for the specified SQLite handle */
+static meterd_rv meterd_db_wrap(sqlite3* internal_handle, void** db_handle)
+{
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) malloc(sizeof(meterd_db_ctx));
+
+	if (ctx == NULL)
+	{
+		sqlite3_close(internal_handle);
+
+		return MRV_MEMORY;
+	}
+
+	ctx->db		= internal_handle;
+	ctx->stmts	= NULL;
+	ctx->in_txn	= 0;
+	ctx->wal_pages	= 0;
+	ctx->page_size	= 0;
+	ctx->staging_name = NULL;
+
+	*db_handle = (void*) ctx;
+
+	return MRV_OK;
+}
+
 /* Initialise database handling */
 meterd_rv meterd_db_init(void)
 {
@@ -111,10 +187,17 @@ meterd_rv meterd_db_create(const char* db_name, int force_create, void** db_hand
 	{
 		ERROR_MSG("Failed to create database %s (%s)", db_name, sqlite3_errmsg(internal_handle));
 
+		sqlite3_close(internal_handle);
+
 		return MRV_DB_ERROR;
 	}
 
-	*db_handle = (void*) internal_handle;
+	sqlite3_busy_timeout(internal_handle, DB_BUSY_TIMEOUT);
+
+	if (meterd_db_wrap(internal_handle, db_handle) != MRV_OK)
+	{
+		return MRV_MEMORY;
+	}
 
 	/* Turn on direct disk synchronisation (data immediately available) */
 	sql = "PRAGMA synchronous=ON;";
@@ -126,6 +209,16 @@ meterd_rv meterd_db_create(const char* db_name, int force_create, void** db_hand
 		sqlite3_free(errmsg);
 	}
 
+	/* Allow expired data to be returned to the file system (must precede table creation) */
+	sql = "PRAGMA auto_vacuum=INCREMENTAL;";
+
+	if (sqlite3_exec(internal_handle, sql, NULL, 0, &errmsg) != SQLITE_OK)
+	{
+		WARNING_MSG("Failed to enable incremental auto-vacuum (%s)", errmsg);
+
+		sqlite3_free(errmsg);
+	}
+
 	/* Switch to write-ahead logging for concurrent DB access */
 	sql = "PRAGMA journal_mode=WAL;";
 
@@ -155,10 +248,11 @@ meterd_rv meterd_db_create_tables(void* db_handle, counter_spec* counters)
 			"id		VARCHAR(16) PRIMARY KEY," \
 			"description	VARCHAR(255)," \
 			"type		INTEGER," \
-			"table_name	VARCHAR(255)" \
+			"table_name	VARCHAR(255)," \
+			"unit		VARCHAR(16)" \
 		");";
 
-	if (sqlite3_exec((sqlite3*) db_handle, sql, NULL, 0, &errmsg) != SQLITE_OK)
+	if (sqlite3_exec(DB_SQLITE(db_handle), sql, NULL, 0, &errmsg) != SQLITE_OK)
 	{
 		ERROR_MSG("Failed to create configuration table (%s)", errmsg);
 
@@ -167,20 +261,29 @@ meterd_rv meterd_db_create_tables(void* db_handle, counter_spec* counters)
 		return MRV_DB_ERROR;
 	}
 
-	/* Populate the configuration table and create the data table */
-	sql =	"INSERT INTO CONFIGURATION (id,description,type,table_name) VALUES ('%s','%s',%d,'%s');" \
-		"CREATE TABLE %s " \
-		"(" \
-			"timestamp	INTEGER," \
-			"value		DOUBLE," \
-			"unit		VARCHAR(16)"
-		");";
-
+	/* Populate the configuration table and create the data table with an index for range queries */
 	LL_FOREACH(counters, ctr_it)
 	{
-		snprintf(sql_buf, 4096, sql, ctr_it->id, ctr_it->description, ctr_it->type, ctr_it->table_name, ctr_it->table_name);
+		if (ctr_it->type == COUNTER_TYPE_WINDOW)
+		{
+			sql =	"INSERT INTO CONFIGURATION (id,description,type,table_name) VALUES ('%s','%s',%d,'%s');" \
+				"CREATE TABLE %s " DB_WINDOW_COLUMNS ";";
+		}
+		else if (DB_IS_AGGREGATE(ctr_it->type))
+		{
+			sql =	"INSERT INTO CONFIGURATION (id,description,type,table_name) VALUES ('%s','%s',%d,'%s');" \
+				"CREATE TABLE %s " DB_AGGREGATE_COLUMNS ";";
+		}
+		else
+		{
+			sql =	"INSERT INTO CONFIGURATION (id,description,type,table_name) VALUES ('%s','%s',%d,'%s');" \
+				"CREATE TABLE %s " DB_DATA_COLUMNS ";" \
+				"CREATE INDEX %s_TS ON %s (timestamp);";
+		}
 
-		if (sqlite3_exec((sqlite3*) db_handle, sql_buf, NULL, 0, &errmsg) != SQLITE_OK)
+		snprintf(sql_buf, 4096, sql, ctr_it->id, ctr_it->description, ctr_it->type, ctr_it->table_name, ctr_it->table_name, ctr_it->table_name, ctr_it->table_name);
+
+		if (sqlite3_exec(DB_SQLITE(db_handle), sql_buf, NULL, 0, &errmsg) != SQLITE_OK)
 		{
 			ERROR_MSG("Failed to insert counter %s into CONFIGURATION table or create table %s (%s)", ctr_it->id, ctr_it->table_name, errmsg);
 
@@ -190,6 +293,17 @@ meterd_rv meterd_db_create_tables(void* db_handle, counter_spec* counters)
 		}
 	}
 
+	snprintf(sql_buf, 4096, "PRAGMA user_version=%d;", DB_SCHEMA_VERSION);
+
+	if (sqlite3_exec(DB_SQLITE(db_handle), sql_buf, NULL, 0, &errmsg) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to set the schema version (%s)", errmsg);
+
+		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
+	}
+
 	return MRV_OK;
 }
 
@@ -207,10 +321,17 @@ meterd_rv meterd_db_open(const char* db_name, int read_only, void** db_handle)
 	{
 		ERROR_MSG("Failed to open database %s (%s)", db_name, sqlite3_errmsg(internal_handle));
 
+		sqlite3_close(internal_handle);
+
 		return MRV_DB_ERROR;
 	}
 
-	*db_handle = (void*) internal_handle;
+	sqlite3_busy_timeout(internal_handle, DB_BUSY_TIMEOUT);
+
+	if (meterd_db_wrap(internal_handle, db_handle) != MRV_OK)
+	{
+		return MRV_MEMORY;
+	}
 
 	
 	/* Turn off direct disk synchronisation (data immediately available) */
@@ -226,174 +347,2025 @@ meterd_rv meterd_db_open(const char* db_name, int read_only, void** db_handle)
 	return MRV_OK;
 }
 
-/* Record a measurement in the specified table of the specified database */
-meterd_rv meterd_db_record(void* db_handle, const char* table_name, long double value, const char* unit, int timestamp)
+/* Switch between full (FULL) and WAL-safe (NORMAL) disk synchronisation */
+meterd_rv meterd_db_set_synchronous(void* db_handle, int normal)
 {
 	assert(db_handle != NULL);
-	assert(table_name != NULL);
-	assert(unit != NULL);
 
-	char*	sql		= NULL;
-	char*	errmsg		= NULL;
-	char	sql_buf[4096]	= { 0 };
+	char*	errmsg	= NULL;
+
+	if (sqlite3_exec(DB_SQLITE(db_handle), normal ? "PRAGMA synchronous=NORMAL;" : "PRAGMA synchronous=ON;", NULL, 0, &errmsg) != SQLITE_OK)
+	{
+		WARNING_MSG("Failed to change disk synchronisation mode (%s)", errmsg);
 
-	sql = "INSERT INTO %s (timestamp, value, unit) VALUES (%d,%Lf,'%s');";
+		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
+	}
+
+	return MRV_OK;
+}
+
+/* Start a transaction in which subsequent measurements are recorded */
+meterd_rv meterd_db_begin(void* db_handle)
+{
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) db_handle;
+	char*		errmsg	= NULL;
 
-	snprintf(sql_buf, 4096, sql, table_name, timestamp, value, unit);
+	if ((ctx == NULL) || ctx->in_txn)
+	{
+		return MRV_OK;
+	}
 
-	if (sqlite3_exec((sqlite3*) db_handle, sql_buf, NULL, 0, &errmsg) != SQLITE_OK)
+	if (sqlite3_exec(ctx->db, "BEGIN;", NULL, 0, &errmsg) != SQLITE_OK)
 	{
-		WARNING_MSG("Failed to record new measurement in the database (%s)", errmsg);
+		WARNING_MSG("Failed to start a transaction (%s)", errmsg);
 
 		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
 	}
 
+	ctx->in_txn = 1;
+
 	return MRV_OK;
 }
 
-static int meterd_db_get_config_cb(void* data, int argc, char* argv[], char* colname[])
+/* Commit the open transaction (if any) */
+meterd_rv meterd_db_commit(void* db_handle)
 {
-	assert(data != NULL);
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) db_handle;
+	char*		errmsg	= NULL;
 
-	char**	table_name = (char**) data;
+	if ((ctx == NULL) || !ctx->in_txn)
+	{
+		return MRV_OK;
+	}
 
-	if (argc != 1)
+	ctx->in_txn = 0;
+
+	if (sqlite3_exec(ctx->db, "COMMIT;", NULL, 0, &errmsg) != SQLITE_OK)
 	{
-		ERROR_MSG("Invalid database format detected");
+		ERROR_MSG("Failed to commit recorded measurements to the database (%s)", errmsg);
 
-		return -1;
+		sqlite3_free(errmsg);
+
+		/* Make sure no transaction is left open */
+		sqlite3_exec(ctx->db, "ROLLBACK;", NULL, 0, NULL);
+
+		return MRV_DB_ERROR;
 	}
 
-	*table_name = strdup(argv[0]);
+	return MRV_OK;
+}
 
-	return 0;
+/* Execute a statement with a single integer result */
+static meterd_rv meterd_db_query_int(sqlite3* db, const char* sql, sqlite3_int64* result)
+{
+	sqlite3_stmt*	stmt	= NULL;
+	meterd_rv	rv	= MRV_DB_ERROR;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		*result = sqlite3_column_int64(stmt, 0);
+
+		rv = MRV_OK;
+	}
+
+	sqlite3_finalize(stmt);
+
+	return rv;
+}
+
+/* Execute a statement and log a warning if it fails */
+static meterd_rv meterd_db_exec(sqlite3* db, const char* sql)
+{
+	char*	errmsg	= NULL;
+
+	if (sqlite3_exec(db, sql, NULL, 0, &errmsg) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to execute '%s' (%s)", sql, errmsg);
+
+		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
+	}
+
+	return MRV_OK;
 }
 
-static int	nresults	= 0;
+/* Keep track of the size of the WAL of the database after each commit; attached databases have their own WAL */
+static int meterd_db_wal_hook(void* data, sqlite3* db, const char* db_name, int pages)
+{
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) data;
+
+	if (strcmp(db_name, "main") == 0)
+	{
+		__atomic_store_n(&ctx->wal_pages, pages, __ATOMIC_RELAXED);
+	}
 
-static int meterd_db_get_results_cb(void* data, int argc, char* argv[], char* colname[])
+	return SQLITE_OK;
+}
+
+/* Disable automatic checkpoints on the specified database and truncate the WAL to at most size_limit bytes when it is reset */
+meterd_rv meterd_db_manual_checkpoints(void* db_handle, long long size_limit)
 {
-	assert(data != NULL);
+	assert(db_handle != NULL);
 
-	db_res_ctr** results = (db_res_ctr**) data;
-	db_res_ctr* new_result = NULL;
+	meterd_db_ctx*	ctx		= (meterd_db_ctx*) db_handle;
+	sqlite3_int64	page_size	= 0;
+	char		sql_buf[256]	= { 0 };
 
-	if (argc != 3)
+	if (meterd_db_query_int(ctx->db, "PRAGMA page_size;", &page_size) != MRV_OK)
 	{
-		ERROR_MSG("Invalid database format detected");
+		ERROR_MSG("Failed to retrieve the page size of the database (%s)", sqlite3_errmsg(ctx->db));
+
+		return MRV_DB_ERROR;
 	}
 
-	new_result = (db_res_ctr*) malloc(sizeof(db_res_ctr));
+	ctx->page_size = (int) page_size;
 
-	new_result->timestamp = atoi(argv[0]);
-	new_result->value = strtold(argv[1], NULL);
-	new_result->unit = strdup(argv[2]);
+	snprintf(sql_buf, 256, "PRAGMA journal_size_limit=%lld;", size_limit);
 
-	LL_APPEND(*results, new_result);
+	if (meterd_db_query_int(ctx->db, sql_buf, &page_size) != MRV_OK)
+	{
+		WARNING_MSG("Failed to limit the size of the WAL (%s)", sqlite3_errmsg(ctx->db));
+	}
 
-	nresults++;
+	/* This replaces the automatic checkpoints, which use the same hook */
+	sqlite3_wal_hook(ctx->db, meterd_db_wal_hook, ctx);
 
-	return 0;
+	return MRV_OK;
 }
 
-/* Retrieve results from the database */
-meterd_rv meterd_db_get_results(void* db_handle, const char* id, long double invert, db_res_ctr** results, int select_from, int skip_time)
+/* Get the size of the WAL in bytes as of the last commit on a database with manual checkpoints; may be called from any thread */
+long long meterd_db_wal_size(void* db_handle)
 {
-	assert(id != NULL);
 	assert(db_handle != NULL);
-	assert(results != NULL);
 
-	char* 	sql		= NULL;
-	char* 	errmsg		= NULL;
-	char	sql_buf[4096]	= { 0 };
-	char*	table_name	= NULL;
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) db_handle;
 
-	DEBUG_MSG("Retrieving data for ID %s", id);
+	return (long long) __atomic_load_n(&ctx->wal_pages, __ATOMIC_RELAXED) * ctx->page_size;
+}
 
-	/* First, find the counter in the configuration table of the database */
-	sql = "SELECT table_name FROM CONFIGURATION WHERE id='%s';";
+/* Copy as much of the WAL into the database as possible without waiting for readers or writers */
+meterd_rv meterd_db_checkpoint(void* db_handle, long long* wal_size, long long* checkpointed)
+{
+	assert(db_handle != NULL);
+	assert(wal_size != NULL);
+	assert(checkpointed != NULL);
 
-	snprintf(sql_buf, 4096, sql, id);
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	sqlite3_int64	page_size	= 0;
+	int		log_pages	= 0;
+	int		done_pages	= 0;
+	int		rc		= SQLITE_OK;
 
-	if (sqlite3_exec((sqlite3*) db_handle, sql_buf, meterd_db_get_config_cb, (void*) &table_name, &errmsg) != SQLITE_OK)
+	*wal_size	= 0;
+	*checkpointed	= 0;
+
+	if ((rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_pages, &done_pages)) != SQLITE_OK)
 	{
-		ERROR_MSG("Failed to retrieve table name for ID %s from the database (%s)", id, errmsg);
+		if (rc == SQLITE_BUSY)
+		{
+			return MRV_DB_BUSY;
+		}
 
-		sqlite3_free(errmsg);
+		ERROR_MSG("Failed to checkpoint the database (%s)", sqlite3_errmsg(db));
 
 		return MRV_DB_ERROR;
 	}
 
-	DEBUG_MSG("Data for ID %s is in table %s", id, table_name);
+	if ((log_pages > 0) && (meterd_db_query_int(db, "PRAGMA page_size;", &page_size) == MRV_OK))
+	{
+		*wal_size	= (long long) log_pages * page_size;
+		*checkpointed	= (long long) done_pages * page_size;
+	}
+
+	return MRV_OK;
+}
+
+/* Check if the specified table has the specified column */
+static int meterd_db_has_column(sqlite3* db, const char* table_name, const char* column)
+{
+	sqlite3_stmt*	stmt		= NULL;
+	char		sql_buf[4096]	= { 0 };
 
-	if (skip_time == 0)
+	snprintf(sql_buf, 4096, "SELECT %s FROM %s LIMIT 0;", column, table_name);
+
+	if (sqlite3_prepare_v2(db, sql_buf, -1, &stmt, NULL) != SQLITE_OK)
 	{
-		/* Now, select the data for the specified interval */
-		sql = "SELECT * FROM %s WHERE timestamp >= %d;";
-	
-		snprintf(sql_buf, 4096, sql, table_name, select_from);
-	
-		if (sqlite3_exec((sqlite3*) db_handle, sql_buf, meterd_db_get_results_cb, (void*) results, &errmsg) != SQLITE_OK)
+		return 0;
+	}
+
+	sqlite3_finalize(stmt);
+
+	return 1;
+}
+
+/* Get the columns that both specified data or aggregate tables have, for copying rows between them */
+static const char* meterd_db_shared_columns(sqlite3* db, const char* src_name, const char* dst_name, int is_data)
+{
+	if (is_data)
+	{
+		if (meterd_db_has_column(db, src_name, "unit") && meterd_db_has_column(db, dst_name, "unit"))
 		{
-			ERROR_MSG("Failed to retrieve results from table %s (%s)", table_name, errmsg);
-	
-			sqlite3_free(errmsg);
-	
-			free(table_name);
-	
-			return MRV_DB_ERROR;
+			return "timestamp, value, unit";
 		}
+
+		return "timestamp, value";
 	}
-	else
+
+	if (meterd_db_has_column(db, src_name, "twa") && meterd_db_has_column(db, dst_name, "twa"))
 	{
-		int	timestamp	= select_from;
+		return "timestamp, count, sum, min, max, first, last, duration, twa";
+	}
 
-		sql = "SELECT * FROM %s WHERE timestamp >= %d LIMIT 1;";
+	return "timestamp, count, sum, min, max, first, last";
+}
 
-		do
-		{
-			snprintf(sql_buf, 4096, sql, table_name, timestamp);
+/* Append the names of the tables of the specified type (-1 for all tables except aggregates) to the list */
+static meterd_rv meterd_db_get_tables(sqlite3* db, int type, char*** tables, int* table_count)
+{
+	sqlite3_stmt*	stmt		= NULL;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[256]	= { 0 };
 
-			nresults = 0;
+	snprintf(sql_buf, 256, "SELECT table_name FROM CONFIGURATION WHERE (?1 < 0 AND type NOT IN (%d,%d,%d)) OR type = ?1;", COUNTER_TYPE_DAILY, COUNTER_TYPE_MONTHLY, COUNTER_TYPE_WINDOW);
 
-			if (sqlite3_exec((sqlite3*) db_handle, sql_buf, meterd_db_get_results_cb, (void*) results, &errmsg) != SQLITE_OK)
-			{
-				ERROR_MSG("Failed to retrieve results from table %s (%s)", table_name, errmsg);
+	if (sqlite3_prepare_v2(db, sql_buf, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to read the configuration table (%s)", sqlite3_errmsg(db));
 
-				sqlite3_free(errmsg);
+		return MRV_DB_ERROR;
+	}
 
-				free(table_name);
+	sqlite3_bind_int(stmt, 1, type);
 
-				return MRV_DB_ERROR;
-			}
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		const char*	table_name	= (const char*) sqlite3_column_text(stmt, 0);
+		char**		new_tables	= NULL;
+
+		if (table_name == NULL) continue;
+
+		new_tables = (char**) realloc(*tables, (*table_count + 1) * sizeof(char*));
+
+		if (new_tables == NULL)
+		{
+			rv = MRV_MEMORY;
 
-			timestamp += skip_time;
+			break;
 		}
-		while (nresults > 0);
+
+		*tables = new_tables;
+		(*tables)[(*table_count)++] = strdup(table_name);
 	}
 
-	/* Apply inversion */
-	if (invert < 0.0f)
-	{
-		db_res_ctr* res_it = NULL;
+	sqlite3_finalize(stmt);
 
-		LL_FOREACH(*results, res_it)
+	if (rv != MRV_OK)
+	{
+		while (*table_count > 0)
 		{
-			res_it->value *= invert;
+			free((*tables)[--(*table_count)]);
 		}
+
+		free(*tables);
+		*tables = NULL;
 	}
 
-	free(table_name);
+	return rv;
+}
 
-	return MRV_OK;
+/* Release a cached statement */
+static void meterd_db_stmt_free(meterd_db_ctx* ctx, meterd_db_stmt* stmt)
+{
+	HASH_DEL(ctx->stmts, stmt);
+
+	sqlite3_finalize(stmt->stmt);
+	free(stmt->table_name);
+	free(stmt);
 }
 
-/* Close the specified database */
-void meterd_db_close(void* db_handle)
+/* Get the cached INSERT statement for the specified data or aggregate table, preparing it on first use */
+static meterd_db_stmt* meterd_db_get_insert(void* db_handle, const char* table_name, int aggregate)
+{
+	meterd_db_ctx*	ctx		= (meterd_db_ctx*) db_handle;
+	meterd_db_stmt*	stmt		= NULL;
+	char		sql_buf[4096]	= { 0 };
+
+	HASH_FIND_STR(ctx->stmts, table_name, stmt);
+
+	if (stmt != NULL)
+	{
+		return stmt;
+	}
+
+	stmt = (meterd_db_stmt*) malloc(sizeof(meterd_db_stmt));
+
+	if (stmt == NULL)
+	{
+		ERROR_MSG("Failed to allocate memory for prepared statement");
+
+		return NULL;
+	}
+
+	stmt->has_unit	= !aggregate && meterd_db_has_column(ctx->db, table_name, "unit");
+	stmt->has_twa	= aggregate && meterd_db_has_column(ctx->db, table_name, "twa");
+	stmt->unit	= -1;
+
+	/* The staging tables have the same columns as the tables they are merged into */
+	if (stmt->has_twa)
+	{
+		snprintf(sql_buf, 4096, "INSERT OR REPLACE INTO %s%s (timestamp, count, sum, min, max, first, last, duration, twa) VALUES (?,?,?,?,?,?,?,?,?);", DB_STAGING_PREFIX(ctx), table_name);
+	}
+	else if (aggregate)
+	{
+		snprintf(sql_buf, 4096, "INSERT OR REPLACE INTO %s%s (timestamp, count, sum, min, max, first, last) VALUES (?,?,?,?,?,?,?);", DB_STAGING_PREFIX(ctx), table_name);
+	}
+	else if (stmt->has_unit)
+	{
+		snprintf(sql_buf, 4096, "INSERT INTO %s%s (timestamp, value, unit) VALUES (?,?,?);", DB_STAGING_PREFIX(ctx), table_name);
+	}
+	else
+	{
+		snprintf(sql_buf, 4096, "INSERT INTO %s%s (timestamp, value) VALUES (?,?);", DB_STAGING_PREFIX(ctx), table_name);
+	}
+
+	if (sqlite3_prepare_v2(ctx->db, sql_buf, -1, &stmt->stmt, NULL) != SQLITE_OK)
+	{
+		WARNING_MSG("Failed to prepare insert statement for table %s (%s)", table_name, sqlite3_errmsg(ctx->db));
+
+		free(stmt);
+
+		return NULL;
+	}
+
+	stmt->table_name = strdup(table_name);
+
+	HASH_ADD_KEYPTR(hh, ctx->stmts, stmt->table_name, strlen(stmt->table_name), stmt);
+
+	return stmt;
+}
+
+/* Store the unit in the configuration table when it is first seen or changes */
+static void meterd_db_update_unit(void* db_handle, meterd_db_stmt* stmt, meterd_unit unit)
+{
+	char	sql_buf[4096]	= { 0 };
+
+	if (stmt->has_unit || (stmt->unit == (int) unit))
+	{
+		return;
+	}
+
+	snprintf(sql_buf, 4096, "UPDATE CONFIGURATION SET unit='%s' WHERE table_name='%s';", meterd_unit_name(unit), stmt->table_name);
+
+	if (sqlite3_exec(DB_SQLITE(db_handle), sql_buf, NULL, 0, NULL) == SQLITE_OK)
+	{
+		stmt->unit = (int) unit;
+	}
+}
+
+/* Record a measurement in the specified table of the specified database */
+meterd_rv meterd_db_record(void* db_handle, const char* table_name, meterd_fixed value, meterd_unit unit, int timestamp)
 {
-	if (db_handle != NULL)
+	assert(db_handle != NULL);
+	assert(table_name != NULL);
+
+	meterd_db_stmt*	stmt	= NULL;
+	int		attempt	= 0;
+	int		step_rv	= SQLITE_OK;
+
+	for (attempt = 0; attempt < 2; attempt++)
 	{
-		sqlite3_close((sqlite3*) db_handle);
+		if ((stmt = meterd_db_get_insert(db_handle, table_name, 0)) == NULL)
+		{
+			return MRV_OK;
+		}
+
+		meterd_db_update_unit(db_handle, stmt, unit);
+
+		step_rv = SQLITE_ERROR;
+
+		if ((sqlite3_bind_int64(stmt->stmt, 1, timestamp) == SQLITE_OK) &&
+		    (sqlite3_bind_double(stmt->stmt, 2, FIXED_TO_DOUBLE(value)) == SQLITE_OK) &&
+		    (!stmt->has_unit || (sqlite3_bind_text(stmt->stmt, 3, meterd_unit_name(unit), -1, SQLITE_STATIC) == SQLITE_OK)))
+		{
+			step_rv = sqlite3_step(stmt->stmt);
+		}
+
+		sqlite3_reset(stmt->stmt);
+		sqlite3_clear_bindings(stmt->stmt);
+
+		if (step_rv == SQLITE_DONE)
+		{
+			return MRV_OK;
+		}
+
+		if (attempt > 0)
+		{
+			WARNING_MSG("Failed to record new measurement in the database (%s)", sqlite3_errmsg(DB_SQLITE(db_handle)));
+		}
+
+		/* The table may have been migrated to a new schema; prepare the statement again */
+		meterd_db_stmt_free((meterd_db_ctx*) db_handle, stmt);
+	}
+
+	return MRV_OK;
+}
+
+/* Determine the calendar day or month (local time) that the specified time falls in */
+void meterd_db_aggregate_period(time_t ts, int type, time_t* start, time_t* end)
+{
+	struct tm	period;
+
+	localtime_r(&ts, &period);
+
+	period.tm_sec	= 0;
+	period.tm_min	= 0;
+	period.tm_hour	= 0;
+	period.tm_isdst	= -1;
+
+	if (type == COUNTER_TYPE_MONTHLY)
+	{
+		period.tm_mday = 1;
+	}
+
+	*start = mktime(&period);
+
+	/* mktime normalises the overflowing field */
+	if (type == COUNTER_TYPE_MONTHLY)
+	{
+		period.tm_mon++;
+	}
+	else
+	{
+		period.tm_mday++;
+	}
+
+	period.tm_hour	= 0;
+	period.tm_isdst	= -1;
+
+	*end = mktime(&period);
+}
+
+/* Determine the window of the specified length that the specified time falls in; windows are aligned to local midnight */
+void meterd_db_window_period(time_t ts, int length, time_t* start, time_t* end)
+{
+	time_t	day_start	= 0;
+	time_t	day_end		= 0;
+
+	meterd_db_aggregate_period(ts, COUNTER_TYPE_DAILY, &day_start, &day_end);
+
+	*start	= day_start + ((ts - day_start) / length) * length;
+	*end	= *start + length;
+
+	/* The last window of a day on which daylight saving time starts is shorter */
+	if (*end > day_end)
+	{
+		*end = day_end;
+	}
+}
+
+/* Load the stored aggregate of the period starting at agg->start; the count is 0 if there is none */
+meterd_rv meterd_db_load_aggregate(void* db_handle, meterd_aggregate* agg)
+{
+	assert(db_handle != NULL);
+	assert(agg != NULL);
+
+	sqlite3_stmt*	stmt		= NULL;
+	char		sql_buf[4096]	= { 0 };
+
+	agg->count	= 0;
+	agg->duration	= 0;
+	agg->weighted	= 0;
+	agg->last_ts	= 0;
+
+	snprintf(sql_buf, 4096, "SELECT count, sum, min, max, first, last%s FROM %s WHERE timestamp = %lld;", (agg->length > 0) ? ", duration, twa" : "", agg->table_name, (long long) agg->start);
+
+	if (sqlite3_prepare_v2(DB_SQLITE(db_handle), sql_buf, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		WARNING_MSG("Failed to read aggregate from table %s (%s)", agg->table_name, sqlite3_errmsg(DB_SQLITE(db_handle)));
+
+		return MRV_DB_ERROR;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		agg->count	= (size_t) sqlite3_column_int64(stmt, 0);
+		agg->sum	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 1));
+		agg->min	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 2));
+		agg->max	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 3));
+		agg->first	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 4));
+		agg->last	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 5));
+
+		if (agg->length > 0)
+		{
+			agg->duration	= (time_t) sqlite3_column_int64(stmt, 6);
+			agg->weighted	= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 7) * (double) agg->duration);
+		}
+	}
+
+	sqlite3_finalize(stmt);
+
+	return MRV_OK;
+}
+
+/* Bind the duration and time-weighted average of a window; the average is NULL if no value applied for long enough */
+static int meterd_db_bind_twa(sqlite3_stmt* stmt, const meterd_aggregate* agg)
+{
+	if (sqlite3_bind_int64(stmt, 8, agg->duration) != SQLITE_OK)
+	{
+		return 0;
+	}
+
+	if (agg->duration <= 0)
+	{
+		return (sqlite3_bind_null(stmt, 9) == SQLITE_OK);
+	}
+
+	return (sqlite3_bind_double(stmt, 9, FIXED_TO_DOUBLE(agg->weighted) / (double) agg->duration) == SQLITE_OK);
+}
+
+/* Store the aggregate of a period, replacing the stored aggregate of that period */
+meterd_rv meterd_db_store_aggregate(void* db_handle, const meterd_aggregate* agg, meterd_unit unit)
+{
+	assert(db_handle != NULL);
+	assert(agg != NULL);
+
+	meterd_db_stmt*	stmt	= NULL;
+	int		step_rv	= SQLITE_ERROR;
+
+	if ((stmt = meterd_db_get_insert(db_handle, agg->table_name, 1)) == NULL)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	meterd_db_update_unit(db_handle, stmt, unit);
+
+	if ((sqlite3_bind_int64(stmt->stmt, 1, agg->start) == SQLITE_OK) &&
+	    (sqlite3_bind_int64(stmt->stmt, 2, agg->count) == SQLITE_OK) &&
+	    (sqlite3_bind_double(stmt->stmt, 3, FIXED_TO_DOUBLE(agg->sum)) == SQLITE_OK) &&
+	    (sqlite3_bind_double(stmt->stmt, 4, FIXED_TO_DOUBLE(agg->min)) == SQLITE_OK) &&
+	    (sqlite3_bind_double(stmt->stmt, 5, FIXED_TO_DOUBLE(agg->max)) == SQLITE_OK) &&
+	    (sqlite3_bind_double(stmt->stmt, 6, FIXED_TO_DOUBLE(agg->first)) == SQLITE_OK) &&
+	    (sqlite3_bind_double(stmt->stmt, 7, FIXED_TO_DOUBLE(agg->last)) == SQLITE_OK) &&
+	    (!stmt->has_twa || meterd_db_bind_twa(stmt->stmt, agg)))
+	{
+		step_rv = sqlite3_step(stmt->stmt);
+	}
+
+	sqlite3_reset(stmt->stmt);
+	sqlite3_clear_bindings(stmt->stmt);
+
+	if (step_rv != SQLITE_DONE)
+	{
+		WARNING_MSG("Failed to store aggregate in table %s (%s)", agg->table_name, sqlite3_errmsg(DB_SQLITE(db_handle)));
+
+		return MRV_DB_ERROR;
+	}
+
+	return MRV_OK;
+}
+
+/* Retrieve the most recent value in the specified data table; the timestamp is 0 if there is none */
+meterd_rv meterd_db_last_value(void* db_handle, const char* table_name, meterd_fixed* value, time_t* timestamp)
+{
+	assert(db_handle != NULL);
+	assert(table_name != NULL);
+	assert(value != NULL);
+	assert(timestamp != NULL);
+
+	sqlite3_stmt*	stmt		= NULL;
+	char		sql_buf[4096]	= { 0 };
+
+	*value		= 0;
+	*timestamp	= 0;
+
+	snprintf(sql_buf, 4096, "SELECT timestamp, value FROM %s ORDER BY timestamp DESC, rowid DESC LIMIT 1;", table_name);
+
+	if (sqlite3_prepare_v2(DB_SQLITE(db_handle), sql_buf, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		WARNING_MSG("Failed to read the last value from table %s (%s)", table_name, sqlite3_errmsg(DB_SQLITE(db_handle)));
+
+		return MRV_DB_ERROR;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		*timestamp	= (time_t) sqlite3_column_int64(stmt, 0);
+		*value		= FIXED_FROM_DOUBLE(sqlite3_column_double(stmt, 1));
+	}
+
+	sqlite3_finalize(stmt);
+
+	return MRV_OK;
+}
+
+/* Check if the specified table exists */
+int meterd_db_has_table(void* db_handle, const char* table_name)
+{
+	assert(db_handle != NULL);
+	assert(table_name != NULL);
+
+	sqlite3_int64	exists		= 0;
+	char		sql_buf[4096]	= { 0 };
+
+	snprintf(sql_buf, 4096, "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='%s';", table_name);
+
+	return (meterd_db_query_int(DB_SQLITE(db_handle), sql_buf, &exists) == MRV_OK) && exists;
+}
+
+/*
+ * Rebuild a data table to the current schema (without a unit column and
+ * with a timestamp index); rows are copied in chunks so the lock on the
+ * database is only held briefly, and rows written by the daemon in the
+ * mean time are picked up in the final swap
+ */
+static meterd_rv meterd_db_migrate_table(sqlite3* db, const char* table_name, int chunk_size)
+{
+	char		sql_buf[4096]	= { 0 };
+	sqlite3_int64	exists		= 0;
+	sqlite3_int64	max_rowid	= 0;
+	sqlite3_int64	copied		= 0;
+	int		has_unit	= 0;
+	char		unit_buf[1024]	= { 0 };
+
+	/* Check if the table exists and was not migrated before */
+	snprintf(sql_buf, 4096, "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='%s';", table_name);
+
+	if ((meterd_db_query_int(db, sql_buf, &exists) != MRV_OK) || !exists)
+	{
+		WARNING_MSG("Table %s does not exist, skipping", table_name);
+
+		return MRV_OK;
+	}
+
+	snprintf(sql_buf, 4096, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND tbl_name='%s' AND name='%s_TS';", table_name, table_name);
+
+	has_unit = meterd_db_has_column(db, table_name, "unit");
+
+	if ((meterd_db_query_int(db, sql_buf, &exists) == MRV_OK) && exists && !has_unit)
+	{
+		INFO_MSG("Table %s is up to date", table_name);
+
+		return MRV_OK;
+	}
+
+	INFO_MSG("Migrating table %s", table_name);
+
+	/*
+	 * Create the new table; a left-over from an interrupted migration is
+	 * discarded. The index of the old table is dropped, so the index of
+	 * the new table can take over its name.
+	 */
+	snprintf(sql_buf, 4096, "DROP TABLE IF EXISTS %s_MIGRATE;" \
+				"DROP INDEX IF EXISTS %s_TS;" \
+				"CREATE TABLE %s_MIGRATE " DB_DATA_COLUMNS ";" \
+				"CREATE INDEX %s_TS ON %s_MIGRATE (timestamp);", table_name, table_name, table_name, table_name, table_name);
+
+	if (meterd_db_exec(db, sql_buf) != MRV_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	/* Copy the existing rows in chunks */
+	snprintf(sql_buf, 4096, "SELECT IFNULL(MAX(rowid), 0) FROM %s;", table_name);
+
+	while ((meterd_db_query_int(db, sql_buf, &max_rowid) == MRV_OK) && (copied < max_rowid))
+	{
+		char		copy_buf[4096]	= { 0 };
+		sqlite3_int64	copy_to		= copied + chunk_size;
+
+		/* Never copy beyond the rows seen, these are picked up in the final swap */
+		if (copy_to > max_rowid)
+		{
+			copy_to = max_rowid;
+		}
+
+		snprintf(copy_buf, 4096, "INSERT INTO %s_MIGRATE (timestamp, value) SELECT timestamp, value FROM %s WHERE rowid > %lld AND rowid <= %lld ORDER BY rowid;",
+			table_name, table_name, (long long) copied, (long long) copy_to);
+
+		if (meterd_db_exec(db, copy_buf) != MRV_OK)
+		{
+			return MRV_DB_ERROR;
+		}
+
+		copied = copy_to;
+
+		DEBUG_MSG("Copied rows up to %lld of %lld from %s", (long long) copied, (long long) max_rowid, table_name);
+
+		/* Give writers a chance to get the lock */
+		usleep(10000);
+	}
+
+	/* Keep the unit of the most recent row in the configuration table */
+	if (has_unit)
+	{
+		snprintf(unit_buf, 1024, "UPDATE CONFIGURATION SET unit=(SELECT unit FROM %s ORDER BY rowid DESC LIMIT 1) WHERE table_name='%s' AND unit IS NULL;", table_name, table_name);
+	}
+
+	/* Copy the remaining rows and swap the tables */
+	snprintf(sql_buf, 4096, "BEGIN IMMEDIATE;" \
+				"INSERT INTO %s_MIGRATE (timestamp, value) SELECT timestamp, value FROM %s WHERE rowid > %lld ORDER BY rowid;" \
+				"%s" \
+				"DROP TABLE %s;" \
+				"ALTER TABLE %s_MIGRATE RENAME TO %s;" \
+				"COMMIT;", table_name, table_name, (long long) copied, unit_buf, table_name, table_name, table_name);
+
+	if (meterd_db_exec(db, sql_buf) != MRV_OK)
+	{
+		sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL);
+
+		return MRV_DB_ERROR;
+	}
+
+	INFO_MSG("Finished migrating table %s", table_name);
+
+	return MRV_OK;
+}
+
+/* Migrate the data tables of the specified database to the current schema */
+meterd_rv meterd_db_migrate(void* db_handle, int chunk_size)
+{
+	assert(db_handle != NULL);
+	assert(chunk_size > 0);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		i		= 0;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[4096]	= { 0 };
+
+	/* Schema version 2 keeps the unit in the configuration table */
+	if (!meterd_db_has_column(db, "CONFIGURATION", "unit") &&
+	    (meterd_db_exec(db, "ALTER TABLE CONFIGURATION ADD COLUMN unit VARCHAR(16);") != MRV_OK))
+	{
+		return MRV_DB_ERROR;
+	}
+
+	/* Collect the table names first, the statement cannot stay open while migrating */
+	if ((rv = meterd_db_get_tables(db, -1, &tables, &table_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	/* Wait longer for the daemon to release its lock than during normal operation */
+	sqlite3_busy_timeout(db, DB_MIGRATE_TIMEOUT);
+
+	for (i = 0; i < table_count; i++)
+	{
+		if ((rv == MRV_OK) && (tables[i] != NULL))
+		{
+			rv = meterd_db_migrate_table(db, tables[i], chunk_size);
+		}
+
+		free(tables[i]);
+	}
+
+	free(tables);
+
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+	if (rv == MRV_OK)
+	{
+		snprintf(sql_buf, 4096, "PRAGMA user_version=%d;", DB_SCHEMA_VERSION);
+
+		rv = meterd_db_exec(db, sql_buf);
+	}
+
+	return rv;
+}
+
+/* Fill an aggregate table from the values in the specified data table, one month at a time */
+static meterd_rv meterd_db_fill_aggregate(sqlite3* db, const char* table_name, const char* agg_table, int type, int length)
+{
+	char		sql_buf[4096]	= { 0 };
+	char		period[512]	= { 0 };
+	sqlite3_int64	first_ts	= 0;
+	sqlite3_int64	last_ts		= 0;
+	time_t		start		= 0;
+	time_t		end		= 0;
+	time_t		next		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	snprintf(sql_buf, 4096, "SELECT IFNULL(MIN(timestamp), 0) FROM %s;", table_name);
+
+	if (meterd_db_query_int(db, sql_buf, &first_ts) != MRV_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	snprintf(sql_buf, 4096, "SELECT IFNULL(MAX(timestamp), 0) FROM %s;", table_name);
+
+	if ((meterd_db_query_int(db, sql_buf, &last_ts) != MRV_OK) || (first_ts == 0))
+	{
+		return MRV_OK;
+	}
+
+	/* Periods are calendar days or months in local time, or windows from the start of the day, as in meterd_db_aggregate_period */
+	if (type == COUNTER_TYPE_WINDOW)
+	{
+		snprintf(period, 512, "(day + ((timestamp - day) / %d) * %d)", length, length);
+	}
+	else
+	{
+		snprintf(period, 512, "CAST(strftime('%%s', timestamp, 'unixepoch', 'localtime', '%s', 'utc') AS INTEGER)", (type == COUNTER_TYPE_MONTHLY) ? "start of month" : "start of day");
+	}
+
+	meterd_db_aggregate_period((time_t) first_ts, COUNTER_TYPE_MONTHLY, &start, &end);
+
+	while ((rv == MRV_OK) && (start <= (time_t) last_ts))
+	{
+		snprintf(sql_buf, 4096, "INSERT OR REPLACE INTO %s (timestamp, count, sum, min, max, first, last) " \
+					"SELECT period, cnt, total, lowest, highest," \
+					"(SELECT value FROM %s WHERE timestamp = first_ts ORDER BY rowid LIMIT 1)," \
+					"(SELECT value FROM %s WHERE timestamp = last_ts ORDER BY rowid DESC LIMIT 1) " \
+					"FROM (SELECT %s AS period," \
+					"COUNT(*) AS cnt, SUM(value) AS total, MIN(value) AS lowest, MAX(value) AS highest," \
+					"MIN(timestamp) AS first_ts, MAX(timestamp) AS last_ts " \
+					"FROM (SELECT *, CAST(strftime('%%s', timestamp, 'unixepoch', 'localtime', 'start of day', 'utc') AS INTEGER) AS day FROM %s) " \
+					"WHERE timestamp >= %lld AND timestamp < %lld GROUP BY period);",
+					agg_table, table_name, table_name, period,
+					table_name, (long long) start, (long long) end);
+
+		rv = meterd_db_exec(db, sql_buf);
+
+		/* Give writers a chance to get the lock */
+		usleep(10000);
+
+		meterd_db_aggregate_period(end, COUNTER_TYPE_MONTHLY, &start, &next);
+
+		end = next;
+	}
+
+	return rv;
+}
+
+/*
+ * Add daily and monthly aggregate tables for the raw and cumulative
+ * counters in the specified database that do not have them yet, and
+ * fill them from the values recorded so far
+ */
+meterd_rv meterd_db_add_aggregates(void* db_handle)
+{
+	assert(db_handle != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	const int	agg_types[2]	= { COUNTER_TYPE_DAILY, COUNTER_TYPE_MONTHLY };
+	const char*	agg_prefix[2]	= { TABLE_PREFIX_DAILY, TABLE_PREFIX_MONTHLY };
+	const char*	agg_suffix[2]	= { ID_SUFFIX_DAILY, ID_SUFFIX_MONTHLY };
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		i		= 0;
+	int		j		= 0;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[4096]	= { 0 };
+	char		agg_table[512]	= { 0 };
+
+	/* Collect the raw and cumulative data tables; average values are not aggregated */
+	if (((rv = meterd_db_get_tables(db, COUNTER_TYPE_RAW, &tables, &table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_CONSUMED, &tables, &table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_PRODUCED, &tables, &table_count)) != MRV_OK))
+	{
+		return rv;
+	}
+
+	sqlite3_busy_timeout(db, DB_MIGRATE_TIMEOUT);
+
+	for (i = 0; i < table_count; i++)
+	{
+		for (j = 0; (j < 2) && (rv == MRV_OK) && (tables[i] != NULL) && (strchr(tables[i], '_') != NULL); j++)
+		{
+			snprintf(agg_table, 512, "%s%s", agg_prefix[j], strchr(tables[i], '_') + 1);
+
+			if (meterd_db_has_table(db_handle, agg_table))
+			{
+				continue;
+			}
+
+			INFO_MSG("Adding aggregate table %s for %s", agg_table, tables[i]);
+
+			/* The ID of the aggregate is that of the counter plus a suffix */
+			snprintf(sql_buf, 4096, "BEGIN IMMEDIATE;" \
+						"INSERT INTO CONFIGURATION (id, description, type, table_name, unit) " \
+						"SELECT id || '%s', description, %d, '%s', unit FROM CONFIGURATION WHERE table_name='%s';" \
+						"CREATE TABLE %s " DB_AGGREGATE_COLUMNS ";" \
+						"COMMIT;", agg_suffix[j], agg_types[j], agg_table, tables[i], agg_table);
+
+			if ((rv = meterd_db_exec(db, sql_buf)) != MRV_OK)
+			{
+				sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL);
+
+				break;
+			}
+
+			rv = meterd_db_fill_aggregate(db, tables[i], agg_table, agg_types[j], 0);
+		}
+
+		free(tables[i]);
+	}
+
+	free(tables);
+
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+	return rv;
+}
+
+/*
+ * Add tables for the aggregates over the window of the specified length for
+ * the raw and cumulative counters in the specified database that do not have
+ * them yet, and fill them from the values recorded so far; the time-weighted
+ * average is only kept for values recorded after this
+ */
+meterd_rv meterd_db_add_window(void* db_handle, int length, const char* id_suffix)
+{
+	assert(db_handle != NULL);
+	assert(length > 0);
+	assert(id_suffix != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		i		= 0;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[4096]	= { 0 };
+	char		agg_table[512]	= { 0 };
+
+	if (((rv = meterd_db_get_tables(db, COUNTER_TYPE_RAW, &tables, &table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_CONSUMED, &tables, &table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_PRODUCED, &tables, &table_count)) != MRV_OK))
+	{
+		return rv;
+	}
+
+	sqlite3_busy_timeout(db, DB_MIGRATE_TIMEOUT);
+
+	for (i = 0; i < table_count; i++)
+	{
+		if ((rv == MRV_OK) && (tables[i] != NULL) && (strchr(tables[i], '_') != NULL))
+		{
+			snprintf(agg_table, 512, "%s%d_%s", TABLE_PREFIX_WINDOW, length, strchr(tables[i], '_') + 1);
+
+			if (!meterd_db_has_table(db_handle, agg_table))
+			{
+				INFO_MSG("Adding window table %s for %s", agg_table, tables[i]);
+
+				snprintf(sql_buf, 4096, "BEGIN IMMEDIATE;" \
+							"INSERT INTO CONFIGURATION (id, description, type, table_name, unit) " \
+							"SELECT id || '%s', description, %d, '%s', unit FROM CONFIGURATION WHERE table_name='%s';" \
+							"CREATE TABLE %s " DB_WINDOW_COLUMNS ";" \
+							"COMMIT;", id_suffix, COUNTER_TYPE_WINDOW, agg_table, tables[i], agg_table);
+
+				if ((rv = meterd_db_exec(db, sql_buf)) != MRV_OK)
+				{
+					sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL);
+				}
+				else
+				{
+					rv = meterd_db_fill_aggregate(db, tables[i], agg_table, COUNTER_TYPE_WINDOW, length);
+				}
+			}
+		}
+
+		free(tables[i]);
+	}
+
+	free(tables);
+
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+	return rv;
+}
+
+/*
+ * Fill a delta table from the values in the specified cumulative table, one
+ * month at a time; a value lower than the one before it means the register
+ * was reset, and the value itself is then the amount since the reset
+ */
+static meterd_rv meterd_db_fill_delta(sqlite3* db, const char* table_name, const char* delta_table)
+{
+	char		sql_buf[4096]	= { 0 };
+	sqlite3_int64	first_ts	= 0;
+	sqlite3_int64	last_ts		= 0;
+	time_t		start		= 0;
+	time_t		end		= 0;
+	time_t		next		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	snprintf(sql_buf, 4096, "SELECT IFNULL(MIN(timestamp), 0) FROM %s;", table_name);
+
+	if (meterd_db_query_int(db, sql_buf, &first_ts) != MRV_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	snprintf(sql_buf, 4096, "SELECT IFNULL(MAX(timestamp), 0) FROM %s;", table_name);
+
+	if ((meterd_db_query_int(db, sql_buf, &last_ts) != MRV_OK) || (first_ts == 0))
+	{
+		return MRV_OK;
+	}
+
+	meterd_db_aggregate_period((time_t) first_ts, COUNTER_TYPE_MONTHLY, &start, &end);
+
+	while ((rv == MRV_OK) && (start <= (time_t) last_ts))
+	{
+		/* The first value has no predecessor and therefore no delta */
+		snprintf(sql_buf, 4096, "INSERT INTO %s (timestamp, value) " \
+					"SELECT timestamp, CASE WHEN value >= prev THEN ROUND(value - prev, 3) ELSE value END " \
+					"FROM (SELECT c.timestamp AS timestamp, c.value AS value," \
+					"(SELECT p.value FROM %s AS p WHERE p.timestamp < c.timestamp ORDER BY p.timestamp DESC LIMIT 1) AS prev " \
+					"FROM %s AS c WHERE c.timestamp >= %lld AND c.timestamp < %lld) " \
+					"WHERE prev IS NOT NULL ORDER BY timestamp;",
+					delta_table, table_name, table_name, (long long) start, (long long) end);
+
+		rv = meterd_db_exec(db, sql_buf);
+
+		/* Give writers a chance to get the lock */
+		usleep(10000);
+
+		meterd_db_aggregate_period(end, COUNTER_TYPE_MONTHLY, &start, &next);
+
+		end = next;
+	}
+
+	return rv;
+}
+
+/*
+ * Add delta tables for the cumulative counters in the specified database
+ * that do not have them yet, and fill them from the values recorded so far
+ */
+meterd_rv meterd_db_add_deltas(void* db_handle)
+{
+	assert(db_handle != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		i		= 0;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[4096]	= { 0 };
+	char		delta_table[512] = { 0 };
+
+	if (((rv = meterd_db_get_tables(db, COUNTER_TYPE_CONSUMED, &tables, &table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_PRODUCED, &tables, &table_count)) != MRV_OK))
+	{
+		return rv;
+	}
+
+	sqlite3_busy_timeout(db, DB_MIGRATE_TIMEOUT);
+
+	for (i = 0; i < table_count; i++)
+	{
+		if ((rv == MRV_OK) && (tables[i] != NULL) && (strchr(tables[i], '_') != NULL))
+		{
+			snprintf(delta_table, 512, "%s%s", TABLE_PREFIX_DELTA, strchr(tables[i], '_') + 1);
+
+			if (!meterd_db_has_table(db_handle, delta_table))
+			{
+				INFO_MSG("Adding delta table %s for %s", delta_table, tables[i]);
+
+				snprintf(sql_buf, 4096, "BEGIN IMMEDIATE;" \
+							"INSERT INTO CONFIGURATION (id, description, type, table_name, unit) " \
+							"SELECT id || '%s', description, %d, '%s', unit FROM CONFIGURATION WHERE table_name='%s';" \
+							"CREATE TABLE %s " DB_DATA_COLUMNS ";" \
+							"CREATE INDEX %s_TS ON %s (timestamp);" \
+							"COMMIT;", ID_SUFFIX_DELTA, COUNTER_TYPE_DELTA, delta_table, tables[i], delta_table, delta_table, delta_table);
+
+				if ((rv = meterd_db_exec(db, sql_buf)) != MRV_OK)
+				{
+					sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL);
+				}
+				else
+				{
+					rv = meterd_db_fill_delta(db, tables[i], delta_table);
+				}
+			}
+		}
+
+		free(tables[i]);
+	}
+
+	free(tables);
+
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+	return rv;
+}
+
+/*
+ * Import the data of a database in the legacy layout (one database per
+ * resolution) into a database in the single database layout; counters are
+ * matched on their ID plus the specified suffix, and only values older
+ * than the data already in the destination table are imported
+ */
+meterd_rv meterd_db_import(void* db_handle, const char* legacy_db_name, const char* id_suffix)
+{
+	assert(db_handle != NULL);
+	assert(legacy_db_name != NULL);
+	assert(id_suffix != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	sqlite3_stmt*	stmt		= NULL;
+	char		sql_buf[4096]	= { 0 };
+	char		unit_buf[1024]	= { 0 };
+	char*		errmsg		= NULL;
+	int		legacy_unit	= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	snprintf(sql_buf, 4096, "ATTACH DATABASE '%s' AS legacy;", legacy_db_name);
+
+	if (sqlite3_exec(db, sql_buf, NULL, 0, &errmsg) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to attach database %s (%s)", legacy_db_name, errmsg);
+
+		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
+	}
+
+	/* Databases created before schema version 2 do not keep the unit in the configuration table */
+	legacy_unit = meterd_db_has_column(db, "legacy.CONFIGURATION", "unit");
+
+	snprintf(sql_buf, 4096, "SELECT l.id, l.table_name, m.table_name FROM legacy.CONFIGURATION AS l LEFT JOIN main.CONFIGURATION AS m ON m.id = l.id || '%s';", id_suffix);
+
+	if ((sqlite3_prepare_v2(db, sql_buf, -1, &stmt, NULL) != SQLITE_OK) ||
+	    (meterd_db_exec(db, "BEGIN IMMEDIATE;") != MRV_OK))
+	{
+		ERROR_MSG("Failed to read the configuration table of %s (%s)", legacy_db_name, sqlite3_errmsg(db));
+
+		sqlite3_finalize(stmt);
+		sqlite3_exec(db, "DETACH DATABASE legacy;", NULL, 0, NULL);
+
+		return MRV_DB_ERROR;
+	}
+
+	while ((rv == MRV_OK) && (sqlite3_step(stmt) == SQLITE_ROW))
+	{
+		const char*	id		= (const char*) sqlite3_column_text(stmt, 0);
+		const char*	src_table	= (const char*) sqlite3_column_text(stmt, 1);
+		const char*	dst_table	= (const char*) sqlite3_column_text(stmt, 2);
+		const char*	columns		= NULL;
+		char		src_name[512]	= { 0 };
+		char		dst_name[512]	= { 0 };
+
+		if ((id == NULL) || (src_table == NULL)) continue;
+
+		snprintf(src_name, 512, "legacy.%s", src_table);
+		snprintf(dst_name, 512, "main.%s", (dst_table != NULL) ? dst_table : "");
+
+		/* Aggregates of periods that are already in the destination table are kept */
+		if ((dst_table != NULL) && meterd_db_has_column(db, src_name, "count") && meterd_db_has_column(db, dst_name, "count"))
+		{
+			INFO_MSG("Importing %s from %s into %s", src_table, legacy_db_name, dst_table);
+
+			columns = meterd_db_shared_columns(db, src_name, dst_name, 0);
+
+			snprintf(sql_buf, 4096, "INSERT OR IGNORE INTO %s (%s) SELECT %s FROM %s;" \
+						"UPDATE main.CONFIGURATION SET unit=(SELECT unit FROM legacy.CONFIGURATION WHERE table_name='%s') WHERE table_name='%s' AND unit IS NULL;",
+						dst_name, columns, columns, src_name, src_table, dst_table);
+
+			if (meterd_db_exec(db, sql_buf) != MRV_OK)
+			{
+				rv = MRV_DB_ERROR;
+			}
+
+			continue;
+		}
+
+		if ((dst_table == NULL) || !meterd_db_has_column(db, src_name, "value") || !meterd_db_has_column(db, dst_name, "value"))
+		{
+			WARNING_MSG("No table for counter %s%s in the single database or no data for it in %s, skipping", id, id_suffix, legacy_db_name);
+
+			continue;
+		}
+
+		INFO_MSG("Importing %s from %s into %s", src_table, legacy_db_name, dst_table);
+
+		/* Copy values and keep the unit if it is not known yet */
+		if (legacy_unit)
+		{
+			snprintf(unit_buf, 1024, "SELECT unit FROM legacy.CONFIGURATION WHERE table_name='%s'", src_table);
+		}
+		else
+		{
+			snprintf(unit_buf, 1024, "SELECT unit FROM %s ORDER BY rowid DESC LIMIT 1", src_name);
+		}
+
+		snprintf(sql_buf, 4096, "INSERT INTO %s (timestamp, value) SELECT timestamp, value FROM %s " \
+					"WHERE timestamp < IFNULL((SELECT MIN(timestamp) FROM %s), 2147483647) ORDER BY rowid;" \
+					"UPDATE main.CONFIGURATION SET unit=(%s) WHERE table_name='%s' AND unit IS NULL;",
+					dst_name, src_name, dst_name, unit_buf, dst_table);
+
+		if (meterd_db_exec(db, sql_buf) != MRV_OK)
+		{
+			rv = MRV_DB_ERROR;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (rv == MRV_OK)
+	{
+		rv = meterd_db_exec(db, "COMMIT;");
+	}
+	else
+	{
+		sqlite3_exec(db, "ROLLBACK;", NULL, 0, NULL);
+	}
+
+	sqlite3_exec(db, "DETACH DATABASE legacy;", NULL, 0, NULL);
+
+	return rv;
+}
+
+/*
+ * Delete at most batch_size rows older than the specified timestamp from
+ * each data table of the specified type (-1 for all types); every batch is
+ * committed on its own so writers are never blocked for long
+ */
+meterd_rv meterd_db_expire(void* db_handle, int type, int before, int batch_size, int* deleted)
+{
+	assert(db_handle != NULL);
+	assert(batch_size > 0);
+	assert(deleted != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		i		= 0;
+	int		sqlite_rv	= SQLITE_OK;
+	meterd_rv	rv		= MRV_OK;
+	char		sql_buf[4096]	= { 0 };
+
+	*deleted = 0;
+
+	if ((rv = meterd_db_get_tables(db, type, &tables, &table_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	for (i = 0; i < table_count; i++)
+	{
+		if ((rv == MRV_OK) && (tables[i] != NULL))
+		{
+			snprintf(sql_buf, 4096, "DELETE FROM %s WHERE rowid IN (SELECT rowid FROM %s WHERE timestamp < %d LIMIT %d);", tables[i], tables[i], before, batch_size);
+
+			sqlite_rv = sqlite3_exec(db, sql_buf, NULL, 0, NULL);
+
+			if (sqlite_rv == SQLITE_OK)
+			{
+				*deleted += sqlite3_changes(db);
+			}
+			else if (sqlite_rv == SQLITE_BUSY)
+			{
+				/* The database is in use, try again later */
+				rv = MRV_DB_BUSY;
+			}
+			else
+			{
+				ERROR_MSG("Failed to delete expired data from %s (%s)", tables[i], sqlite3_errmsg(db));
+
+				rv = MRV_DB_ERROR;
+			}
+		}
+
+		free(tables[i]);
+	}
+
+	free(tables);
+
+	return rv;
+}
+
+/*
+ * Return at most max_pages free pages to the file system; only possible
+ * if the database was created with incremental auto-vacuum, otherwise
+ * free pages are only reused by SQLite
+ */
+meterd_rv meterd_db_vacuum(void* db_handle, int max_pages, long long* reclaimed)
+{
+	assert(db_handle != NULL);
+	assert(reclaimed != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	sqlite3_int64	auto_vacuum	= 0;
+	sqlite3_int64	page_size	= 0;
+	sqlite3_int64	pages_before	= 0;
+	sqlite3_int64	pages_after	= 0;
+	int		sqlite_rv	= SQLITE_OK;
+	char		sql_buf[256]	= { 0 };
+
+	*reclaimed = 0;
+
+	if ((meterd_db_query_int(db, "PRAGMA auto_vacuum;", &auto_vacuum) != MRV_OK) ||
+	    (meterd_db_query_int(db, "PRAGMA page_size;", &page_size) != MRV_OK) ||
+	    (meterd_db_query_int(db, "PRAGMA page_count;", &pages_before) != MRV_OK))
+	{
+		ERROR_MSG("Failed to query the database layout (%s)", sqlite3_errmsg(db));
+
+		return MRV_DB_ERROR;
+	}
+
+	/* 2 is incremental auto-vacuum */
+	if (auto_vacuum != 2)
+	{
+		return MRV_OK;
+	}
+
+	snprintf(sql_buf, 256, "PRAGMA incremental_vacuum(%d);", max_pages);
+
+	if ((sqlite_rv = sqlite3_exec(db, sql_buf, NULL, 0, NULL)) != SQLITE_OK)
+	{
+		if (sqlite_rv == SQLITE_BUSY)
+		{
+			return MRV_DB_BUSY;
+		}
+
+		ERROR_MSG("Failed to vacuum the database (%s)", sqlite3_errmsg(db));
+
+		return MRV_DB_ERROR;
+	}
+
+	if (meterd_db_query_int(db, "PRAGMA page_count;", &pages_after) == MRV_OK)
+	{
+		*reclaimed = (pages_before - pages_after) * page_size;
+	}
+
+	return MRV_OK;
+}
+
+/* Get the file name of the specified database */
+const char* meterd_db_filename(void* db_handle)
+{
+	assert(db_handle != NULL);
+
+	const char*	filename	= sqlite3_db_filename(DB_SQLITE(db_handle), "main");
+
+	return (filename != NULL) ? filename : "";
+}
+
+/* Get the data tables (the first data_count) and aggregate tables of the specified database */
+static meterd_rv meterd_db_get_all_tables(sqlite3* db, char*** tables, int* table_count, int* data_count)
+{
+	meterd_rv	rv	= MRV_OK;
+
+	*tables		= NULL;
+	*table_count	= 0;
+
+	if ((rv = meterd_db_get_tables(db, -1, tables, table_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	*data_count = *table_count;
+
+	if (((rv = meterd_db_get_tables(db, COUNTER_TYPE_DAILY, tables, table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_MONTHLY, tables, table_count)) != MRV_OK) ||
+	    ((rv = meterd_db_get_tables(db, COUNTER_TYPE_WINDOW, tables, table_count)) != MRV_OK))
+	{
+		return rv;
+	}
+
+	return MRV_OK;
+}
+
+/* Release a list of tables */
+static void meterd_db_free_tables(char** tables, int table_count)
+{
+	while (table_count > 0)
+	{
+		free(tables[--table_count]);
+	}
+
+	free(tables);
+}
+
+/* Get the name of the staging database for the specified database in the specified directory */
+char* meterd_db_staging_name(const char* staging_dir, const char* db_name)
+{
+	assert(staging_dir != NULL);
+	assert(db_name != NULL);
+
+	const char*	base		= strrchr(db_name, '/');
+	char*		staging_name	= NULL;
+
+	base = (base != NULL) ? (base + 1) : db_name;
+
+	staging_name = (char*) malloc(strlen(staging_dir) + strlen(base) + 2);
+
+	if (staging_name != NULL)
+	{
+		sprintf(staging_name, "%s/%s", staging_dir, base);
+	}
+
+	return staging_name;
+}
+
+/* Get the columns of the specified staged table that the table in the database also has */
+static const char* meterd_db_staged_columns(sqlite3* db, const char* table_name, int is_data)
+{
+	char	staged_name[4096]	= { 0 };
+	char	main_name[4096]		= { 0 };
+
+	snprintf(staged_name, 4096, "staging.%s", table_name);
+	snprintf(main_name, 4096, "main.%s", table_name);
+
+	/* Tables are migrated to the current schema independently of the staging database */
+	return meterd_db_shared_columns(db, staged_name, main_name, is_data);
+}
+
+/* Write measurements to the specified staging database instead, until they are merged; rows left from a previous run are merged first */
+meterd_rv meterd_db_stage(void* db_handle, const char* staging_name)
+{
+	assert(db_handle != NULL);
+	assert(staging_name != NULL);
+
+	meterd_db_ctx*	ctx		= (meterd_db_ctx*) db_handle;
+	sqlite3*	staging_db	= NULL;
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		data_count	= 0;
+	int		merged		= 0;
+	int		i		= 0;
+	sqlite3_int64	dummy		= 0;
+	char		sql_buf[4096]	= { 0 };
+	meterd_rv	rv		= MRV_OK;
+
+	/* Attached databases are opened with the flags of the database, which do not allow creating it */
+	if (sqlite3_open_v2(staging_name, &staging_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to create staging database %s (%s)", staging_name, sqlite3_errmsg(staging_db));
+
+		sqlite3_close(staging_db);
+
+		return MRV_DB_ERROR;
+	}
+
+	sqlite3_close(staging_db);
+
+	snprintf(sql_buf, 4096, "ATTACH DATABASE '%s' AS staging;", staging_name);
+
+	if (meterd_db_exec(ctx->db, sql_buf) != MRV_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	/* The staging database is expected to be on tmpfs, so there is no point in syncing it */
+	meterd_db_query_int(ctx->db, "PRAGMA staging.journal_mode=WAL;", &dummy);
+	meterd_db_exec(ctx->db, "PRAGMA staging.synchronous=OFF;");
+
+	ctx->staging_name = strdup(staging_name);
+
+	if ((rv = meterd_db_merge(db_handle, &merged)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to merge the rows left in staging database %s", staging_name);
+
+		meterd_db_unstage(db_handle);
+
+		return rv;
+	}
+
+	if (merged > 0)
+	{
+		INFO_MSG("Merged %d row(s) left in staging database %s", merged, staging_name);
+	}
+
+	if ((rv = meterd_db_get_all_tables(ctx->db, &tables, &table_count, &data_count)) != MRV_OK)
+	{
+		meterd_db_unstage(db_handle);
+
+		return rv;
+	}
+
+	/* The staged tables are empty now; recreate them, as the tables in the database may have been migrated since */
+	for (i = 0; i < table_count; i++)
+	{
+		if (i < data_count)
+		{
+			snprintf(sql_buf, 4096, "DROP TABLE IF EXISTS staging.%s;" \
+						"CREATE TABLE staging.%s AS SELECT * FROM main.%s WHERE 0;", tables[i], tables[i], tables[i]);
+		}
+		else if (meterd_db_has_column(ctx->db, tables[i], "twa"))
+		{
+			snprintf(sql_buf, 4096, "DROP TABLE IF EXISTS staging.%s;" \
+						"CREATE TABLE staging.%s " DB_WINDOW_COLUMNS ";", tables[i], tables[i]);
+		}
+		else
+		{
+			snprintf(sql_buf, 4096, "DROP TABLE IF EXISTS staging.%s;" \
+						"CREATE TABLE staging.%s " DB_AGGREGATE_COLUMNS ";", tables[i], tables[i]);
+		}
+
+		/* Tables that are missing from the database cannot be staged either */
+		sqlite3_exec(ctx->db, sql_buf, NULL, 0, NULL);
+	}
+
+	meterd_db_free_tables(tables, table_count);
+
+	return MRV_OK;
+}
+
+/* Move the staged rows into the database in a single transaction; the number of rows moved is returned */
+meterd_rv meterd_db_merge(void* db_handle, int* merged)
+{
+	assert(db_handle != NULL);
+	assert(merged != NULL);
+
+	meterd_db_ctx*	ctx		= (meterd_db_ctx*) db_handle;
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		data_count	= 0;
+	int		i		= 0;
+	int		sqlite_rv	= SQLITE_OK;
+	const char*	columns		= NULL;
+	char		sql_buf[4096]	= { 0 };
+	meterd_rv	rv		= MRV_OK;
+
+	*merged = 0;
+
+	if (ctx->staging_name == NULL)
+	{
+		return MRV_OK;
+	}
+
+	/* Measurements that were batched are merged as well */
+	meterd_db_commit(db_handle);
+
+	if ((rv = meterd_db_get_all_tables(ctx->db, &tables, &table_count, &data_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	if ((sqlite_rv = sqlite3_exec(ctx->db, "BEGIN IMMEDIATE;", NULL, 0, NULL)) != SQLITE_OK)
+	{
+		meterd_db_free_tables(tables, table_count);
+
+		return (sqlite_rv == SQLITE_BUSY) ? MRV_DB_BUSY : MRV_DB_ERROR;
+	}
+
+	for (i = 0; (i < table_count) && (rv == MRV_OK); i++)
+	{
+		snprintf(sql_buf, 4096, "staging.%s", tables[i]);
+
+		if (!meterd_db_has_column(ctx->db, sql_buf, "timestamp")) continue;
+
+		columns = meterd_db_staged_columns(ctx->db, tables[i], (i < data_count));
+
+		/* Aggregates of a period replace the ones stored earlier */
+		snprintf(sql_buf, 4096, "INSERT %sINTO main.%s (%s) SELECT %s FROM staging.%s;", (i < data_count) ? "" : "OR REPLACE ", tables[i], columns, columns, tables[i]);
+
+		if ((sqlite_rv = sqlite3_exec(ctx->db, sql_buf, NULL, 0, NULL)) == SQLITE_OK)
+		{
+			*merged += sqlite3_changes(ctx->db);
+
+			snprintf(sql_buf, 4096, "DELETE FROM staging.%s;", tables[i]);
+
+			sqlite_rv = sqlite3_exec(ctx->db, sql_buf, NULL, 0, NULL);
+		}
+
+		if (sqlite_rv != SQLITE_OK)
+		{
+			ERROR_MSG("Failed to merge staged rows into %s (%s)", tables[i], sqlite3_errmsg(ctx->db));
+
+			rv = (sqlite_rv == SQLITE_BUSY) ? MRV_DB_BUSY : MRV_DB_ERROR;
+		}
+	}
+
+	meterd_db_free_tables(tables, table_count);
+
+	if ((rv == MRV_OK) && ((sqlite_rv = sqlite3_exec(ctx->db, "COMMIT;", NULL, 0, NULL)) != SQLITE_OK))
+	{
+		ERROR_MSG("Failed to commit merged rows (%s)", sqlite3_errmsg(ctx->db));
+
+		rv = (sqlite_rv == SQLITE_BUSY) ? MRV_DB_BUSY : MRV_DB_ERROR;
+	}
+
+	if (rv != MRV_OK)
+	{
+		sqlite3_exec(ctx->db, "ROLLBACK;", NULL, 0, NULL);
+
+		*merged = 0;
+	}
+	else if (sqlite3_wal_checkpoint_v2(ctx->db, "staging", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL) != SQLITE_OK)
+	{
+		/* Deleting the staged rows does not shrink the WAL, and there are no automatic checkpoints with manual checkpointing */
+		WARNING_MSG("Failed to truncate the WAL of staging database %s (%s)", ctx->staging_name, sqlite3_errmsg(ctx->db));
+	}
+
+	return rv;
+}
+
+/* Merge the staged rows and write measurements to the database again; the staging database is removed if it is empty */
+meterd_rv meterd_db_unstage(void* db_handle)
+{
+	assert(db_handle != NULL);
+
+	meterd_db_ctx*	ctx		= (meterd_db_ctx*) db_handle;
+	meterd_db_stmt*	stmt_it		= NULL;
+	meterd_db_stmt*	stmt_tmp	= NULL;
+	char		file_buf[4096]	= { 0 };
+	int		merged		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	if (ctx->staging_name == NULL)
+	{
+		return MRV_OK;
+	}
+
+	rv = meterd_db_merge(db_handle, &merged);
+
+	/* The prepared statements write to the staging database */
+	HASH_ITER(hh, ctx->stmts, stmt_it, stmt_tmp)
+	{
+		meterd_db_stmt_free(ctx, stmt_it);
+	}
+
+	meterd_db_exec(ctx->db, "DETACH DATABASE staging;");
+
+	if (rv == MRV_OK)
+	{
+		unlink(ctx->staging_name);
+
+		snprintf(file_buf, 4096, "%s-wal", ctx->staging_name);
+		unlink(file_buf);
+
+		snprintf(file_buf, 4096, "%s-shm", ctx->staging_name);
+		unlink(file_buf);
+	}
+	else
+	{
+		WARNING_MSG("Keeping staging database %s, it will be merged when meterd is started again", ctx->staging_name);
+	}
+
+	free(ctx->staging_name);
+
+	ctx->staging_name = NULL;
+
+	return rv;
+}
+
+/* Show the rows in the specified staging database (if it exists) together with the rows in the database when querying it */
+meterd_rv meterd_db_attach_staging(void* db_handle, const char* staging_name)
+{
+	assert(db_handle != NULL);
+	assert(staging_name != NULL);
+
+	sqlite3*	db		= DB_SQLITE(db_handle);
+	char**		tables		= NULL;
+	int		table_count	= 0;
+	int		data_count	= 0;
+	int		i		= 0;
+	const char*	columns		= NULL;
+	char		sql_buf[4096]	= { 0 };
+	meterd_rv	rv		= MRV_OK;
+
+	/* meterd removes the staging database when it is stopped */
+	if (meterd_db_exists(staging_name) != MRV_OK)
+	{
+		return MRV_OK;
+	}
+
+	snprintf(sql_buf, 4096, "ATTACH DATABASE '%s' AS staging;", staging_name);
+
+	if (meterd_db_exec(db, sql_buf) != MRV_OK)
+	{
+		return MRV_DB_ERROR;
+	}
+
+	if ((rv = meterd_db_get_all_tables(db, &tables, &table_count, &data_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	/* Temporary views take precedence over the tables in the database with the same name */
+	for (i = 0; (i < table_count) && (rv == MRV_OK); i++)
+	{
+		snprintf(sql_buf, 4096, "staging.%s", tables[i]);
+
+		if (!meterd_db_has_column(db, sql_buf, "timestamp")) continue;
+
+		columns = meterd_db_staged_columns(db, tables[i], (i < data_count));
+
+		if (i < data_count)
+		{
+			snprintf(sql_buf, 4096, "CREATE TEMP VIEW %s AS SELECT %s FROM main.%s UNION ALL SELECT %s FROM staging.%s;", tables[i], columns, tables[i], columns, tables[i]);
+		}
+		else
+		{
+			snprintf(sql_buf, 4096, "CREATE TEMP VIEW %s AS SELECT %s FROM main.%s WHERE timestamp NOT IN (SELECT timestamp FROM staging.%s) UNION ALL SELECT %s FROM staging.%s;", tables[i], columns, tables[i], tables[i], columns, tables[i]);
+		}
+
+		rv = meterd_db_exec(db, sql_buf);
+	}
+
+	meterd_db_free_tables(tables, table_count);
+
+	return rv;
+}
+
+static int meterd_db_get_config_cb(void* data, int argc, char* argv[], char* colname[])
+{
+	assert(data != NULL);
+
+	char**	table_name = (char**) data;
+
+	if (argc != 1)
+	{
+		ERROR_MSG("Invalid database format detected");
+
+		return -1;
+	}
+
+	*table_name = strdup(argv[0]);
+
+	return 0;
+}
+
+/* Append a value to a series, growing the arrays if needed */
+static meterd_rv meterd_db_series_append(db_res_series* results, int timestamp, double value)
+{
+	if (results->count == results->capacity)
+	{
+		size_t	new_capacity	= (results->capacity == 0) ? 1024 : (results->capacity * 2);
+		int*	new_timestamps	= (int*) realloc(results->timestamps, new_capacity * sizeof(int));
+		double*	new_values	= NULL;
+
+		if (new_timestamps == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		results->timestamps = new_timestamps;
+
+		new_values = (double*) realloc(results->values, new_capacity * sizeof(double));
+
+		if (new_values == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		results->values		= new_values;
+		results->capacity	= new_capacity;
+	}
+
+	results->timestamps[results->count]	= timestamp;
+	results->values[results->count]		= value;
+	results->count++;
+
+	return MRV_OK;
+}
+
+/* Retrieve results from the database */
+meterd_rv meterd_db_get_results(void* db_handle, const char* id, long double invert, db_res_series* results, int select_from, int skip_time, int sample_mode)
+{
+	assert(id != NULL);
+	assert(db_handle != NULL);
+	assert(results != NULL);
+
+	char* 		sql		= NULL;
+	char* 		errmsg		= NULL;
+	char		sql_buf[4096]	= { 0 };
+	char*		table_name	= NULL;
+	sqlite3_stmt*	stmt		= NULL;
+	int		step_rv		= SQLITE_OK;
+	int		has_unit	= 0;
+	int		is_aggregate	= 0;
+	int		is_window	= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	memset(results, 0, sizeof(db_res_series));
+
+	DEBUG_MSG("Retrieving data for ID %s", id);
+
+	/* First, find the counter in the configuration table of the database */
+	sql = "SELECT table_name FROM CONFIGURATION WHERE id='%s';";
+
+	snprintf(sql_buf, 4096, sql, id);
+
+	if (sqlite3_exec(DB_SQLITE(db_handle), sql_buf, meterd_db_get_config_cb, (void*) &table_name, &errmsg) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to retrieve table name for ID %s from the database (%s)", id, errmsg);
+
+		sqlite3_free(errmsg);
+
+		return MRV_DB_ERROR;
+	}
+
+	/* Databases with one resolution store average values under the plain ID */
+	if ((table_name == NULL) && (strchr(id, '/') != NULL))
+	{
+		snprintf(sql_buf, 4096, "SELECT table_name FROM CONFIGURATION WHERE id='%.*s';", (int) (strchr(id, '/') - id), id);
+
+		if (sqlite3_exec(DB_SQLITE(db_handle), sql_buf, meterd_db_get_config_cb, (void*) &table_name, &errmsg) != SQLITE_OK)
+		{
+			ERROR_MSG("Failed to retrieve table name for ID %s from the database (%s)", id, errmsg);
+
+			sqlite3_free(errmsg);
+
+			return MRV_DB_ERROR;
+		}
+	}
+
+	if (table_name == NULL)
+	{
+		ERROR_MSG("No data for ID %s in the database", id);
+
+		return MRV_DB_ERROR;
+	}
+
+	DEBUG_MSG("Data for ID %s is in table %s", id, table_name);
+
+	/* Tables that have not been migrated to schema version 2 store the unit in each row */
+	has_unit = meterd_db_has_column(DB_SQLITE(db_handle), table_name, "unit");
+
+	if (!has_unit)
+	{
+		snprintf(sql_buf, 4096, "SELECT unit FROM CONFIGURATION WHERE table_name='%s';", table_name);
+
+		if (sqlite3_prepare_v2(DB_SQLITE(db_handle), sql_buf, -1, &stmt, NULL) == SQLITE_OK)
+		{
+			if (sqlite3_step(stmt) == SQLITE_ROW)
+			{
+				const char*	unit	= (const char*) sqlite3_column_text(stmt, 0);
+
+				results->unit = (unit != NULL) ? meterd_unit_intern(unit, strlen(unit)) : UNIT_NONE;
+			}
+
+			sqlite3_finalize(stmt);
+			stmt = NULL;
+		}
+	}
+
+	is_aggregate	= meterd_db_has_column(DB_SQLITE(db_handle), table_name, "count");
+	is_window	= is_aggregate && meterd_db_has_column(DB_SQLITE(db_handle), table_name, "twa");
+
+	/* Inverted values swap minimum and maximum */
+	if ((invert < 0.0f) && (sample_mode == DB_SAMPLE_MIN))
+	{
+		sample_mode = DB_SAMPLE_MAX;
+	}
+	else if ((invert < 0.0f) && (sample_mode == DB_SAMPLE_MAX))
+	{
+		sample_mode = DB_SAMPLE_MIN;
+	}
+
+	if (skip_time <= 0)
+	{
+		const char*	value_expr	= "value";
+
+		/* Aggregates have one row per period */
+		if (is_aggregate)
+		{
+			switch(sample_mode)
+			{
+			case DB_SAMPLE_AVG:
+				/* Windows have a time-weighted average, unless no value applied for long enough */
+				value_expr = is_window ? "IFNULL(twa, sum / count)" : "sum / count";
+				break;
+			case DB_SAMPLE_MIN:
+				value_expr = "min";
+				break;
+			case DB_SAMPLE_MAX:
+				value_expr = "max";
+				break;
+			case DB_SAMPLE_SUM:
+				value_expr = "sum";
+				break;
+			default:
+				value_expr = "first";
+				break;
+			}
+		}
+
+		/* Now, select the data for the specified interval */
+		sql = "SELECT timestamp, %s%s FROM %s WHERE timestamp >= %d;";
+	
+		snprintf(sql_buf, 4096, sql, value_expr, has_unit ? ", unit" : "", table_name, select_from);
+	}
+	else
+	{
+		const char*	value_expr	= is_aggregate ? "first" : "value";
+
+		switch(sample_mode)
+		{
+		case DB_SAMPLE_AVG:
+			value_expr = is_window ? "IFNULL(SUM(twa * duration) / SUM(duration), SUM(sum) / SUM(count))" : (is_aggregate ? "SUM(sum) / SUM(count)" : "AVG(value)");
+			break;
+		case DB_SAMPLE_MIN:
+			value_expr = is_aggregate ? "MIN(min)" : "MIN(value)";
+			break;
+		case DB_SAMPLE_MAX:
+			value_expr = is_aggregate ? "MAX(max)" : "MAX(value)";
+			break;
+		case DB_SAMPLE_SUM:
+			value_expr = is_aggregate ? "SUM(sum)" : "SUM(value)";
+			break;
+		default:
+			/* The value of the row with the lowest timestamp in the interval */
+			break;
+		}
+
+		/* Select one row per interval of skip_time seconds in a single pass */
+		sql = "SELECT MIN(timestamp), %s%s FROM %s WHERE timestamp >= %d GROUP BY (timestamp - %d) / %d ORDER BY 1;";
+
+		snprintf(sql_buf, 4096, sql, value_expr, has_unit ? ", unit" : "", table_name, select_from, select_from, skip_time);
+	}
+
+	if (sqlite3_prepare_v2(DB_SQLITE(db_handle), sql_buf, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		ERROR_MSG("Failed to retrieve results from table %s (%s)", table_name, sqlite3_errmsg(DB_SQLITE(db_handle)));
+
+		free(table_name);
+
+		return MRV_DB_ERROR;
+	}
+
+	/* Read the rows straight into the series; the unit is the same for all rows */
+	while ((step_rv = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		double	value	= sqlite3_column_double(stmt, 1);
+
+		if (has_unit && (results->count == 0))
+		{
+			const char*	unit	= (const char*) sqlite3_column_text(stmt, 2);
+
+			results->unit = (unit != NULL) ? meterd_unit_intern(unit, strlen(unit)) : UNIT_NONE;
+		}
+
+		/* Apply inversion */
+		if (invert < 0.0f)
+		{
+			value *= (double) invert;
+		}
+
+		if ((rv = meterd_db_series_append(results, (int) sqlite3_column_int64(stmt, 0), value)) != MRV_OK)
+		{
+			break;
+		}
+	}
+
+	if ((rv == MRV_OK) && (step_rv != SQLITE_DONE))
+	{
+		ERROR_MSG("Failed to retrieve results from table %s (%s)", table_name, sqlite3_errmsg(DB_SQLITE(db_handle)));
+
+		rv = MRV_DB_ERROR;
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (rv != MRV_OK)
+	{
+		meterd_db_free_results(results);
+	}
+
+	free(table_name);
+
+	return rv;
+}
+
+/* Release the values of a series retrieved from the database */
+void meterd_db_free_results(db_res_series* results)
+{
+	if (results != NULL)
+	{
+		free(results->timestamps);
+		free(results->values);
+
+		memset(results, 0, sizeof(db_res_series));
+	}
+}
+
+/* Close the specified database */
+void meterd_db_close(void* db_handle)
+{
+	meterd_db_ctx*	ctx	= (meterd_db_ctx*) db_handle;
+	meterd_db_stmt*	stmt_it	= NULL;
+	meterd_db_stmt*	stmt_tmp = NULL;
+
+	if (ctx != NULL)
+	{
+		meterd_db_unstage(ctx);
+		meterd_db_commit(ctx);
+
+		HASH_ITER(hh, ctx->stmts, stmt_it, stmt_tmp)
+		{
+			meterd_db_stmt_free(ctx, stmt_it);
+		}
+
+		sqlite3_close(ctx->db);
+
+		free(ctx);
 	}
 }
 
@@ -52,14 +52,99 @@ meterd_rv meterd_db_create(const char* db_name, int force_create, void** db_hand
 /* Create tables based on the supplied counter specifications */
 meterd_rv meterd_db_create_tables(void* db_handle, counter_spec* counters);
 
+/* Migrate the data tables of the specified database to the current schema, copying chunk_size rows at a time */
+meterd_rv meterd_db_migrate(void* db_handle, int chunk_size);
+
+/* Add daily and monthly aggregate tables for the counters in the database that do not have them yet */
+meterd_rv meterd_db_add_aggregates(void* db_handle);
+
+/* Add delta tables for the cumulative counters in the database that do not have them yet */
+meterd_rv meterd_db_add_deltas(void* db_handle);
+
+/* Add tables for the aggregates over the window of the specified length for the counters in the database that do not have them yet */
+meterd_rv meterd_db_add_window(void* db_handle, int length, const char* id_suffix);
+
+/* Import the data of a database in the legacy layout into a database in the single database layout */
+meterd_rv meterd_db_import(void* db_handle, const char* legacy_db_name, const char* id_suffix);
+
+/* Delete a batch of rows older than the specified timestamp from the data tables of the specified type (-1 for all) */
+meterd_rv meterd_db_expire(void* db_handle, int type, int before, int batch_size, int* deleted);
+
+/* Return at most max_pages free pages to the file system (0 for all); the number of bytes reclaimed is returned */
+meterd_rv meterd_db_vacuum(void* db_handle, int max_pages, long long* reclaimed);
+
+/* Get the file name of the specified database */
+const char* meterd_db_filename(void* db_handle);
+
+/* Get the name of the staging database for the specified database in the specified directory */
+char* meterd_db_staging_name(const char* staging_dir, const char* db_name);
+
+/* Write measurements to the specified staging database instead, until they are merged; rows left from a previous run are merged first */
+meterd_rv meterd_db_stage(void* db_handle, const char* staging_name);
+
+/* Move the staged rows into the database in a single transaction; the number of rows moved is returned */
+meterd_rv meterd_db_merge(void* db_handle, int* merged);
+
+/* Merge the staged rows and write measurements to the database again; the staging database is removed if it is empty */
+meterd_rv meterd_db_unstage(void* db_handle);
+
+/* Show the rows in the specified staging database (if it exists) together with the rows in the database when querying it */
+meterd_rv meterd_db_attach_staging(void* db_handle, const char* staging_name);
+
 /* Open the specified database */
 meterd_rv meterd_db_open(const char* db_name, int read_only, void** db_handle);
 
+/* Switch between full (FULL) and WAL-safe (NORMAL) disk synchronisation */
+meterd_rv meterd_db_set_synchronous(void* db_handle, int normal);
+
+/* Disable automatic checkpoints on the specified database and truncate the WAL to at most size_limit bytes when it is reset */
+meterd_rv meterd_db_manual_checkpoints(void* db_handle, long long size_limit);
+
+/* Get the size of the WAL in bytes as of the last commit on a database with manual checkpoints; may be called from any thread */
+long long meterd_db_wal_size(void* db_handle);
+
+/* Copy as much of the WAL into the database as possible without waiting for readers or writers */
+meterd_rv meterd_db_checkpoint(void* db_handle, long long* wal_size, long long* checkpointed);
+
+/* Start a transaction in which subsequent measurements are recorded; no-op if one is open */
+meterd_rv meterd_db_begin(void* db_handle);
+
+/* Commit the open transaction (if any); this also happens when the database is closed */
+meterd_rv meterd_db_commit(void* db_handle);
+
 /* Record a measurement in the specified table of the specified database */
-meterd_rv meterd_db_record(void* db_handle, const char* table_name, long double value, const char* unit, int timestamp);
+meterd_rv meterd_db_record(void* db_handle, const char* table_name, meterd_fixed value, meterd_unit unit, int timestamp);
+
+/* Determine the calendar day or month (local time) the specified time falls in */
+void meterd_db_aggregate_period(time_t ts, int type, time_t* start, time_t* end);
+
+/* Determine the window of the specified length that the specified time falls in; windows are aligned to local midnight */
+void meterd_db_window_period(time_t ts, int length, time_t* start, time_t* end);
+
+/* Load the stored aggregate of the period starting at agg->start; the count is 0 if there is none */
+meterd_rv meterd_db_load_aggregate(void* db_handle, meterd_aggregate* agg);
+
+/* Store the aggregate of a period, replacing the stored aggregate of that period */
+meterd_rv meterd_db_store_aggregate(void* db_handle, const meterd_aggregate* agg, meterd_unit unit);
+
+/* Retrieve the most recent value in the specified data table; the timestamp is 0 if there is none */
+meterd_rv meterd_db_last_value(void* db_handle, const char* table_name, meterd_fixed* value, time_t* timestamp);
+
+/* Check if the specified table exists */
+int meterd_db_has_table(void* db_handle, const char* table_name);
+
+/* Value reported per interval when sampling results */
+#define DB_SAMPLE_FIRST		0	/* First value in the interval */
+#define DB_SAMPLE_AVG		1	/* Average value over the interval */
+#define DB_SAMPLE_MIN		2	/* Minimum value in the interval */
+#define DB_SAMPLE_MAX		3	/* Maximum value in the interval */
+#define DB_SAMPLE_SUM		4	/* Sum of the values in the interval */
+
+/* Retrieve results from the database; if skip_time is set, one result is returned per skip_time seconds */
+meterd_rv meterd_db_get_results(void* db_handle, const char* id, long double invert, db_res_series* results, int select_from, int skip_time, int sample_mode);
 
-/* Retrieve results from the database */
-meterd_rv meterd_db_get_results(void* db_handle, const char* id, long double invert, db_res_ctr** results, int select_from, int skip_time);
+/* Release the values of a series retrieved from the database */
+void meterd_db_free_results(db_res_series* results);
 
 /* Close the specified database */
 void meterd_db_close(void* db_handle);
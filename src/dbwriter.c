@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Asynchronous database writer
+ */
+
+#include "config.h"
+#include "dbwriter.h"
+#include "meterd_types.h"
+#include "meterd_log.h"
+#include "meterd_error.h"
+#include "db.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Types of queued writes */
+#define WRITE_BEGIN		0
+#define WRITE_COMMIT		1
+#define WRITE_RECORD		2
+#define WRITE_AGGREGATE		3
+#define WRITE_MERGE		4
+
+/* Minimum interval between warnings about dropped writes (seconds) */
+#define DBWRITER_WARN_INTERVAL	60
+
+/* Write queued by the measurement loop */
+typedef struct dbwriter_entry
+{
+	int			type;
+	void*			db_handle;
+	const char*		table_name;
+	meterd_fixed		value;
+	meterd_unit		unit;
+	int			timestamp;
+	meterd_aggregate	agg;
+}
+dbwriter_entry;
+
+/*
+ * The queue is a ring buffer with a single producer (the measurement loop)
+ * and a single consumer (the writer thread); the producer only advances the
+ * head and the consumer only advances the tail, so no lock is needed
+ */
+static dbwriter_entry*		queue		= NULL;
+static size_t			queue_size	= 0;	/* Power of two, so the positions can wrap around */
+static size_t			queue_head	= 0;
+static size_t			queue_tail	= 0;
+static int			overload_policy	= WRITE_OVERLOAD_DROP_RAW;
+
+/* Statistics; written and recorded are only updated by the writer thread, the others by the measurement loop */
+static size_t			max_depth	= 0;
+static unsigned long long	written		= 0;
+static unsigned long long	recorded	= 0;
+static unsigned long long	dropped		= 0;
+static unsigned long long	stalled		= 0;
+static unsigned long long	dropped_warned	= 0;
+static time_t			last_warning	= 0;
+
+/* Writer thread */
+static pthread_t		writer_thread;
+static pthread_mutex_t		writer_mutex;
+static pthread_cond_t		writer_cond;
+static int			writer_wake	= 0;
+static int			writer_run	= 0;
+
+/* Initialise the writer with a queue of the specified number of writes */
+meterd_rv meterd_dbwriter_init(size_t size, int overload)
+{
+	size_t	rounded	= 64;
+
+	while (rounded < size)
+	{
+		rounded *= 2;
+	}
+
+	size = rounded;
+
+	queue = (dbwriter_entry*) calloc(size, sizeof(dbwriter_entry));
+
+	if (queue == NULL)
+	{
+		ERROR_MSG("Failed to allocate a write queue of %zu entries", size);
+
+		return MRV_MEMORY;
+	}
+
+	queue_size	= size;
+	queue_head	= 0;
+	queue_tail	= 0;
+	overload_policy	= overload;
+
+	pthread_mutex_init(&writer_mutex, NULL);
+	pthread_cond_init(&writer_cond, NULL);
+
+	INFO_MSG("Queueing up to %zu database writes, %s when the queue is full", size, (overload == WRITE_OVERLOAD_BLOCK) ? "waiting for space" : "dropping raw values first");
+
+	return MRV_OK;
+}
+
+/* Merge the staged rows of the specified database */
+static void meterd_dbwriter_merge_staged(void* db_handle)
+{
+	struct timespec	start;
+	struct timespec	end;
+	int		merged	= 0;
+	meterd_rv	rv	= MRV_OK;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rv = meterd_db_merge(db_handle, &merged);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if ((rv == MRV_OK) && (merged > 0))
+	{
+		INFO_MSG("Merged %d staged row(s) into %s in %.1fms", merged, meterd_db_filename(db_handle), ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_nsec - start.tv_nsec) / 1000000.0));
+	}
+	else if (rv == MRV_DB_BUSY)
+	{
+		INFO_MSG("Database %s is busy, merging staged rows during the next run", meterd_db_filename(db_handle));
+	}
+}
+
+/* Perform a queued write */
+static void meterd_dbwriter_perform(dbwriter_entry* entry)
+{
+	switch(entry->type)
+	{
+	case WRITE_BEGIN:
+		meterd_db_begin(entry->db_handle);
+		break;
+	case WRITE_COMMIT:
+		meterd_db_commit(entry->db_handle);
+		break;
+	case WRITE_RECORD:
+		meterd_db_record(entry->db_handle, entry->table_name, entry->value, entry->unit, entry->timestamp);
+		__atomic_store_n(&recorded, recorded + 1, __ATOMIC_RELAXED);
+		break;
+	case WRITE_AGGREGATE:
+		meterd_db_store_aggregate(entry->db_handle, &entry->agg, entry->unit);
+		break;
+	case WRITE_MERGE:
+		meterd_dbwriter_merge_staged(entry->db_handle);
+		break;
+	}
+}
+
+/* Main thread procedure; handles queued writes until stopped and the queue is empty */
+void* meterd_dbwriter_threadproc(void* param)
+{
+	int		run	= 1;
+	sigset_t	signals;
+
+	/* Signals are handled by the measurement loop */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	INFO_MSG("Entering database writer thread");
+
+	while (run)
+	{
+		size_t	head	= 0;
+		size_t	tail	= __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&writer_mutex);
+
+		while (!writer_wake && writer_run)
+		{
+			pthread_cond_wait(&writer_cond, &writer_mutex);
+		}
+
+		writer_wake	= 0;
+		run		= writer_run;
+
+		pthread_mutex_unlock(&writer_mutex);
+
+		/* Handle everything that was queued so far */
+		while (tail != (head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)))
+		{
+			while (tail != head)
+			{
+				meterd_dbwriter_perform(&queue[tail & (queue_size - 1)]);
+
+				tail++;
+				written++;
+
+				__atomic_store_n(&queue_tail, tail, __ATOMIC_RELEASE);
+			}
+		}
+	}
+
+	INFO_MSG("Leaving database writer thread");
+
+	return NULL;
+}
+
+/* Start the writer thread */
+meterd_rv meterd_dbwriter_start(void)
+{
+	pthread_attr_t	writer_t_attr;
+
+	writer_run = 1;
+
+	pthread_attr_init(&writer_t_attr);
+	pthread_attr_setdetachstate(&writer_t_attr, PTHREAD_CREATE_JOINABLE);
+
+	if (pthread_create(&writer_thread, &writer_t_attr, meterd_dbwriter_threadproc, NULL) != 0)
+	{
+		ERROR_MSG("Failed to start database writer thread");
+
+		writer_run = 0;
+
+		return MRV_GENERAL_ERROR;
+	}
+
+	return MRV_OK;
+}
+
+/* Write everything that is still queued and stop the writer thread */
+void meterd_dbwriter_stop(void)
+{
+	if (!writer_run)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&writer_mutex);
+
+	writer_run	= 0;
+	writer_wake	= 1;
+
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+
+	pthread_join(writer_thread, NULL);
+}
+
+/* Uninitialise the writer */
+void meterd_dbwriter_finalize(void)
+{
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	INFO_MSG("Wrote %llu queued database update(s), dropped %llu, waited %llu time(s) for space; at most %zu update(s) were queued", written, dropped, stalled, max_depth);
+
+	pthread_cond_destroy(&writer_cond);
+	pthread_mutex_destroy(&writer_mutex);
+
+	free(queue);
+
+	queue		= NULL;
+	queue_size	= 0;
+}
+
+/* Wake up the writer to handle the queued writes */
+void meterd_dbwriter_notify(void)
+{
+	pthread_mutex_lock(&writer_mutex);
+
+	writer_wake = 1;
+
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+/* Add a write to the queue, applying the overload policy if it is (nearly) full */
+static void meterd_dbwriter_push(const dbwriter_entry* entry, int priority)
+{
+	size_t	head	= queue_head;
+	size_t	depth	= head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE);
+	time_t	now	= 0;
+
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	/* Keep the last quarter of the queue free for writes that are never dropped */
+	if ((priority == WRITE_PRIO_LOW) && (overload_policy == WRITE_OVERLOAD_DROP_RAW) && (depth >= (queue_size - queue_size / 4)))
+	{
+		dropped++;
+
+		if (((now = time(NULL)) - last_warning) >= DBWRITER_WARN_INTERVAL)
+		{
+			WARNING_MSG("Database writes are falling behind, dropped %llu raw value(s) (%llu in total)", dropped - dropped_warned, dropped);
+
+			dropped_warned	= dropped;
+			last_warning	= now;
+		}
+
+		return;
+	}
+
+	/* Wait for the writer to make space */
+	if (depth >= queue_size)
+	{
+		stalled++;
+
+		do
+		{
+			meterd_dbwriter_notify();
+
+			usleep(1000);
+
+			depth = head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE);
+		}
+		while (depth >= queue_size);
+	}
+
+	queue[head & (queue_size - 1)] = *entry;
+
+	__atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+
+	if (depth + 1 > max_depth)
+	{
+		max_depth = depth + 1;
+	}
+}
+
+/* Queue the start of a transaction on the specified database */
+void meterd_dbwriter_begin(void* db_handle)
+{
+	dbwriter_entry	entry;
+
+	if (db_handle == NULL) return;
+
+	memset(&entry, 0, sizeof(dbwriter_entry));
+
+	entry.type	= WRITE_BEGIN;
+	entry.db_handle	= db_handle;
+
+	meterd_dbwriter_push(&entry, WRITE_PRIO_HIGH);
+}
+
+/* Queue a commit of the open transaction on the specified database */
+void meterd_dbwriter_commit(void* db_handle)
+{
+	dbwriter_entry	entry;
+
+	if (db_handle == NULL) return;
+
+	memset(&entry, 0, sizeof(dbwriter_entry));
+
+	entry.type	= WRITE_COMMIT;
+	entry.db_handle	= db_handle;
+
+	meterd_dbwriter_push(&entry, WRITE_PRIO_HIGH);
+}
+
+/* Queue a measurement */
+void meterd_dbwriter_record(void* db_handle, const char* table_name, meterd_fixed value, meterd_unit unit, int timestamp, int priority)
+{
+	dbwriter_entry	entry;
+
+	memset(&entry, 0, sizeof(dbwriter_entry));
+
+	entry.type		= WRITE_RECORD;
+	entry.db_handle		= db_handle;
+	entry.table_name	= table_name;
+	entry.value		= value;
+	entry.unit		= unit;
+	entry.timestamp		= timestamp;
+
+	meterd_dbwriter_push(&entry, priority);
+}
+
+/* Queue storing the current state of an aggregate */
+void meterd_dbwriter_store_aggregate(void* db_handle, const meterd_aggregate* agg, meterd_unit unit)
+{
+	dbwriter_entry	entry;
+
+	memset(&entry, 0, sizeof(dbwriter_entry));
+
+	entry.type	= WRITE_AGGREGATE;
+	entry.db_handle	= db_handle;
+	entry.agg	= *agg;
+	entry.unit	= unit;
+
+	meterd_dbwriter_push(&entry, WRITE_PRIO_HIGH);
+}
+
+/* Queue merging the staged rows of the specified database into it */
+void meterd_dbwriter_merge(void* db_handle)
+{
+	dbwriter_entry	entry;
+
+	if (db_handle == NULL) return;
+
+	memset(&entry, 0, sizeof(dbwriter_entry));
+
+	entry.type	= WRITE_MERGE;
+	entry.db_handle	= db_handle;
+
+	meterd_dbwriter_push(&entry, WRITE_PRIO_HIGH);
+}
+
+/* Check if the writer has handled everything that was queued; may be called from any thread */
+int meterd_dbwriter_idle(void)
+{
+	return (__atomic_load_n(&queue_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE));
+}
+
+/* Get the writer statistics */
+void meterd_dbwriter_get_stats(dbwriter_stats* stats)
+{
+	assert(stats != NULL);
+
+	stats->size		= queue_size;
+	stats->depth		= __atomic_load_n(&queue_head, __ATOMIC_RELAXED) - __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+	stats->max_depth	= max_depth;
+	stats->dropped		= dropped;
+	stats->stalled		= stalled;
+	stats->recorded		= __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+}
+
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Asynchronous database writer
+ */
+
+#ifndef _METERD_DBWRITER_H
+#define _METERD_DBWRITER_H
+
+#include "config.h"
+#include "meterd_types.h"
+
+/* Priority of queued writes */
+#define WRITE_PRIO_LOW		0	/* Raw values; dropped first when the queue fills up */
+#define WRITE_PRIO_HIGH		1	/* Averages, cumulative values, deltas and aggregates; never dropped */
+
+/* Behaviour when the queue fills up */
+#define WRITE_OVERLOAD_DROP_RAW	0	/* Drop low priority writes when the queue is nearly full, wait for space for the others */
+#define WRITE_OVERLOAD_BLOCK	1	/* Never drop writes, wait for space */
+
+/* Writer statistics */
+typedef struct dbwriter_stats
+{
+	size_t			size;		/* Number of writes that can be queued */
+	size_t			depth;		/* Number of queued writes */
+	size_t			max_depth;	/* Highest number of queued writes seen */
+	unsigned long long	dropped;	/* Number of writes dropped because the queue was full */
+	unsigned long long	stalled;	/* Number of times the measurement loop waited for space */
+	unsigned long long	recorded;	/* Number of measurements written */
+}
+dbwriter_stats;
+
+/* Initialise the writer with a queue of (at least) the specified number of writes */
+meterd_rv meterd_dbwriter_init(size_t queue_size, int overload);
+
+/* Start the writer thread */
+meterd_rv meterd_dbwriter_start(void);
+
+/* Write everything that is still queued and stop the writer thread */
+void meterd_dbwriter_stop(void);
+
+/* Uninitialise the writer */
+void meterd_dbwriter_finalize(void);
+
+/* Queue the start of a transaction on the specified database */
+void meterd_dbwriter_begin(void* db_handle);
+
+/* Queue a commit of the open transaction on the specified database */
+void meterd_dbwriter_commit(void* db_handle);
+
+/* Queue a measurement; the table name must remain valid until the writer is stopped */
+void meterd_dbwriter_record(void* db_handle, const char* table_name, meterd_fixed value, meterd_unit unit, int timestamp, int priority);
+
+/* Queue storing the current state of an aggregate */
+void meterd_dbwriter_store_aggregate(void* db_handle, const meterd_aggregate* agg, meterd_unit unit);
+
+/* Queue merging the staged rows of the specified database into it */
+void meterd_dbwriter_merge(void* db_handle);
+
+/* Wake up the writer to handle the queued writes */
+void meterd_dbwriter_notify(void);
+
+/* Check if the writer has handled everything that was queued; may be called from any thread */
+int meterd_dbwriter_idle(void);
+
+/* Get the writer statistics */
+void meterd_dbwriter_get_stats(dbwriter_stats* stats);
+
+#endif /* !_METERD_DBWRITER_H */
+
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Fixed-point counter values
+ */
+
+#include "config.h"
+#include "meterd_types.h"
+#include "meterd_error.h"
+#include "fixed.h"
+#include <stdint.h>
+#include <string.h>
+
+#define FIXED_DECIMALS		3
+#define FIXED_INT_DIGITS	15
+#define FIXED_IS_DIGIT(c)	(((c) >= '0') && ((c) <= '9'))
+
+/*
+ * Convert eight ASCII digits to their value in three multiply steps,
+ * combining pairs of digits, then pairs of pairs and finally both halves
+ */
+static uint64_t meterd_fixed_swar8(const char* digits)
+{
+	uint64_t	val	= 0;
+
+#ifdef WORDS_BIGENDIAN
+	int		i	= 0;
+
+	/* The kernel expects the first digit in the lowest byte */
+	for (i = 7; i >= 0; i--)
+	{
+		val = (val << 8) | (unsigned char) digits[i];
+	}
+#else
+	memcpy(&val, digits, 8);
+#endif /* WORDS_BIGENDIAN */
+
+	val -= 0x3030303030303030ULL;
+
+	val = ((val * 10) + (val >> 8)) & 0x00FF00FF00FF00FFULL;
+	val = ((val * 100) + (val >> 16)) & 0x0000FFFF0000FFFFULL;
+	val = (val * 10000) + (val >> 32);
+
+	return val & 0xFFFFFFFFULL;
+}
+
+/* Parse a decimal value ("000123.456") into a fixed-point value */
+meterd_rv meterd_fixed_parse(const char* str, size_t len, meterd_fixed* value)
+{
+	const char*	it		= str;
+	const char*	end		= str + len;
+	char		digits[24];
+	size_t		int_len		= 0;
+	size_t		frac_len	= 0;
+	size_t		total		= 0;
+	size_t		pad		= 0;
+	size_t		i		= 0;
+	uint64_t	result		= 0;
+
+	/* Skip leading zeroes of the integer part */
+	while ((it < end) && (*it == '0')) it++;
+
+	while (((it + int_len) < end) && FIXED_IS_DIGIT(it[int_len])) int_len++;
+
+	if (int_len > FIXED_INT_DIGITS)
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	/* Right-align the digits in a multiple of eight, followed by exactly three decimals */
+	total	= int_len + FIXED_DECIMALS;
+	pad	= (total <= 8) ? (8 - total) : (total <= 16) ? (16 - total) : (24 - total);
+
+	memset(digits, '0', sizeof(digits));
+	memcpy(&digits[pad], it, int_len);
+
+	it += int_len;
+
+	if ((it < end) && (*it == '.'))
+	{
+		for (it++; (it < end) && FIXED_IS_DIGIT(*it) && (frac_len < FIXED_DECIMALS); it++)
+		{
+			digits[pad + int_len + frac_len++] = *it;
+		}
+	}
+
+	for (i = 0; i < (pad + total); i += 8)
+	{
+		result = (result * 100000000ULL) + meterd_fixed_swar8(&digits[i]);
+	}
+
+	*value = (meterd_fixed) result;
+
+	return MRV_OK;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Fixed-point counter values
+ */
+
+#ifndef _METERD_FIXED_H
+#define _METERD_FIXED_H
+
+#include "config.h"
+#include "meterd_types.h"
+#include <stdlib.h>
+
+/*
+ * Counter values are kept as signed 64-bit integers in thousandths of
+ * their unit (P1 values have at most three decimals); they are only
+ * converted to text or floating point at the edges
+ */
+#define FIXED_SCALE		1000LL
+
+/* Format a fixed-point value exactly: printf(FIXED_FMT, FIXED_ARGS(value)) */
+#define FIXED_FMT		"%s%lld.%03lld"
+#define FIXED_ARGS(v)		((v) < 0) ? "-" : "", (long long) (llabs(v) / FIXED_SCALE), (long long) (llabs(v) % FIXED_SCALE)
+
+/* Convert a fixed-point value to floating point */
+#define FIXED_TO_LDOUBLE(v)	((long double) (v) / (long double) FIXED_SCALE)
+#define FIXED_TO_DOUBLE(v)	((double) (v) / (double) FIXED_SCALE)
+
+/* Convert a floating point value to fixed-point, rounding to the nearest thousandth */
+#define FIXED_FROM_DOUBLE(d)	((meterd_fixed) (((d) < 0.0) ? (((d) * (double) FIXED_SCALE) - 0.5) : (((d) * (double) FIXED_SCALE) + 0.5)))
+
+/*
+ * Parse a decimal value ("000123.456") into a fixed-point value; parsing
+ * stops at the first character that is not part of the number and
+ * decimals beyond the third are ignored
+ */
+meterd_rv meterd_fixed_parse(const char* str, size_t len, meterd_fixed* value);
+
+#endif /* !_METERD_FIXED_H */
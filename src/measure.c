@@ -38,22 +38,411 @@
 #include "measure.h"
 #include "db.h"
 #include "comm.h"
+#include "telegram.h"
 #include <stdlib.h>
 #include <string.h>
 #include "utlist.h"
+#include "uthash.h"
 #include "p1_parser.h"
+#include "obis.h"
+#include "fixed.h"
+#include "dbwriter.h"
+#include "checkpoint.h"
+#include <sys/resource.h>
+
+/* Index of the counter specifications by counter ID */
+typedef struct
+{
+	obis_key	key;		/* Packed counter ID (C.D.E) */
+	counter_spec**	specs;		/* Specifications for this ID */
+	int		spec_count;	/* Number of specifications */
+	UT_hash_handle	hh;
+}
+counter_index;
 
 /* Module variables */
 static void*		raw_db_h	= NULL;
 static void*		fivemin_db_h	= NULL;
 static void*		hourly_db_h	= NULL;
 static void*		cumul_db_h	= NULL;
+static int		single_db	= 0;
 static counter_spec*	counters	= NULL;
 static int		run_measurement	= 1;
 static char*		gas_id		= NULL;
 static int		total_interval	= 0;
 static char*		telegram_file	= NULL;
 static char*		telegram_tmp	= NULL;
+static p1_parser_ctx*	parser		= NULL;
+static p1_telegram	telegram;
+static counter_index*	counter_idx	= NULL;
+static int		commit_telegrams = 1;
+static int		commit_interval	= 0;
+static int		pending_telegrams = 0;
+static time_t		last_commit	= 0;
+static int		staging		= 0;
+static int		merge_interval	= 0;
+static time_t		last_merge	= 0;
+static long		start_oublock	= 0;
+static int		max_hold	= 0;
+
+/* Default number of database writes that can be queued */
+#define DEFAULT_WRITE_QUEUE	4096
+
+/* Default interval between merges of the staging databases (seconds) */
+#define DEFAULT_MERGE_INTERVAL	3600
+
+/* Number of meter intervals a value is assumed to apply for in time-weighted averages */
+#define HOLD_INTERVALS		3
+
+/* Return the rounded average of the accumulated fixed-point values */
+static meterd_fixed meterd_measure_average(meterd_fixed sum, size_t count)
+{
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	return (sum >= 0) ? ((sum + (meterd_fixed) (count / 2)) / (meterd_fixed) count) : ((sum - (meterd_fixed) (count / 2)) / (meterd_fixed) count);
+}
+
+/*
+ * Fold a value into the aggregate of the current day, month or window; it is
+ * stored when the measurements are committed. For the time-weighted average,
+ * the previous value is assumed to apply until this one, unless the meter
+ * was silent for longer than max_hold seconds
+ */
+static void meterd_measure_aggregate(void* db_h, meterd_aggregate* agg, int type, meterd_fixed value, meterd_unit unit, time_t now)
+{
+	time_t	held	= 0;
+
+	if ((db_h == NULL) || (agg->table_name == NULL))
+	{
+		return;
+	}
+
+	if ((agg->count > 0) && (agg->last_ts > 0) && (now > agg->last_ts) && ((now - agg->last_ts) <= max_hold))
+	{
+		held = now - agg->last_ts;
+	}
+
+	/* Start a new period; the stored aggregate of the current period was loaded on startup */
+	if ((now < agg->start) || (now >= agg->end))
+	{
+		time_t	carried	= 0;
+
+		/* The previous value applied until the end of its period and from the start of this one */
+		if ((held > 0) && (now >= agg->end) && (agg->last_ts < agg->end))
+		{
+			agg->duration	+= agg->end - agg->last_ts;
+			agg->weighted	+= agg->last * (meterd_fixed) (agg->end - agg->last_ts);
+			agg->dirty	= 1;
+			carried		= now - agg->end;
+		}
+
+		if (agg->dirty)
+		{
+			meterd_dbwriter_store_aggregate(db_h, agg, agg->unit);
+		}
+
+		if (type == COUNTER_TYPE_WINDOW)
+		{
+			meterd_db_window_period(now, agg->length, &agg->start, &agg->end);
+		}
+		else
+		{
+			meterd_db_aggregate_period(now, type, &agg->start, &agg->end);
+		}
+
+		if (carried > (now - agg->start))
+		{
+			carried = now - agg->start;
+		}
+
+		agg->count	= 0;
+		agg->duration	= carried;
+		agg->weighted	= agg->last * (meterd_fixed) carried;
+	}
+	else if (held > 0)
+	{
+		agg->duration	+= held;
+		agg->weighted	+= agg->last * (meterd_fixed) held;
+	}
+
+	if (agg->count == 0)
+	{
+		agg->sum	= 0;
+		agg->min	= value;
+		agg->max	= value;
+		agg->first	= value;
+	}
+
+	agg->count++;
+	agg->sum	+= value;
+	agg->last	= value;
+	agg->last_ts	= now;
+	agg->unit	= unit;
+	agg->dirty	= 1;
+
+	if (value < agg->min) agg->min = value;
+	if (value > agg->max) agg->max = value;
+}
+
+/*
+ * Store the aggregates that changed since they were last stored; while the
+ * database writer is falling behind this is deferred unless forced, since
+ * every store replaces the previous one
+ */
+static void meterd_measure_store_aggregates(int force)
+{
+	counter_spec*	ctr_it	= NULL;
+	int		i	= 0;
+	dbwriter_stats	stats;
+
+	meterd_dbwriter_get_stats(&stats);
+
+	if (!force && (stats.depth >= (stats.size / 2)))
+	{
+		return;
+	}
+
+	LL_FOREACH(counters, ctr_it)
+	{
+		void*	agg_db_h	= (ctr_it->type == COUNTER_TYPE_RAW) ? ctr_it->raw_db_h : ctr_it->cumul_db_h;
+
+		if (ctr_it->daily.dirty)
+		{
+			meterd_dbwriter_store_aggregate(agg_db_h, &ctr_it->daily, ctr_it->daily.unit);
+			ctr_it->daily.dirty = 0;
+		}
+
+		if (ctr_it->monthly.dirty)
+		{
+			meterd_dbwriter_store_aggregate(agg_db_h, &ctr_it->monthly, ctr_it->monthly.unit);
+			ctr_it->monthly.dirty = 0;
+		}
+
+		for (i = 0; i < ctr_it->window_count; i++)
+		{
+			if (ctr_it->windows[i].dirty)
+			{
+				meterd_dbwriter_store_aggregate(agg_db_h, &ctr_it->windows[i], ctr_it->windows[i].unit);
+				ctr_it->windows[i].dirty = 0;
+			}
+		}
+	}
+}
+
+/* Record the difference between a cumulative value and the one recorded before it */
+static void meterd_measure_delta(counter_spec* ctr, meterd_fixed value, meterd_unit unit, int db_ts)
+{
+	if (ctr->delta_base_set)
+	{
+		meterd_fixed	delta	= value - ctr->delta_base;
+
+		/* A lower value means the register was reset (e.g. the meter was replaced) and counts up from zero */
+		if (value < ctr->delta_base)
+		{
+			INFO_MSG("Register %s went back from " FIXED_FMT " to " FIXED_FMT ", assuming it was reset", ctr->id, FIXED_ARGS(ctr->delta_base), FIXED_ARGS(value));
+
+			delta = value;
+		}
+
+		meterd_dbwriter_record(ctr->cumul_db_h, ctr->delta_table_name, delta, unit, db_ts, WRITE_PRIO_HIGH);
+		DEBUG_MSG("Recorded " FIXED_FMT " %s for %s as delta", FIXED_ARGS(delta), meterd_unit_name(unit), ctr->id);
+	}
+
+	ctr->delta_base		= value;
+	ctr->delta_base_set	= 1;
+}
+
+/* Start a transaction on all databases for the next telegram */
+static void meterd_measure_begin(void)
+{
+	meterd_dbwriter_begin(raw_db_h);
+	meterd_dbwriter_begin(fivemin_db_h);
+	meterd_dbwriter_begin(hourly_db_h);
+	meterd_dbwriter_begin(cumul_db_h);
+}
+
+/* Commit the measurements recorded since the last flush */
+static void meterd_measure_flush(time_t now, int force)
+{
+	dbwriter_stats	stats;
+
+	if (pending_telegrams > 0)
+	{
+		meterd_dbwriter_get_stats(&stats);
+
+		DEBUG_MSG("Committing measurements of %d telegram(s), %zu database write(s) queued", pending_telegrams, stats.depth);
+	}
+
+	meterd_measure_store_aggregates(force);
+
+	meterd_dbwriter_commit(raw_db_h);
+	meterd_dbwriter_commit(fivemin_db_h);
+	meterd_dbwriter_commit(hourly_db_h);
+	meterd_dbwriter_commit(cumul_db_h);
+
+	pending_telegrams	= 0;
+	last_commit		= now;
+
+	/* Move the staged measurements to persistent storage */
+	if (staging && (force || ((now - last_merge) >= merge_interval)))
+	{
+		meterd_dbwriter_merge(raw_db_h);
+
+		if (!single_db)
+		{
+			meterd_dbwriter_merge(fivemin_db_h);
+			meterd_dbwriter_merge(hourly_db_h);
+			meterd_dbwriter_merge(cumul_db_h);
+		}
+
+		last_merge = now;
+	}
+}
+
+/* Write the measurements for the specified database to a staging database in the specified directory */
+static void meterd_measure_stage(void* db_h, const char* db_name, const char* staging_dir)
+{
+	char*	staging_name	= NULL;
+
+	if (db_h == NULL)
+	{
+		return;
+	}
+
+	if ((staging_name = meterd_db_staging_name(staging_dir, db_name)) == NULL)
+	{
+		ERROR_MSG("Memory allocation error");
+
+		return;
+	}
+
+	if (meterd_db_stage(db_h, staging_name) == MRV_OK)
+	{
+		INFO_MSG("Staging measurements for %s in %s", db_name, staging_name);
+
+		staging = 1;
+	}
+	else
+	{
+		ERROR_MSG("Failed to stage measurements for %s in %s, writing to it directly", db_name, staging_name);
+	}
+
+	free(staging_name);
+}
+
+/* Set up the aggregates over the configured windows for which the database of the counter has a table */
+static meterd_rv meterd_measure_windows(counter_spec* ctr, void* agg_db_h, const int* lengths, int count, time_t now)
+{
+	int	i	= 0;
+	int	missing	= 0;
+
+	if (count == 0)
+	{
+		return MRV_OK;
+	}
+
+	if ((ctr->windows = (meterd_aggregate*) calloc(count, sizeof(meterd_aggregate))) == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		meterd_aggregate*	window	= &ctr->windows[ctr->window_count];
+
+		if ((window->table_name = meterd_conf_create_window_table_name(ctr->id, lengths[i])) == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		if (!meterd_db_has_table(agg_db_h, window->table_name))
+		{
+			free(window->table_name);
+			window->table_name = NULL;
+
+			missing++;
+
+			continue;
+		}
+
+		/* Continue the aggregate of the current window if meterd was restarted during it */
+		window->length = lengths[i];
+
+		meterd_db_window_period(now, window->length, &window->start, &window->end);
+		meterd_db_load_aggregate(agg_db_h, window);
+
+		ctr->window_count++;
+	}
+
+	if ((missing > 0) && meterd_db_has_table(agg_db_h, ctr->table_name))
+	{
+		INFO_MSG("No tables for %d aggregation window(s) of %s, run meterd-createdb -m to add them", missing, ctr->id);
+	}
+
+	return MRV_OK;
+}
+
+/* Add a counter specification to the index; an ID may have more than one specification */
+static meterd_rv meterd_measure_index_add(counter_spec* spec)
+{
+	counter_index*	idx		= NULL;
+	counter_spec**	new_specs	= NULL;
+
+	if (meterd_obis_from_string(spec->id, strlen(spec->id), &spec->key) != MRV_OK)
+	{
+		ERROR_MSG("Invalid counter ID %s in the configuration", spec->id);
+
+		return MRV_CONFIG_ERROR;
+	}
+
+	spec->key = OBIS_CDE(spec->key);
+
+	HASH_FIND(hh, counter_idx, &spec->key, sizeof(obis_key), idx);
+
+	if (idx == NULL)
+	{
+		idx = (counter_index*) calloc(1, sizeof(counter_index));
+
+		if (idx == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		idx->key = spec->key;
+
+		HASH_ADD(hh, counter_idx, key, sizeof(obis_key), idx);
+	}
+
+	new_specs = (counter_spec**) realloc(idx->specs, (idx->spec_count + 1) * sizeof(counter_spec*));
+
+	if (new_specs == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	idx->specs = new_specs;
+	idx->specs[idx->spec_count++] = spec;
+
+	return MRV_OK;
+}
+
+/* Release the counter index */
+static void meterd_measure_index_free(void)
+{
+	counter_index*	idx_it	= NULL;
+	counter_index*	idx_tmp	= NULL;
+
+	HASH_ITER(hh, counter_idx, idx_it, idx_tmp)
+	{
+		HASH_DEL(counter_idx, idx_it);
+
+		free(idx_it->specs);
+		free(idx_it);
+	}
+}
 
 /* Initialise measuring */
 meterd_rv meterd_measure_init(void)
@@ -62,6 +451,9 @@ meterd_rv meterd_measure_init(void)
 	char* 		fivemin_db_name	= NULL;
 	char*		hourly_db_name	= NULL;
 	char*		cumul_db_name	= NULL;
+	char*		single_db_name	= NULL;
+	char*		staging_dir	= NULL;
+	struct rusage	usage;
 	meterd_rv	rv		= MRV_OK;
 	char*		id_cur_consume	= NULL;
 	char*		id_cur_produce	= NULL;
@@ -69,9 +461,23 @@ meterd_rv meterd_measure_init(void)
 	int		raw_id_count	= 0;
 	counter_spec*	new_counter	= NULL;
 	counter_spec*	counter_it	= NULL;
+	int		write_queue	= DEFAULT_WRITE_QUEUE;
+	char*		write_overload	= NULL;
+	int		overload	= WRITE_OVERLOAD_DROP_RAW;
+	int*		window_lengths	= NULL;
+	int		window_count	= 0;
+	int		meter_interval	= 0;
 
 	INFO_MSG("Initialising measurement subsystem");
 
+	/* Keep track of the amount of data written to storage */
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		start_oublock = usage.ru_oublock;
+	}
+
+	meterd_telegram_init(&telegram);
+
 	/* Get database names */
 	if (meterd_conf_get_string("database", "raw_db", &raw_db_name, NULL) != MRV_OK)
 	{
@@ -93,10 +499,16 @@ meterd_rv meterd_measure_init(void)
 		WARNING_MSG("Failed to retrieve total consumption/production database name from the configuration");
 	}
 
+	if (meterd_conf_get_string("database", "single_db", &single_db_name, NULL) != MRV_OK)
+	{
+		WARNING_MSG("Failed to retrieve single database name from the configuration");
+	}
+
 	if ((raw_db_name == NULL) &&
 	    (fivemin_db_name == NULL) &&
 	    (hourly_db_name == NULL) &&
-	    (cumul_db_name == NULL))
+	    (cumul_db_name == NULL) &&
+	    (single_db_name == NULL))
 	{
 		ERROR_MSG("No databases configured, please fix the configuration");
 
@@ -104,46 +516,123 @@ meterd_rv meterd_measure_init(void)
 	}
 
 	/* Open databases */
-	if ((raw_db_name != NULL) && (meterd_db_open(raw_db_name, 0, &raw_db_h) != MRV_OK))
-	{
-		ERROR_MSG("Failed to open %s as raw database", raw_db_name);
-	}
-	else
+	if (single_db_name != NULL)
 	{
-		INFO_MSG("Writing raw measurement data to %s", raw_db_name);
-	}
+		/* All values are written to one database, so a telegram is committed in one transaction */
+		if ((raw_db_name != NULL) || (fivemin_db_name != NULL) || (hourly_db_name != NULL) || (cumul_db_name != NULL))
+		{
+			WARNING_MSG("Using the single database %s, ignoring separately configured databases", single_db_name);
+		}
 
-	if ((fivemin_db_name != NULL) && (meterd_db_open(fivemin_db_name, 0, &fivemin_db_h) != MRV_OK))
-	{
-		ERROR_MSG("Failed to open %s as 5 minute average database", fivemin_db_name);
+		if (meterd_db_open(single_db_name, 0, &raw_db_h) != MRV_OK)
+		{
+			ERROR_MSG("Failed to open %s as single database", single_db_name);
+		}
+		else
+		{
+			INFO_MSG("Writing all measurement data to %s", single_db_name);
+
+			fivemin_db_h	= raw_db_h;
+			hourly_db_h	= raw_db_h;
+			cumul_db_h	= raw_db_h;
+			single_db	= 1;
+		}
 	}
 	else
 	{
-		INFO_MSG("Writing 5 minute average values to %s", fivemin_db_name);
+		if ((raw_db_name != NULL) && (meterd_db_open(raw_db_name, 0, &raw_db_h) != MRV_OK))
+		{
+			ERROR_MSG("Failed to open %s as raw database", raw_db_name);
+		}
+		else
+		{
+			INFO_MSG("Writing raw measurement data to %s", raw_db_name);
+		}
+
+		if ((fivemin_db_name != NULL) && (meterd_db_open(fivemin_db_name, 0, &fivemin_db_h) != MRV_OK))
+		{
+			ERROR_MSG("Failed to open %s as 5 minute average database", fivemin_db_name);
+		}
+		else
+		{
+			INFO_MSG("Writing 5 minute average values to %s", fivemin_db_name);
+		}
+
+		if ((hourly_db_name != NULL) && (meterd_db_open(hourly_db_name, 0, &hourly_db_h) != MRV_OK))
+		{
+			ERROR_MSG("Failed to open %s as hourly average database", hourly_db_name);
+		}
+		else
+		{
+			INFO_MSG("Writing hourly average values to %s", hourly_db_name);
+		}
+
+		if ((cumul_db_name != NULL) && (meterd_db_open(cumul_db_name, 0, &cumul_db_h) != MRV_OK))
+		{
+			ERROR_MSG("Failed to open %s as cumulative consumption/production database", cumul_db_name);
+		}
+		else
+		{
+			INFO_MSG("Writing cumulative consumption/production data to %s", cumul_db_name);
+		}
 	}
 
-	if ((hourly_db_name != NULL) && (meterd_db_open(hourly_db_name, 0, &hourly_db_h) != MRV_OK))
+	/* Optionally write measurements to a staging database (e.g. on tmpfs) that is merged periodically */
+	if (meterd_conf_get_string("database", "staging_dir", &staging_dir, NULL) != MRV_OK)
 	{
-		ERROR_MSG("Failed to open %s as hourly average database", hourly_db_name);
+		WARNING_MSG("Failed to retrieve the staging directory from the configuration");
 	}
-	else
+
+	if (meterd_conf_get_int("database", "merge_interval", &merge_interval, DEFAULT_MERGE_INTERVAL) != MRV_OK)
 	{
-		INFO_MSG("Writing hourly average values to %s", hourly_db_name);
+		WARNING_MSG("Failed to retrieve the interval between merges of staged measurements from the configuration");
 	}
 
-	if ((cumul_db_name != NULL) && (meterd_db_open(cumul_db_name, 0, &cumul_db_h) != MRV_OK))
+	if (staging_dir != NULL)
 	{
-		ERROR_MSG("Failed to open %s as cumulative consumption/production database", cumul_db_name);
+		if (single_db)
+		{
+			meterd_measure_stage(raw_db_h, single_db_name, staging_dir);
+		}
+		else
+		{
+			meterd_measure_stage(raw_db_h, raw_db_name, staging_dir);
+			meterd_measure_stage(fivemin_db_h, fivemin_db_name, staging_dir);
+			meterd_measure_stage(hourly_db_h, hourly_db_name, staging_dir);
+			meterd_measure_stage(cumul_db_h, cumul_db_name, staging_dir);
+		}
+
+		if (staging)
+		{
+			INFO_MSG("Merging staged measurements every %d second(s)", merge_interval);
+		}
+
+		free(staging_dir);
 	}
-	else
+
+	last_merge = time(NULL);
+
+	/* Take over WAL checkpoints from SQLite, so they do not hold up writes; failures leave them to SQLite */
+	if (meterd_checkpoint_init() == MRV_OK)
 	{
-		INFO_MSG("Writing cumulative consumption/production data to %s", cumul_db_name);
+		if (single_db)
+		{
+			meterd_checkpoint_add(single_db_name, raw_db_h);
+		}
+		else
+		{
+			if (raw_db_h != NULL) meterd_checkpoint_add(raw_db_name, raw_db_h);
+			if (fivemin_db_h != NULL) meterd_checkpoint_add(fivemin_db_name, fivemin_db_h);
+			if (hourly_db_h != NULL) meterd_checkpoint_add(hourly_db_name, hourly_db_h);
+			if (cumul_db_h != NULL) meterd_checkpoint_add(cumul_db_name, cumul_db_h);
+		}
 	}
 
 	free(raw_db_name);
 	free(fivemin_db_name);
 	free(hourly_db_name);
 	free(cumul_db_name);
+	free(single_db_name);
 
 	if ((raw_db_h == NULL) &&
 	    (fivemin_db_h == NULL) &&
@@ -178,13 +667,20 @@ meterd_rv meterd_measure_init(void)
 		new_counter->description 	= strdup("Current consumption");
 		new_counter->id			= id_cur_consume;
 		new_counter->table_name		= meterd_conf_create_table_name(id_cur_consume, COUNTER_TYPE_RAW);
+		new_counter->fivemin_table_name	= NULL;
+		new_counter->hourly_table_name	= NULL;
+		new_counter->delta_table_name	= NULL;
+		memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+		memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+		new_counter->windows		= NULL;
+		new_counter->window_count	= 0;
 		new_counter->type		= COUNTER_TYPE_RAW;
-		new_counter->last_val		= 0.0f;
+		new_counter->last_val		= 0;
 		new_counter->last_ts		= 0;
-		new_counter->fivemin_cumul	= 0.0f;
+		new_counter->fivemin_cumul	= 0;
 		new_counter->fivemin_ctr	= 0;
 		new_counter->fivemin_ts		= 0;
-		new_counter->hourly_cumul	= 0.0f;
+		new_counter->hourly_cumul	= 0;
 		new_counter->hourly_ctr		= 0;
 		new_counter->hourly_ts		= 0;
 		new_counter->raw_db_h		= raw_db_h;
@@ -206,13 +702,20 @@ meterd_rv meterd_measure_init(void)
 		new_counter->description 	= strdup("Current production");
 		new_counter->id			= id_cur_produce;
 		new_counter->table_name		= meterd_conf_create_table_name(id_cur_produce, COUNTER_TYPE_RAW);
+		new_counter->fivemin_table_name	= NULL;
+		new_counter->hourly_table_name	= NULL;
+		new_counter->delta_table_name	= NULL;
+		memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+		memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+		new_counter->windows		= NULL;
+		new_counter->window_count	= 0;
 		new_counter->type		= COUNTER_TYPE_RAW;
-		new_counter->last_val		= 0.0f;
+		new_counter->last_val		= 0;
 		new_counter->last_ts		= 0;
-		new_counter->fivemin_cumul	= 0.0f;
+		new_counter->fivemin_cumul	= 0;
 		new_counter->fivemin_ctr	= 0;
 		new_counter->fivemin_ts		= 0;
-		new_counter->hourly_cumul	= 0.0f;
+		new_counter->hourly_cumul	= 0;
 		new_counter->hourly_ctr		= 0;
 		new_counter->hourly_ts		= 0;
 		new_counter->raw_db_h		= raw_db_h;
@@ -235,13 +738,20 @@ meterd_rv meterd_measure_init(void)
 			new_counter->description	= strdup("Raw counter");
 			new_counter->id			= strdup(raw_id[i]);
 			new_counter->table_name		= meterd_conf_create_table_name(new_counter->id, COUNTER_TYPE_RAW);
+			new_counter->fivemin_table_name	= NULL;
+			new_counter->hourly_table_name	= NULL;
+			new_counter->delta_table_name	= NULL;
+			memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+			memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+			new_counter->windows		= NULL;
+			new_counter->window_count	= 0;
 			new_counter->type		= COUNTER_TYPE_RAW;
-			new_counter->last_val		= 0.0f;
+			new_counter->last_val		= 0;
 			new_counter->last_ts		= 0;
-			new_counter->fivemin_cumul	= 0.0f;
+			new_counter->fivemin_cumul	= 0;
 			new_counter->fivemin_ctr	= 0;
 			new_counter->fivemin_ts		= 0;
-			new_counter->hourly_cumul	= 0.0f;
+			new_counter->hourly_cumul	= 0;
 			new_counter->hourly_ctr		= 0;
 			new_counter->hourly_ts		= 0;
 			new_counter->raw_db_h		= raw_db_h;
@@ -265,7 +775,7 @@ meterd_rv meterd_measure_init(void)
 
 	LL_FOREACH(new_counter, counter_it)
 	{
-		counter_it->last_val		= 0.0f;
+		counter_it->last_val		= 0;
 		counter_it->last_ts		= 0;
 		counter_it->cumul_rec_ts	= 0;
 		counter_it->cumul_db_h		= cumul_db_h;
@@ -284,7 +794,7 @@ meterd_rv meterd_measure_init(void)
 
 	LL_FOREACH(new_counter, counter_it)
 	{
-		counter_it->last_val		= 0.0f;
+		counter_it->last_val		= 0;
 		counter_it->last_ts		= 0;
 		counter_it->cumul_rec_ts	= 0;
 		counter_it->cumul_db_h		= cumul_db_h;
@@ -305,8 +815,15 @@ meterd_rv meterd_measure_init(void)
 		new_counter->id			= strdup(gas_id);
 		new_counter->description	= strdup("Gas");
 		new_counter->table_name		= meterd_conf_create_table_name(gas_id, COUNTER_TYPE_CONSUMED);
+		new_counter->fivemin_table_name	= NULL;
+		new_counter->hourly_table_name	= NULL;
+		new_counter->delta_table_name	= NULL;
+		memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+		memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+		new_counter->windows		= NULL;
+		new_counter->window_count	= 0;
 		new_counter->type		= COUNTER_TYPE_CONSUMED;
-		new_counter->last_val		= 0.0f;
+		new_counter->last_val		= 0;
 		new_counter->last_ts		= 0;
 		new_counter->cumul_rec_ts	= 0;
 		new_counter->cumul_db_h		= cumul_db_h;
@@ -314,12 +831,250 @@ meterd_rv meterd_measure_init(void)
 		LL_APPEND(counters, new_counter);
 	}
 
+	/* Set the table names for average values of raw counters */
+	LL_FOREACH(counters, counter_it)
+	{
+		if (counter_it->type != COUNTER_TYPE_RAW) continue;
+
+		if (single_db)
+		{
+			counter_it->fivemin_table_name	= meterd_conf_create_table_name(counter_it->id, COUNTER_TYPE_FIVEMIN);
+			counter_it->hourly_table_name	= meterd_conf_create_table_name(counter_it->id, COUNTER_TYPE_HOURLY);
+		}
+		else
+		{
+			counter_it->fivemin_table_name	= strdup(counter_it->table_name);
+			counter_it->hourly_table_name	= strdup(counter_it->table_name);
+		}
+	}
+
+	/* Keep daily and monthly aggregates in the database of the raw or cumulative values */
+	LL_FOREACH(counters, counter_it)
+	{
+		void*	agg_db_h	= (counter_it->type == COUNTER_TYPE_RAW) ? counter_it->raw_db_h : counter_it->cumul_db_h;
+
+		if (agg_db_h == NULL) continue;
+
+		counter_it->daily.table_name	= meterd_conf_create_table_name(counter_it->id, COUNTER_TYPE_DAILY);
+		counter_it->monthly.table_name	= meterd_conf_create_table_name(counter_it->id, COUNTER_TYPE_MONTHLY);
+
+		if (!meterd_db_has_table(agg_db_h, counter_it->daily.table_name) || !meterd_db_has_table(agg_db_h, counter_it->monthly.table_name))
+		{
+			if (meterd_db_has_table(agg_db_h, counter_it->table_name))
+			{
+				INFO_MSG("No aggregate tables for %s, run meterd-createdb -m to add them", counter_it->id);
+			}
+
+			free(counter_it->daily.table_name);
+			free(counter_it->monthly.table_name);
+
+			counter_it->daily.table_name	= NULL;
+			counter_it->monthly.table_name	= NULL;
+		}
+		else
+		{
+			/* Continue the aggregates of the current day and month if meterd was restarted during them */
+			time_t	now	= time(NULL);
+
+			meterd_db_aggregate_period(now, COUNTER_TYPE_DAILY, &counter_it->daily.start, &counter_it->daily.end);
+			meterd_db_aggregate_period(now, COUNTER_TYPE_MONTHLY, &counter_it->monthly.start, &counter_it->monthly.end);
+
+			meterd_db_load_aggregate(agg_db_h, &counter_it->daily);
+			meterd_db_load_aggregate(agg_db_h, &counter_it->monthly);
+		}
+	}
+
+	/* Aggregate the values over the configured windows, aligned to the wall clock */
+	if (meterd_conf_get_windows(&window_lengths, &window_count) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve the aggregation windows from the configuration");
+	}
+
+	if (meterd_conf_get_int("meter", "meter_interval", &meter_interval, 10) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve the meter interval from the configuration");
+	}
+
+	max_hold = HOLD_INTERVALS * ((meter_interval > 0) ? meter_interval : 10);
+
+	if (window_count > 0)
+	{
+		char	windows_buf[256]	= { 0 };
+		char	label[WINDOW_LABEL_LEN]	= { 0 };
+		int	i			= 0;
+
+		for (i = 0; i < window_count; i++)
+		{
+			meterd_conf_window_label(window_lengths[i], label, WINDOW_LABEL_LEN);
+
+			snprintf(windows_buf + strlen(windows_buf), 256 - strlen(windows_buf), "%s%s", (i > 0) ? ", " : "", label);
+		}
+
+		INFO_MSG("Aggregating values over windows of %s", windows_buf);
+	}
+
+	LL_FOREACH(counters, counter_it)
+	{
+		void*	agg_db_h	= (counter_it->type == COUNTER_TYPE_RAW) ? counter_it->raw_db_h : counter_it->cumul_db_h;
+
+		if (agg_db_h == NULL) continue;
+
+		if ((rv = meterd_measure_windows(counter_it, agg_db_h, window_lengths, window_count, time(NULL))) != MRV_OK)
+		{
+			ERROR_MSG("Failed to set up the aggregation windows of counter %s", counter_it->id);
+
+			free(window_lengths);
+
+			meterd_measure_finalize();
+
+			return rv;
+		}
+	}
+
+	free(window_lengths);
+
+	/* Record the differences between cumulative values, continuing from the last recorded value */
+	LL_FOREACH(counters, counter_it)
+	{
+		time_t	base_ts	= 0;
+
+		if ((counter_it->type == COUNTER_TYPE_RAW) || (counter_it->cumul_db_h == NULL)) continue;
+
+		counter_it->delta_table_name	= meterd_conf_create_table_name(counter_it->id, COUNTER_TYPE_DELTA);
+		counter_it->delta_base		= 0;
+		counter_it->delta_base_set	= 0;
+
+		if (!meterd_db_has_table(counter_it->cumul_db_h, counter_it->delta_table_name))
+		{
+			if (meterd_db_has_table(counter_it->cumul_db_h, counter_it->table_name))
+			{
+				INFO_MSG("No delta table for %s, run meterd-createdb -m to add it", counter_it->id);
+			}
+
+			free(counter_it->delta_table_name);
+
+			counter_it->delta_table_name	= NULL;
+		}
+		else if ((meterd_db_last_value(counter_it->cumul_db_h, counter_it->table_name, &counter_it->delta_base, &base_ts) == MRV_OK) && (base_ts > 0))
+		{
+			counter_it->delta_base_set	= 1;
+		}
+	}
+
+	/* Set up the telegram parser */
+	if ((rv = meterd_p1_parser_create(gas_id, P1_ENGINE_DEFAULT, &parser)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to initialise the P1 telegram parser");
+
+		meterd_measure_finalize();
+
+		return rv;
+	}
+
+	/* Index the counters and only decode the ones that are recorded */
+	LL_FOREACH(counters, counter_it)
+	{
+		if ((rv = meterd_measure_index_add(counter_it)) != MRV_OK)
+		{
+			ERROR_MSG("Failed to index counter %s", counter_it->id);
+
+			meterd_measure_finalize();
+
+			return rv;
+		}
+
+		if ((rv = meterd_p1_parser_add_filter(parser, counter_it->key)) != MRV_OK)
+		{
+			ERROR_MSG("Failed to add counter %s to the P1 telegram parser", counter_it->id);
+
+			meterd_measure_finalize();
+
+			return rv;
+		}
+	}
+
 	/* Get interval for recording total consumed/produced values */
 	if ((rv = meterd_conf_get_int("database", "total_interval", &total_interval, 300)) != MRV_OK)
 	{
 		ERROR_MSG("Failed to get interval between recording total consumed/produced values from the configuration");
 	}
 
+	/* Get the group commit window */
+	if ((rv = meterd_conf_get_int("database", "commit_telegrams", &commit_telegrams, 1)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to get the number of telegrams per commit from the configuration");
+	}
+
+	if ((rv = meterd_conf_get_int("database", "commit_interval", &commit_interval, 0)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to get the maximum interval between commits from the configuration");
+	}
+
+	if ((commit_telegrams <= 0) && (commit_interval <= 0))
+	{
+		WARNING_MSG("Neither commit_telegrams nor commit_interval is set, committing every telegram");
+
+		commit_telegrams = 1;
+	}
+
+	if ((commit_telegrams != 1) || (commit_interval > 0))
+	{
+		int	sync_normal	= 0;
+
+		INFO_MSG("Committing measurements every %d telegram(s) or %d second(s)", commit_telegrams, commit_interval);
+
+		if ((rv = meterd_conf_get_bool("database", "sync_normal", &sync_normal, 0)) != MRV_OK)
+		{
+			ERROR_MSG("Failed to get the disk synchronisation mode from the configuration");
+		}
+
+		if (sync_normal)
+		{
+			INFO_MSG("Using normal disk synchronisation");
+
+			if (raw_db_h != NULL) meterd_db_set_synchronous(raw_db_h, 1);
+			if (fivemin_db_h != NULL) meterd_db_set_synchronous(fivemin_db_h, 1);
+			if (hourly_db_h != NULL) meterd_db_set_synchronous(hourly_db_h, 1);
+			if (cumul_db_h != NULL) meterd_db_set_synchronous(cumul_db_h, 1);
+		}
+	}
+
+	last_commit = time(NULL);
+
+	/* Set up the database writer; the measurement loop only queues writes for it */
+	if ((rv = meterd_conf_get_int("database", "write_queue", &write_queue, DEFAULT_WRITE_QUEUE)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to get the size of the database write queue from the configuration");
+	}
+
+	if ((rv = meterd_conf_get_string("database", "write_overload", &write_overload, "drop_raw")) != MRV_OK)
+	{
+		ERROR_MSG("Failed to get the database write overload policy from the configuration");
+	}
+
+	if ((write_overload != NULL) && !strcmp(write_overload, "block"))
+	{
+		overload = WRITE_OVERLOAD_BLOCK;
+	}
+	else if ((write_overload != NULL) && strcmp(write_overload, "drop_raw"))
+	{
+		WARNING_MSG("Unknown database write overload policy %s, dropping raw values first", write_overload);
+	}
+
+	free(write_overload);
+
+	if (((rv = meterd_dbwriter_init((write_queue > 0) ? (size_t) write_queue : DEFAULT_WRITE_QUEUE, overload)) != MRV_OK) ||
+	    ((rv = meterd_dbwriter_start()) != MRV_OK))
+	{
+		ERROR_MSG("Failed to start the database writer");
+
+		meterd_measure_finalize();
+
+		return rv;
+	}
+
+	meterd_checkpoint_start();
+
 	/* Get optional filename to store raw telegrams in */
 	if ((rv = meterd_conf_get_string("telegram", "file", &telegram_file, NULL)) == MRV_OK)
 	{
@@ -330,6 +1085,9 @@ meterd_rv meterd_measure_init(void)
 			telegram_tmp = (char*) malloc((strlen(telegram_file) + strlen(".tmp") + 1) * sizeof(char));
 
 			sprintf(telegram_tmp, "%s.tmp", telegram_file);
+
+			/* Only keep the lines of the telegram if it needs to be stored */
+			meterd_p1_parser_record(parser, &telegram);
 		}
 	}
 
@@ -337,18 +1095,19 @@ meterd_rv meterd_measure_init(void)
 }
 
 /* Output the raw telegram to a file */
-static void dump_telegram(telegram_ll* p1)
+static void dump_telegram(const p1_telegram* p1)
 {
 	FILE*		dump_tmp	= NULL;
-	telegram_ll*	p1_it		= NULL;
+	size_t		i		= 0;
 
 	if (!telegram_file || !telegram_tmp) return;
 
 	if ((dump_tmp = fopen(telegram_tmp, "w")) != NULL)
 	{
-		LL_FOREACH(p1, p1_it)
+		for (i = 0; i < p1->line_count; i++)
 		{
-			fprintf(dump_tmp, "%s\n", p1_it->t_line);
+			fwrite(TELEGRAM_LINE(p1, i), 1, TELEGRAM_LINE_LEN(p1, i), dump_tmp);
+			fputc('\n', dump_tmp);
 		}
 
 		fclose(dump_tmp);
@@ -361,14 +1120,17 @@ static void dump_telegram(telegram_ll* p1)
 void meterd_measure_loop(void)
 {
 	meterd_rv	rv		= MRV_OK;
-	telegram_ll*	p1		= NULL;
 	smart_counter*	p1_counters	= NULL;
 	smart_counter*	p1_ctr_it	= NULL;
 	counter_spec*	ctr_it		= NULL;
 
 	while(run_measurement)
 	{
-		if ((rv = meterd_comm_recv_p1(&p1)) != MRV_OK)
+		const char*	data		= NULL;
+		size_t		data_len	= 0;
+		size_t		consumed	= 0;
+
+		if ((rv = meterd_comm_recv(&data, &data_len)) != MRV_OK)
 		{
 			if (rv == MRV_COMM_INTR)
 			{
@@ -382,83 +1144,132 @@ void meterd_measure_loop(void)
 			break;
 		}
 
-		/* Dump the telegram */
-		dump_telegram(p1);
+		/* Decode the received data; counters are added as their lines arrive */
+		rv = meterd_p1_parser_push(parser, data, data_len, &consumed, &p1_counters);
+
+		meterd_comm_consume(consumed);
 
-		/* Parse the telegram */
-		if (meterd_parse_p1_telegram(p1, gas_id, &p1_counters) == MRV_OK)
+		if (rv == MRV_P1_MORE_DATA)
+		{
+			continue;
+		}
+
+		/* Telegrams that failed the CRC check or could not be processed were discarded by the parser */
+		if (rv == MRV_OK)
 		{
 			time_t 	now 	= time(NULL);
 			int 	db_ts	= (int) now;
 
+			/* Dump the telegram */
+			dump_telegram(&telegram);
+
+			/* Record all values of the telegram in one transaction */
+			meterd_measure_begin();
+
 			/* Record values of the counters where appropriate */
 			LL_FOREACH(p1_counters, p1_ctr_it)
 			{
-				LL_FOREACH(counters, ctr_it)
+				counter_index*	idx		= NULL;
+				obis_key	key		= OBIS_CDE(p1_ctr_it->id);
+				int		i		= 0;
+				int		j		= 0;
+				void*		agg_db_h	= NULL;
+
+				HASH_FIND(hh, counter_idx, &key, sizeof(obis_key), idx);
+
+				if (idx == NULL) continue;
+
+				for (i = 0; i < idx->spec_count; i++)
 				{
-					if (!strcmp(ctr_it->id, p1_ctr_it->id))
+					ctr_it = idx->specs[i];
+
+					ctr_it->last_val 	= 	p1_ctr_it->value;
+					ctr_it->last_ts		= 	now;
+
+					/* Fold the value into the daily, monthly and window aggregates */
+					agg_db_h = (ctr_it->type == COUNTER_TYPE_RAW) ? ctr_it->raw_db_h : ctr_it->cumul_db_h;
+
+					meterd_measure_aggregate(agg_db_h, &ctr_it->daily, COUNTER_TYPE_DAILY, p1_ctr_it->value, p1_ctr_it->unit, now);
+					meterd_measure_aggregate(agg_db_h, &ctr_it->monthly, COUNTER_TYPE_MONTHLY, p1_ctr_it->value, p1_ctr_it->unit, now);
+
+					for (j = 0; j < ctr_it->window_count; j++)
 					{
-						ctr_it->last_val 	= 	p1_ctr_it->value;
-						ctr_it->last_ts		= 	now;
+						meterd_measure_aggregate(agg_db_h, &ctr_it->windows[j], COUNTER_TYPE_WINDOW, p1_ctr_it->value, p1_ctr_it->unit, now);
+					}
 
-						if (ctr_it->type == COUNTER_TYPE_RAW)
-						{
-							ctr_it->fivemin_cumul	+= 	p1_ctr_it->value;
-							ctr_it->fivemin_ctr++;
-							ctr_it->hourly_cumul	+=	p1_ctr_it->value;
-							ctr_it->hourly_ctr++;
+					if (ctr_it->type == COUNTER_TYPE_RAW)
+					{
+						ctr_it->fivemin_cumul	+= 	p1_ctr_it->value;
+						ctr_it->fivemin_ctr++;
+						ctr_it->hourly_cumul	+=	p1_ctr_it->value;
+						ctr_it->hourly_ctr++;
 
-							if (ctr_it->raw_db_h != NULL)
-							{
-								meterd_db_record(ctr_it->raw_db_h, ctr_it->table_name, p1_ctr_it->value, p1_ctr_it->unit, db_ts);
-								DEBUG_MSG("Recorded %Lf %s for %s as raw value", p1_ctr_it->value, p1_ctr_it->unit, ctr_it->id);
-							}
+						if (ctr_it->raw_db_h != NULL)
+						{
+							meterd_dbwriter_record(ctr_it->raw_db_h, ctr_it->table_name, p1_ctr_it->value, p1_ctr_it->unit, db_ts, WRITE_PRIO_LOW);
+							DEBUG_MSG("Recorded " FIXED_FMT " %s for %s as raw value", FIXED_ARGS(p1_ctr_it->value), meterd_unit_name(p1_ctr_it->unit), ctr_it->id);
+						}
 
-							if ((ctr_it->fivemin_db_h != NULL) && ((now - ctr_it->fivemin_ts) >= 300))
-							{
-								ctr_it->fivemin_cumul /= (long double) ctr_it->fivemin_ctr;
+						if ((ctr_it->fivemin_db_h != NULL) && ((now - ctr_it->fivemin_ts) >= 300))
+						{
+							ctr_it->fivemin_cumul = meterd_measure_average(ctr_it->fivemin_cumul, ctr_it->fivemin_ctr);
 
-								meterd_db_record(ctr_it->fivemin_db_h, ctr_it->table_name, ctr_it->fivemin_cumul, p1_ctr_it->unit, db_ts);
-								DEBUG_MSG("Recorded %Lf %s for %s as 5 minute average", ctr_it->fivemin_cumul, p1_ctr_it->unit, ctr_it->id);
+							meterd_dbwriter_record(ctr_it->fivemin_db_h, ctr_it->fivemin_table_name, ctr_it->fivemin_cumul, p1_ctr_it->unit, db_ts, WRITE_PRIO_HIGH);
+							DEBUG_MSG("Recorded " FIXED_FMT " %s for %s as 5 minute average", FIXED_ARGS(ctr_it->fivemin_cumul), meterd_unit_name(p1_ctr_it->unit), ctr_it->id);
 
-								ctr_it->fivemin_cumul 	= 0.0f;
-								ctr_it->fivemin_ctr 	= 0;
-								ctr_it->fivemin_ts	= now;
-							}
+							ctr_it->fivemin_cumul 	= 0;
+							ctr_it->fivemin_ctr 	= 0;
+							ctr_it->fivemin_ts	= now;
+						}
 
-							if ((ctr_it->hourly_db_h != NULL) && ((now - ctr_it->hourly_ts) >= 3600))
-							{
-								ctr_it->hourly_cumul /= (long double) ctr_it->hourly_ctr;
+						if ((ctr_it->hourly_db_h != NULL) && ((now - ctr_it->hourly_ts) >= 3600))
+						{
+							ctr_it->hourly_cumul = meterd_measure_average(ctr_it->hourly_cumul, ctr_it->hourly_ctr);
 
-								meterd_db_record(ctr_it->hourly_db_h, ctr_it->table_name, ctr_it->hourly_cumul, p1_ctr_it->unit, db_ts);
-								DEBUG_MSG("Recorded %Lf %s for %s as hourly average", ctr_it->hourly_cumul, p1_ctr_it->unit, ctr_it->id);
+							meterd_dbwriter_record(ctr_it->hourly_db_h, ctr_it->hourly_table_name, ctr_it->hourly_cumul, p1_ctr_it->unit, db_ts, WRITE_PRIO_HIGH);
+							DEBUG_MSG("Recorded " FIXED_FMT " %s for %s as hourly average", FIXED_ARGS(ctr_it->hourly_cumul), meterd_unit_name(p1_ctr_it->unit), ctr_it->id);
 
-								ctr_it->hourly_cumul 	= 0.0f;
-								ctr_it->hourly_ctr 	= 0;
-								ctr_it->hourly_ts	= now;
-							}
+							ctr_it->hourly_cumul 	= 0;
+							ctr_it->hourly_ctr 	= 0;
+							ctr_it->hourly_ts	= now;
 						}
-						else
+					}
+					else
+					{
+						if ((ctr_it->cumul_db_h != NULL) && ((now - ctr_it->cumul_rec_ts) >= total_interval))
 						{
-							if ((ctr_it->cumul_db_h != NULL) && ((now - ctr_it->cumul_rec_ts) >= total_interval))
+							meterd_dbwriter_record(ctr_it->cumul_db_h, ctr_it->table_name, p1_ctr_it->value, p1_ctr_it->unit, db_ts, WRITE_PRIO_HIGH);
+							ctr_it->cumul_rec_ts = now;
+							DEBUG_MSG("Recorded " FIXED_FMT " %s for %s as cumulative value", FIXED_ARGS(p1_ctr_it->value), meterd_unit_name(p1_ctr_it->unit), ctr_it->id);
+
+							if (ctr_it->delta_table_name != NULL)
 							{
-								meterd_db_record(ctr_it->cumul_db_h, ctr_it->table_name, p1_ctr_it->value, p1_ctr_it->unit, db_ts);
-								ctr_it->cumul_rec_ts = now;
-								DEBUG_MSG("Recorded %Lf %s for %s as cumulative value", p1_ctr_it->value, p1_ctr_it->unit, ctr_it->id);
+								meterd_measure_delta(ctr_it, p1_ctr_it->value, p1_ctr_it->unit, db_ts);
 							}
 						}
 					}
 				}
 			}
-		}
 
-		meterd_comm_telegram_free(p1);
-		p1 = NULL;
+			pending_telegrams++;
+
+			if (((commit_telegrams > 0) && (pending_telegrams >= commit_telegrams)) ||
+			    ((commit_interval > 0) && ((now - last_commit) >= commit_interval)))
+			{
+				meterd_measure_flush(now, 0);
+			}
+
+			/* Hand the writes of this telegram to the database writer */
+			meterd_dbwriter_notify();
+		}
 
 		meterd_p1_counters_free(p1_counters);
 		p1_counters = NULL;
 		p1_ctr_it = NULL;
 	}
+
+	/* Release counters from an incomplete telegram */
+	meterd_p1_counters_free(p1_counters);
 }
 
 /* Stop measuring */
@@ -467,25 +1278,81 @@ void meterd_measure_interrupt(void)
 	INFO_MSG("Cancelling measurement");
 
 	run_measurement = 0;
+
+	/* The signal may have been delivered to another thread */
+	meterd_comm_interrupt();
 }
 
 /* Uninitialise measuring */
 meterd_rv meterd_measure_finalize(void)
 {
+	dbwriter_stats	stats;
+	struct rusage	usage;
+
+	memset(&stats, 0, sizeof(dbwriter_stats));
+
 	INFO_MSG("Finalizing measurements");
 
 	/* Uninitialise communications */
 	meterd_comm_finalize();
 
+	/* Commit measurements that are still pending and wait until everything is written */
+	meterd_measure_flush(time(NULL), 1);
+
+	meterd_dbwriter_stop();
+	meterd_dbwriter_get_stats(&stats);
+	meterd_dbwriter_finalize();
+
+	/* Stop checkpointing; the WAL is checkpointed one last time when the databases are closed */
+	meterd_checkpoint_stop();
+	meterd_checkpoint_finalize();
+
 	/* Free counter specifications */
+	meterd_measure_index_free();
 	meterd_conf_free_counter_specs(counters);
 	counters = NULL;
 
-	/* Close database connections */
+	/* Close database connections; in the single database layout these share one handle */
 	meterd_db_close(raw_db_h);
-	meterd_db_close(fivemin_db_h);
-	meterd_db_close(hourly_db_h);
-	meterd_db_close(cumul_db_h);
+
+	if (!single_db)
+	{
+		meterd_db_close(fivemin_db_h);
+		meterd_db_close(hourly_db_h);
+		meterd_db_close(cumul_db_h);
+	}
+
+	raw_db_h	= NULL;
+	fivemin_db_h	= NULL;
+	hourly_db_h	= NULL;
+	cumul_db_h	= NULL;
+
+	/* Block output is counted in 512 byte units; writes to tmpfs are not counted */
+	if ((getrusage(RUSAGE_SELF, &usage) == 0) && (stats.recorded > 0))
+	{
+		long long	written	= (long long) (usage.ru_oublock - start_oublock) * 512;
+
+		INFO_MSG("Wrote %lld bytes to storage for %llu measurement(s), %.1f bytes per measurement", written, stats.recorded, (double) written / stats.recorded);
+	}
+
+	/* Release the telegram parser */
+	if (parser != NULL)
+	{
+		unsigned long long	good	= 0;
+		unsigned long long	bad	= 0;
+
+		meterd_p1_parser_get_stats(parser, &good, &bad);
+
+		INFO_MSG("Received %llu telegrams with a valid CRC and %llu with an invalid CRC", good, bad);
+	}
+
+	meterd_p1_parser_destroy(parser);
+	parser = NULL;
+
+	/* Release the telegram buffer */
+	meterd_telegram_free(&telegram);
+
+	meterd_units_free();
 
 	free(gas_id);
 	free(telegram_file);
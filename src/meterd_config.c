@@ -45,11 +45,17 @@
 /* The configuration */
 config_t configuration;
 
-static const char* prefixes[3] =
+static const char* prefixes[9] =
 {
 	TABLE_PREFIX_RAW,
 	TABLE_PREFIX_CONSUMED,
-	TABLE_PREFIX_PRODUCED
+	TABLE_PREFIX_PRODUCED,
+	TABLE_PREFIX_FIVEMIN,
+	TABLE_PREFIX_HOURLY,
+	TABLE_PREFIX_DAILY,
+	TABLE_PREFIX_MONTHLY,
+	TABLE_PREFIX_DELTA,
+	TABLE_PREFIX_WINDOW
 };
 
 /* Initialise the configuration handler */
@@ -319,6 +325,13 @@ meterd_rv meterd_conf_get_counter_specs(const char* base_path, const char* sub_p
 		new_counter->description 	= strdup(description);
 		new_counter->id			= strdup(id);
 		new_counter->table_name		= meterd_conf_create_table_name(id, type);
+		new_counter->fivemin_table_name	= NULL;
+		new_counter->hourly_table_name	= NULL;
+		new_counter->delta_table_name	= NULL;
+		memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+		memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+		new_counter->windows		= NULL;
+		new_counter->window_count	= 0;
 		new_counter->type		= type;
 
 		LL_APPEND((*counter_specs), new_counter);
@@ -353,6 +366,161 @@ char* meterd_conf_create_table_name(const char* id, int type)
 	return strdup(table_name_buf);
 }
 
+/* Convert a counter ID to the table name for its aggregates over the window of the specified length */
+char* meterd_conf_create_window_table_name(const char* id, int length)
+{
+	char*	table_name		= meterd_conf_create_table_name(id, COUNTER_TYPE_WINDOW);
+	char	table_name_buf[256]	= { 0 };
+
+	if (table_name == NULL)
+	{
+		return NULL;
+	}
+
+	snprintf(table_name_buf, 256, "%s%d_%s", TABLE_PREFIX_WINDOW, length, table_name + strlen(TABLE_PREFIX_WINDOW));
+
+	free(table_name);
+
+	return strdup(table_name_buf);
+}
+
+/* Parse the length of an aggregation window, a number of seconds optionally followed by s, m, h or d */
+meterd_rv meterd_conf_parse_window(const char* window, int* length)
+{
+	char*	end	= NULL;
+	long	value	= 0;
+
+	if ((window == NULL) || (length == NULL))
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	value = strtol(window, &end, 10);
+
+	if ((end == window) || (value <= 0) || (value > 86400))
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	switch(*end)
+	{
+	case 'd':
+		value *= 86400;
+		end++;
+		break;
+	case 'h':
+		value *= 3600;
+		end++;
+		break;
+	case 'm':
+		value *= 60;
+		end++;
+		break;
+	case 's':
+		end++;
+		break;
+	default:
+		break;
+	}
+
+	/* Windows are aligned to local midnight, so a day must consist of whole windows */
+	if ((*end != '\0') || (value > 86400) || ((86400 % value) != 0))
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	*length = (int) value;
+
+	return MRV_OK;
+}
+
+/* Get the label of the window of the specified length in the largest whole unit (e.g. "15m") */
+void meterd_conf_window_label(int length, char* label, size_t label_len)
+{
+	if ((length % 86400) == 0)
+	{
+		snprintf(label, label_len, "%dd", length / 86400);
+	}
+	else if ((length % 3600) == 0)
+	{
+		snprintf(label, label_len, "%dh", length / 3600);
+	}
+	else if ((length % 60) == 0)
+	{
+		snprintf(label, label_len, "%dm", length / 60);
+	}
+	else
+	{
+		snprintf(label, label_len, "%ds", length);
+	}
+}
+
+/* Retrieve the lengths of the configured aggregation windows in ascending order; note: caller must free lengths */
+meterd_rv meterd_conf_get_windows(int** lengths, int* count)
+{
+	char**		windows		= NULL;
+	int		window_count	= 0;
+	int		i		= 0;
+	int		j		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	if ((lengths == NULL) || (count == NULL))
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	*lengths	= NULL;
+	*count		= 0;
+
+	if ((rv = meterd_conf_get_string_array("database", "windows", &windows, &window_count)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	if (window_count == 0)
+	{
+		return MRV_OK;
+	}
+
+	*lengths = (int*) malloc(window_count * sizeof(int));
+
+	if (*lengths == NULL)
+	{
+		meterd_conf_free_string_array(windows, window_count);
+
+		return MRV_MEMORY;
+	}
+
+	for (i = 0; i < window_count; i++)
+	{
+		int	length	= 0;
+
+		if (meterd_conf_parse_window(windows[i], &length) != MRV_OK)
+		{
+			WARNING_MSG("Invalid aggregation window %s, windows must divide a day into whole parts (e.g. 1m, 15m, 1h or 1d)", windows[i]);
+
+			continue;
+		}
+
+		/* Insert in order, skipping duplicates */
+		for (j = *count; (j > 0) && ((*lengths)[j - 1] > length); j--);
+
+		if ((j > 0) && ((*lengths)[j - 1] == length))
+		{
+			continue;
+		}
+
+		memmove(&(*lengths)[j + 1], &(*lengths)[j], (*count - j) * sizeof(int));
+
+		(*lengths)[j] = length;
+		(*count)++;
+	}
+
+	meterd_conf_free_string_array(windows, window_count);
+
+	return MRV_OK;
+}
+
 /* Clean up counter specifications */
 void meterd_conf_free_counter_specs(counter_spec* counter_specs)
 {
@@ -366,6 +534,18 @@ void meterd_conf_free_counter_specs(counter_spec* counter_specs)
 		free(ctr_it->description);
 		free(ctr_it->id);
 		free(ctr_it->table_name);
+		free(ctr_it->fivemin_table_name);
+		free(ctr_it->hourly_table_name);
+		free(ctr_it->daily.table_name);
+		free(ctr_it->monthly.table_name);
+		free(ctr_it->delta_table_name);
+
+		while (ctr_it->window_count > 0)
+		{
+			free(ctr_it->windows[--ctr_it->window_count].table_name);
+		}
+
+		free(ctr_it->windows);
 		free(ctr_it);
 	}
 }
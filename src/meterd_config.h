@@ -61,6 +61,18 @@ meterd_rv meterd_conf_get_counter_specs(const char* base_path, const char* sub_p
 /* Convert a counter ID to a table name */
 char* meterd_conf_create_table_name(const char* id, int type);
 
+/* Convert a counter ID to the table name for its aggregates over the window of the specified length */
+char* meterd_conf_create_window_table_name(const char* id, int length);
+
+/* Parse the length of an aggregation window, a number of seconds optionally followed by s, m, h or d */
+meterd_rv meterd_conf_parse_window(const char* window, int* length);
+
+/* Get the label of the window of the specified length in the largest whole unit (e.g. "15m") */
+void meterd_conf_window_label(int length, char* label, size_t label_len);
+
+/* Retrieve the lengths of the configured aggregation windows in ascending order; note: caller must free lengths */
+meterd_rv meterd_conf_get_windows(int** lengths, int* count);
+
 /* Clean up counter specifications */
 void meterd_conf_free_counter_specs(counter_spec* counter_specs);
 
@@ -39,6 +39,9 @@
 #include "db.h"
 #include "utlist.h"
 
+/* Default number of rows copied per step when migrating */
+#define DEFAULT_MIGRATE_CHUNK	10000
+
 void version(void)
 {
 	printf("Smart Meter Monitoring Daemon (meterd) version %s\n", VERSION);
@@ -55,126 +58,289 @@ void usage(void)
 	printf("Database initialisation utility\n");
 	printf("Usage:\n");
 	printf("\tmeterd-createdb [-c <config>] [-f]\n");
+	printf("\tmeterd-createdb [-c <config>] -m [-n <rows>]\n");
+	printf("\tmeterd-createdb [-c <config>] -I\n");
 	printf("\tmeterd-createdb -h\n");
 	printf("\tmeterd-createdb -v\n");
 	printf("\n");
 	printf("\t-c <config>   Use <config> as configuration file\n");
 	printf("\t              Defaults to %s\n", DEFAULT_METERD_CONF);
 	printf("\t-f            Force overwriting of existing databases\n");
+	printf("\t-I            Import the separate databases into the single database\n");
+	printf("\t              configured as database.single_db\n");
+	printf("\t-m            Migrate existing databases to the current schema;\n");
+	printf("\t              this can be done while meterd is running\n");
+	printf("\t-n <rows>     Number of rows to copy at a time when migrating\n");
+	printf("\t              Defaults to %d\n", DEFAULT_MIGRATE_CHUNK);
 	printf("\n");
 	printf("\t-h            Print this help message\n");
 	printf("\n");
 	printf("\t-v            Print the version number\n");
 }
 
-meterd_rv meterd_createdb_raw(const char* type, int force_overwrite)
+/* Add a counter specification for the specified ID to the list */
+static meterd_rv meterd_createdb_add_spec(const char* id, const char* id_suffix, const char* description, int type, counter_spec** ctr_specs)
 {
-	assert(type != NULL);
+	counter_spec*	new_counter	= (counter_spec*) malloc(sizeof(counter_spec));
+	char		id_buf[256]	= { 0 };
 
-	char*		db_name		= NULL;
+	if (new_counter == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	snprintf(id_buf, 256, "%s%s", id, id_suffix);
+
+	new_counter->description 	= strdup(description);
+	new_counter->id			= strdup(id_buf);
+	new_counter->table_name		= meterd_conf_create_table_name(id, type);
+	new_counter->fivemin_table_name	= NULL;
+	new_counter->hourly_table_name	= NULL;
+	new_counter->delta_table_name	= NULL;
+	memset(&new_counter->daily, 0, sizeof(meterd_aggregate));
+	memset(&new_counter->monthly, 0, sizeof(meterd_aggregate));
+	new_counter->windows		= NULL;
+	new_counter->window_count	= 0;
+	new_counter->type		= type;
+
+	LL_APPEND(*ctr_specs, new_counter);
+
+	return MRV_OK;
+}
+
+/* Retrieve the specifications of the raw counters; the table names are prefixed according to type */
+static meterd_rv meterd_createdb_raw_specs(int type, const char* id_suffix, counter_spec** ctr_specs)
+{
 	char*		id_cur_consume	= NULL;
 	char*		id_cur_produce	= NULL;
-	void*		db_handle	= NULL;
 	meterd_rv	rv		= MRV_OK;
-	counter_spec*	ctr_specs	= NULL;
 
-	/* Check if the database type is configured */
-	if ((rv = meterd_conf_get_string("database", type, &db_name, NULL)) != MRV_OK)
+	/* Retrieve counters for current consumption and production */
+	if ((rv = meterd_conf_get_string("database", "current_consumption_id", &id_cur_consume, NULL)) != MRV_OK)
 	{
-		ERROR_MSG("Failed to retrieve configuration option database.%s", type);
+		ERROR_MSG("Failed to retrieve configuration option database.current_consumption");
 
 		return rv;
 	}
 
-	if (db_name == NULL)
+	if ((id_cur_consume != NULL) && ((rv = meterd_createdb_add_spec(id_cur_consume, id_suffix, "Current consumption", type, ctr_specs)) != MRV_OK))
 	{
-		INFO_MSG("No database of type %s configured", type);
+		free(id_cur_consume);
 
-		return MRV_OK;
+		return rv;
 	}
 
-	/* Retrieve counters for current consumption and production */
-	if ((rv = meterd_conf_get_string("database", "current_consumption_id", &id_cur_consume, NULL)) != MRV_OK)
+	free(id_cur_consume);
+
+	if ((rv = meterd_conf_get_string("database", "current_production_id", &id_cur_produce, NULL)) != MRV_OK)
 	{
-		ERROR_MSG("Failed to retrieve configuration option database.current_consumption");
+		ERROR_MSG("Failed to retrieve configuration option database.current_production");
 
-		free(db_name);
+		return rv;
+	}
+
+	if ((id_cur_produce != NULL) && ((rv = meterd_createdb_add_spec(id_cur_produce, id_suffix, "Current production", type, ctr_specs)) != MRV_OK))
+	{
+		free(id_cur_produce);
 
 		return rv;
 	}
 
-	if (id_cur_consume != NULL)
+	free(id_cur_produce);
+
+	return MRV_OK;
+}
+
+/* Add a specification for the aggregates of the counter with the specified ID over the window of the specified length */
+static meterd_rv meterd_createdb_add_window_spec(const char* id, const char* description, int length, counter_spec** ctr_specs)
+{
+	counter_spec*	new_spec			= NULL;
+	char		id_suffix[WINDOW_LABEL_LEN + 1]	= { 0 };
+	meterd_rv	rv				= MRV_OK;
+
+	/* The ID of the window is that of the counter plus its label (e.g. 1.7.0/15m) */
+	id_suffix[0] = '/';
+
+	meterd_conf_window_label(length, &id_suffix[1], WINDOW_LABEL_LEN);
+
+	if ((rv = meterd_createdb_add_spec(id, id_suffix, description, COUNTER_TYPE_WINDOW, &new_spec)) != MRV_OK)
+	{
+		return rv;
+	}
+
+	free(new_spec->table_name);
+
+	if ((new_spec->table_name = meterd_conf_create_window_table_name(id, length)) == NULL)
 	{
-		counter_spec* new_counter = (counter_spec*) malloc(sizeof(counter_spec));
+		meterd_conf_free_counter_specs(new_spec);
+
+		return MRV_MEMORY;
+	}
+
+	LL_CONCAT(*ctr_specs, new_spec);
 
-		if (new_counter == NULL)
+	return MRV_OK;
+}
+
+/* Add specifications for the daily, monthly and window aggregates of the counters in the list */
+static meterd_rv meterd_createdb_aggregate_specs(counter_spec** ctr_specs)
+{
+	counter_spec*	agg_specs	= NULL;
+	counter_spec*	ctr_it		= NULL;
+	int*		window_lengths	= NULL;
+	int		window_count	= 0;
+	int		i		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	if ((rv = meterd_conf_get_windows(&window_lengths, &window_count)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.windows");
+
+		return rv;
+	}
+
+	LL_FOREACH(*ctr_specs, ctr_it)
+	{
+		if (((rv = meterd_createdb_add_spec(ctr_it->id, ID_SUFFIX_DAILY, ctr_it->description, COUNTER_TYPE_DAILY, &agg_specs)) != MRV_OK) ||
+		    ((rv = meterd_createdb_add_spec(ctr_it->id, ID_SUFFIX_MONTHLY, ctr_it->description, COUNTER_TYPE_MONTHLY, &agg_specs)) != MRV_OK))
 		{
-			free(db_name);
-			free(id_cur_consume);
+			break;
+		}
 
-			return MRV_MEMORY;
+		for (i = 0; (i < window_count) && (rv == MRV_OK); i++)
+		{
+			rv = meterd_createdb_add_window_spec(ctr_it->id, ctr_it->description, window_lengths[i], &agg_specs);
 		}
 
-		new_counter->description 	= strdup("Current consumption");
-		new_counter->id			= strdup(id_cur_consume);
-		new_counter->table_name		= meterd_conf_create_table_name(id_cur_consume, COUNTER_TYPE_RAW);
-		new_counter->type		= COUNTER_TYPE_RAW;
+		if (rv != MRV_OK) break;
+	}
 
-		LL_APPEND(ctr_specs, new_counter);
+	free(window_lengths);
 
-		free(id_cur_consume);
+	if (rv != MRV_OK)
+	{
+		meterd_conf_free_counter_specs(agg_specs);
+
+		return rv;
 	}
 
-	if ((rv = meterd_conf_get_string("database", "current_production_id", &id_cur_produce, NULL)) != MRV_OK)
-	{
-		ERROR_MSG("Failed to retrieve configuration option database.current_production");
+	LL_CONCAT(*ctr_specs, agg_specs);
 
-		free(db_name);
-		meterd_conf_free_counter_specs(ctr_specs);
+	return MRV_OK;
+}
+
+/* Add the tables for the configured aggregation windows that the specified database does not have yet */
+static meterd_rv meterd_createdb_add_windows(void* db_handle)
+{
+	int*		window_lengths			= NULL;
+	int		window_count			= 0;
+	int		i				= 0;
+	char		id_suffix[WINDOW_LABEL_LEN + 1]	= { 0 };
+	meterd_rv	rv				= MRV_OK;
+
+	if ((rv = meterd_conf_get_windows(&window_lengths, &window_count)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.windows");
 
 		return rv;
 	}
 
-	if (id_cur_produce != NULL)
+	for (i = 0; (i < window_count) && (rv == MRV_OK); i++)
+	{
+		id_suffix[0] = '/';
+
+		meterd_conf_window_label(window_lengths[i], &id_suffix[1], WINDOW_LABEL_LEN);
+
+		rv = meterd_db_add_window(db_handle, window_lengths[i], id_suffix);
+	}
+
+	free(window_lengths);
+
+	return rv;
+}
+
+/* Add specifications for the differences between the recorded values of the cumulative counters in the list */
+static meterd_rv meterd_createdb_delta_specs(counter_spec** ctr_specs)
+{
+	counter_spec*	delta_specs	= NULL;
+	counter_spec*	ctr_it		= NULL;
+	meterd_rv	rv		= MRV_OK;
+
+	LL_FOREACH(*ctr_specs, ctr_it)
 	{
-		counter_spec* new_counter = (counter_spec*) malloc(sizeof(counter_spec));
+		if ((ctr_it->type != COUNTER_TYPE_CONSUMED) && (ctr_it->type != COUNTER_TYPE_PRODUCED)) continue;
 
-		if (new_counter == NULL)
+		if ((rv = meterd_createdb_add_spec(ctr_it->id, ID_SUFFIX_DELTA, ctr_it->description, COUNTER_TYPE_DELTA, &delta_specs)) != MRV_OK)
 		{
-			free(db_name);
-			free(id_cur_consume);
-			meterd_conf_free_counter_specs(ctr_specs);
+			meterd_conf_free_counter_specs(delta_specs);
 
-			return MRV_MEMORY;
+			return rv;
 		}
+	}
 
-		new_counter->description 	= strdup("Current production");
-		new_counter->id 		= strdup(id_cur_produce);
-		new_counter->table_name		= meterd_conf_create_table_name(id_cur_produce, COUNTER_TYPE_RAW);
-		new_counter->type		= COUNTER_TYPE_RAW;
+	LL_CONCAT(*ctr_specs, delta_specs);
 
-		LL_APPEND(ctr_specs, new_counter);
+	return MRV_OK;
+}
 
-		free(id_cur_produce);
+/* Retrieve the specifications of the consumption, production and gas counters */
+static meterd_rv meterd_createdb_counter_specs(counter_spec** counters)
+{
+	char*		gas_id		= NULL;
+	char*		gas_description	= NULL;
+	meterd_rv	rv		= MRV_OK;
+
+	/* Retrieve the consumption counters */
+	if ((rv = meterd_conf_get_counter_specs("database", "consumption", COUNTER_TYPE_CONSUMED, counters)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve consumption counter configuration");
+
+		return rv;
 	}
 
-	if (ctr_specs == NULL)
+	/* Retrieve the production counters */
+	if ((rv = meterd_conf_get_counter_specs("database", "production", COUNTER_TYPE_PRODUCED, counters)) != MRV_OK)
 	{
-		INFO_MSG("No raw consumption or production counters specified, skipping creation of database %s of type %s", db_name, type);
+		ERROR_MSG("Failed to retrieve production counter configuration");
 
-		free(db_name);
+		return rv;
+	}
 
-		return MRV_OK;
+	/* Check if there is a gas counter configured */
+	if (((rv = meterd_conf_get_string("database.gascounter", "id", &gas_id, NULL)) != MRV_OK) ||
+	    ((rv = meterd_conf_get_string("database.gascounter", "description", &gas_description, NULL)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to retrieve gas counter configuration");
+
+		free(gas_id);
+		free(gas_description);
+
+		return rv;
+	}
+
+	/* Add the gas counter if specified */
+	if (gas_id != NULL)
+	{
+		rv = meterd_createdb_add_spec(gas_id, "", (gas_description != NULL) ? gas_description : "Gas", COUNTER_TYPE_CONSUMED, counters);
 	}
 
+	free(gas_id);
+	free(gas_description);
+
+	return rv;
+}
+
+/* Create the database configured under the specified name with tables for the specified counters */
+static meterd_rv meterd_createdb_create(const char* type, const char* db_name, counter_spec* ctr_specs, int force_overwrite)
+{
+	void*		db_handle	= NULL;
+	meterd_rv	rv		= MRV_OK;
+
 	/* Create and open the database */
 	if ((rv = meterd_db_create(db_name, force_overwrite, &db_handle)) != MRV_OK)
 	{
 		ERROR_MSG("Failed to create database %s of type %s", db_name, type);
 
-		free(db_name);
-		meterd_conf_free_counter_specs(ctr_specs);
-
 		return rv;
 	}
 
@@ -188,124 +354,216 @@ meterd_rv meterd_createdb_raw(const char* type, int force_overwrite)
 		unlink(db_name);
 	}
 
-	free(db_name);
-	meterd_conf_free_counter_specs(ctr_specs);
-
 	/* Close the database */
 	meterd_db_close(db_handle);
 
 	return rv;
 }
 
-meterd_rv meterd_createdb_counters(int force_overwrite)
+meterd_rv meterd_createdb_raw(const char* type, int force_overwrite)
 {
-	counter_spec*	counters	= NULL;
+	assert(type != NULL);
+
 	char*		db_name		= NULL;
-	char*		gas_id		= NULL;
-	char*		gas_description	= NULL;
 	meterd_rv	rv		= MRV_OK;
-	void*		db_handle	= NULL;
+	counter_spec*	ctr_specs	= NULL;
 
 	/* Check if the database type is configured */
-	if ((rv = meterd_conf_get_string("database", "total_consumed", &db_name, NULL)) != MRV_OK)
+	if ((rv = meterd_conf_get_string("database", type, &db_name, NULL)) != MRV_OK)
 	{
-		ERROR_MSG("Failed to retrieve configuration option database.counters");
+		ERROR_MSG("Failed to retrieve configuration option database.%s", type);
 
 		return rv;
 	}
 
 	if (db_name == NULL)
 	{
-		INFO_MSG("No database for consumption and production counters specified, skipping");
+		INFO_MSG("No database of type %s configured", type);
 
 		return MRV_OK;
 	}
 
-	/* Retrieve the consumption counters */
-	if ((rv = meterd_conf_get_counter_specs("database", "consumption", COUNTER_TYPE_CONSUMED, &counters)) != MRV_OK)
+	if ((rv = meterd_createdb_raw_specs(COUNTER_TYPE_RAW, "", &ctr_specs)) != MRV_OK)
 	{
-		ERROR_MSG("Failed to retrieve consumption counter configuration");
+		free(db_name);
+		meterd_conf_free_counter_specs(ctr_specs);
 
 		return rv;
 	}
 
-	/* Retrieve the production counters */
-	if ((rv = meterd_conf_get_counter_specs("database", "production", COUNTER_TYPE_PRODUCED, &counters)) != MRV_OK)
+	if (ctr_specs == NULL)
 	{
-		ERROR_MSG("Failed to retrieve production counter configuration");
+		INFO_MSG("No raw consumption or production counters specified, skipping creation of database %s of type %s", db_name, type);
+
+		free(db_name);
+
+		return MRV_OK;
+	}
+
+	/* The raw values are aggregated per day and month in the same database */
+	if ((strcmp(type, "raw_db") != 0) || ((rv = meterd_createdb_aggregate_specs(&ctr_specs)) == MRV_OK))
+	{
+		rv = meterd_createdb_create(type, db_name, ctr_specs, force_overwrite);
+	}
+
+	free(db_name);
+	meterd_conf_free_counter_specs(ctr_specs);
+
+	return rv;
+}
+
+meterd_rv meterd_createdb_counters(int force_overwrite)
+{
+	counter_spec*	counters	= NULL;
+	char*		db_name		= NULL;
+	meterd_rv	rv		= MRV_OK;
+
+	/* Check if the database type is configured */
+	if ((rv = meterd_conf_get_string("database", "total_consumed", &db_name, NULL)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.counters");
 
 		return rv;
 	}
 
-	/* Check if there is a gas counter configured */
-	if (((rv = meterd_conf_get_string("database.gascounter", "id", &gas_id, NULL)) != MRV_OK) ||
-	    ((rv = meterd_conf_get_string("database.gascounter", "description", &gas_description, NULL)) != MRV_OK))
+	if (db_name == NULL)
 	{
-		ERROR_MSG("Failed to retrieve gas counter configuration");
+		INFO_MSG("No database for consumption and production counters specified, skipping");
 
-		free(db_name);
-		free(gas_id);
-		free(gas_description);
-		meterd_conf_free_counter_specs(counters);
+		return MRV_OK;
+	}
+
+	if (((rv = meterd_createdb_counter_specs(&counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_aggregate_specs(&counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_delta_specs(&counters)) == MRV_OK))
+	{
+		rv = meterd_createdb_create("total_consumed", db_name, counters, force_overwrite);
+	}
+
+	free(db_name);
+	meterd_conf_free_counter_specs(counters);
+
+	return rv;
+}
+
+/* Create a single database for all resolutions */
+meterd_rv meterd_createdb_single(const char* db_name, int force_overwrite)
+{
+	counter_spec*	counters	= NULL;
+	meterd_rv	rv		= MRV_OK;
+
+	if (((rv = meterd_createdb_raw_specs(COUNTER_TYPE_RAW, "", &counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_counter_specs(&counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_aggregate_specs(&counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_delta_specs(&counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_raw_specs(COUNTER_TYPE_FIVEMIN, ID_SUFFIX_FIVEMIN, &counters)) == MRV_OK) &&
+	    ((rv = meterd_createdb_raw_specs(COUNTER_TYPE_HOURLY, ID_SUFFIX_HOURLY, &counters)) == MRV_OK))
+	{
+		rv = meterd_createdb_create("single_db", db_name, counters, force_overwrite);
+	}
+
+	meterd_conf_free_counter_specs(counters);
+
+	return rv;
+}
+
+/* Import the databases in the legacy layout into the single database */
+meterd_rv meterd_createdb_import(const char* db_name)
+{
+	const char*	types[4]	= { "raw_db", "fivemin_avg", "hourly_avg", "total_consumed" };
+	const char*	suffixes[4]	= { "", ID_SUFFIX_FIVEMIN, ID_SUFFIX_HOURLY, "" };
+	void*		db_handle	= NULL;
+	meterd_rv	rv		= MRV_OK;
+	int		i		= 0;
+
+	if ((rv = meterd_db_open(db_name, 0, &db_handle)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to open single database %s", db_name);
 
 		return rv;
 	}
 
-	/* Add the gas counter if specified */
-	if (gas_id != NULL)
+	for (i = 0; (i < 4) && (rv == MRV_OK); i++)
 	{
-		counter_spec* new_counter = NULL;
+		char*	legacy_name	= NULL;
 
-		if (gas_description == NULL)
+		if (((rv = meterd_conf_get_string("database", types[i], &legacy_name, NULL)) != MRV_OK) || (legacy_name == NULL))
 		{
-			gas_description = strdup("Gas");
+			continue;
 		}
 
-		new_counter = (counter_spec*) malloc(sizeof(counter_spec));
-
-		if (new_counter == NULL)
+		if (meterd_db_exists(legacy_name) != MRV_OK)
+		{
+			INFO_MSG("Database %s of type %s does not exist, skipping import", legacy_name, types[i]);
+		}
+		else
 		{
-			free(db_name);
-			free(gas_id);
-			free(gas_description);
-			meterd_conf_free_counter_specs(counters);
+			INFO_MSG("Importing database %s of type %s", legacy_name, types[i]);
 
-			return MRV_MEMORY;
+			rv = meterd_db_import(db_handle, legacy_name, suffixes[i]);
 		}
 
-		new_counter->id 		= gas_id;
-		new_counter->description	= gas_description;
-		new_counter->table_name		= meterd_conf_create_table_name(gas_id, COUNTER_TYPE_CONSUMED);
-		new_counter->type		= COUNTER_TYPE_CONSUMED;
+		free(legacy_name);
+	}
+
+	meterd_db_close(db_handle);
+
+	return rv;
+}
+
+meterd_rv meterd_createdb_migrate(const char* type, int chunk_size, int aggregates)
+{
+	char*		db_name		= NULL;
+	void*		db_handle	= NULL;
+	meterd_rv	rv		= MRV_OK;
 
-		LL_APPEND(counters, new_counter);
+	/* Check if the database type is configured */
+	if ((rv = meterd_conf_get_string("database", type, &db_name, NULL)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.%s", type);
+
+		return rv;
 	}
 
-	/* Create and open the database */
-	if ((rv = meterd_db_create(db_name, force_overwrite, &db_handle)) != MRV_OK)
+	if ((db_name == NULL) || (meterd_db_exists(db_name) != MRV_OK))
 	{
-		ERROR_MSG("Failed to create database %s for counters", db_name);
+		INFO_MSG("No database of type %s to migrate", type);
+
+		free(db_name);
+
+		return MRV_OK;
+	}
+
+	if ((rv = meterd_db_open(db_name, 0, &db_handle)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to open database %s of type %s", db_name, type);
 
 		free(db_name);
-		meterd_conf_free_counter_specs(counters);
 
 		return rv;
 	}
 
-	INFO_MSG("Created database %s for counters", db_name);
+	INFO_MSG("Migrating database %s of type %s", db_name, type);
 
-	/* Create data tables */
-	if ((rv = meterd_db_create_tables(db_handle, counters)) != MRV_OK)
+	if ((rv = meterd_db_migrate(db_handle, chunk_size)) != MRV_OK)
 	{
-		ERROR_MSG("Error during table creation");
-
-		unlink(db_name);
+		ERROR_MSG("Failed to migrate database %s", db_name);
+	}
+	else if (aggregates && ((rv = meterd_db_add_aggregates(db_handle)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to add aggregate tables to database %s", db_name);
+	}
+	else if (aggregates && ((rv = meterd_db_add_deltas(db_handle)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to add delta tables to database %s", db_name);
+	}
+	else if (aggregates && ((rv = meterd_createdb_add_windows(db_handle)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to add window tables to database %s", db_name);
 	}
 
 	free(db_name);
-	meterd_conf_free_counter_specs(counters);
 
-	/* Close the database */
 	meterd_db_close(db_handle);
 
 	return rv;
@@ -315,9 +573,13 @@ int main(int argc, char* argv[])
 {
 	char* 	config_path 	= NULL;
 	int	force_overwrite	= 0;
+	char*	single_db	= NULL;
+	int	migrate		= 0;
+	int	import		= 0;
+	int	chunk_size	= DEFAULT_MIGRATE_CHUNK;
 	int 	c 		= 0;
 	
-	while ((c = getopt(argc, argv, "c:fhv")) != -1)
+	while ((c = getopt(argc, argv, "c:fImn:hv")) != -1)
 	{
 		switch(c)
 		{
@@ -333,6 +595,22 @@ int main(int argc, char* argv[])
 			break;
 		case 'f':
 			force_overwrite = 1;
+			break;
+		case 'I':
+			import = 1;
+			break;
+		case 'm':
+			migrate = 1;
+			break;
+		case 'n':
+			chunk_size = atoi(optarg);
+
+			if (chunk_size <= 0)
+			{
+				fprintf(stderr, "Invalid number of rows specified (%s)\n", optarg);
+				return MRV_PARAM_INVALID;
+			}
+
 			break;
 		case 'h':
 			usage();
@@ -381,23 +659,78 @@ int main(int argc, char* argv[])
 		return MRV_DB_ERROR;
 	}
 
-	if (force_overwrite)
+	/* Check if a single database is configured for all resolutions */
+	if (meterd_conf_get_string("database", "single_db", &single_db, NULL) != MRV_OK)
 	{
-		INFO_MSG("Will overwrite existing databases");
+		ERROR_MSG("Failed to retrieve configuration option database.single_db");
 	}
-
-	/* Create raw databases and counter databases */
-	if ((meterd_createdb_raw("raw_db", force_overwrite) != MRV_OK) ||
-	    (meterd_createdb_raw("fivemin_avg", force_overwrite) != MRV_OK) ||
-	    (meterd_createdb_raw("hourly_avg", force_overwrite) != MRV_OK) ||
-	    (meterd_createdb_counters(force_overwrite) != MRV_OK))
+	else if (migrate)
 	{
-		ERROR_MSG("Errors occurred during database creation");
-	} 
-	else 
+		/* Migrate existing databases */
+		if ((meterd_createdb_migrate("raw_db", chunk_size, 1) != MRV_OK) ||
+		    (meterd_createdb_migrate("fivemin_avg", chunk_size, 0) != MRV_OK) ||
+		    (meterd_createdb_migrate("hourly_avg", chunk_size, 0) != MRV_OK) ||
+		    (meterd_createdb_migrate("total_consumed", chunk_size, 1) != MRV_OK) ||
+		    (meterd_createdb_migrate("single_db", chunk_size, 1) != MRV_OK))
+		{
+			ERROR_MSG("Errors occurred during database migration");
+		}
+		else
+		{
+			INFO_MSG("Finished database migration");
+		}
+	}
+	else if (import)
 	{
-		INFO_MSG("Finished database creation");
+		/* Import the legacy databases into the single database, creating it if necessary */
+		if (single_db == NULL)
+		{
+			ERROR_MSG("No single database configured (database.single_db), cannot import");
+		}
+		else if (((meterd_db_exists(single_db) != MRV_OK) && (meterd_createdb_single(single_db, 0) != MRV_OK)) ||
+		         (meterd_createdb_import(single_db) != MRV_OK))
+		{
+			ERROR_MSG("Errors occurred during database import");
+		}
+		else
+		{
+			INFO_MSG("Finished database import");
+		}
 	}
+	else
+	{
+		if (force_overwrite)
+		{
+			INFO_MSG("Will overwrite existing databases");
+		}
+
+		if (single_db != NULL)
+		{
+			/* Create a single database for all resolutions and counters */
+			if (meterd_createdb_single(single_db, force_overwrite) != MRV_OK)
+			{
+				ERROR_MSG("Errors occurred during database creation");
+			}
+			else
+			{
+				INFO_MSG("Finished database creation");
+			}
+		}
+		/* Create raw databases and counter databases */
+		else if ((meterd_createdb_raw("raw_db", force_overwrite) != MRV_OK) ||
+		         (meterd_createdb_raw("fivemin_avg", force_overwrite) != MRV_OK) ||
+		         (meterd_createdb_raw("hourly_avg", force_overwrite) != MRV_OK) ||
+		         (meterd_createdb_counters(force_overwrite) != MRV_OK))
+		{
+			ERROR_MSG("Errors occurred during database creation");
+		} 
+		else 
+		{
+			INFO_MSG("Finished database creation");
+		}
+	}
+
+	free(single_db);
 
 	/* Uninitialise database handling */
 	meterd_db_finalize();
@@ -55,6 +55,9 @@
 #define MRV_CONF_NO_COUNTERS	0x8000000B	/* No counters were found under the specified configuration path */
 #define MRV_COMM_ERROR		0x8000000C	/* A communication error occurred */
 #define MRV_COMM_INTR		0x8000000D	/* Communication was interrupted by a signal */
+#define MRV_P1_MORE_DATA	0x8000000E	/* The P1 telegram is not complete yet */
+#define MRV_P1_CRC_ERROR	0x8000000F	/* The P1 telegram failed the CRC check */
+#define MRV_DB_BUSY		0x80000010	/* The database is locked by another connection */
 
 #endif /* !_METERD_ERROR_H */
 
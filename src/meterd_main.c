@@ -38,6 +38,7 @@
 #include "meterd_log.h"
 #include "measure.h"
 #include "tasksched.h"
+#include "retention.h"
 
 void version(void)
 {
@@ -312,18 +313,40 @@ int main(int argc, char* argv[])
 		if (meterd_tasksched_init() != MRV_OK)
 		{
 			ERROR_MSG("Failed to intialise task scheduling, giving up");
+
+			/* The measurement threads are running already */
+			meterd_measure_finalize();
+		}
+		else if (meterd_retention_init() != MRV_OK)
+		{
+			ERROR_MSG("Failed to initialise data retention, giving up");
+
+			meterd_retention_finalize();
+			meterd_tasksched_finalize();
+
+			/* The measurement threads are running already */
+			meterd_measure_finalize();
 		}
 		else
 		{
 			/* Start task scheduler */
 			meterd_tasksched_start();
 
+			/* Start data retention */
+			meterd_retention_start();
+
 			/* Run measurement loop */
 			meterd_measure_loop();
 
+			/* Stop data retention */
+			meterd_retention_stop();
+
 			/* Stop task scheduler */
 			meterd_tasksched_stop();
 
+			/* Uninitialise data retention */
+			meterd_retention_finalize();
+
 			/* Uninitialise task scheduling */
 			if (meterd_tasksched_finalize() != MRV_OK)
 			{
@@ -38,6 +38,7 @@
 #include "meterd_config.h"
 #include "meterd_log.h"
 #include "db.h"
+#include "obis.h"
 #include "utlist.h"
 
 #define FORMAT_GNUPLOT		1
@@ -59,8 +60,10 @@ void usage(void)
 	printf("Data series output tool\n");
 	printf("Usage:\n");
 	printf("\tmeterd-output [-c <config>] [-q] [-a] [-p] [-C] [-s <id>] [-S <id>]\n");
-	printf("\t              -d <database> [-o <file>] -i <interval> [-y <offset]\n");
+	printf("\t              [-d <database>] [-R <res>] [-o <file>]\n");
+	printf("\t              -i <interval> [-y <offset]\n");
 	printf("\t              [-x] [-r <file>] [-t <time offset>]\n");
+	printf("\t              [-j <seconds> [-J <mode>]]\n");
 	printf("\tmeterd-output -h\n");
 	printf("\tmeterd-output -v\n");
 	printf("\n");
@@ -76,6 +79,13 @@ void usage(void)
 	printf("\t-S <id>       Select counter with <id> and invert (negate) its value\n");
 	printf("\t              (can occur multiple times)\n");
 	printf("\t-d <database> Read data from <database>\n");
+	printf("\t              (defaults to database.single_db if configured)\n");
+	printf("\t-R <res>      Read the raw, 5min or hourly data of the selected\n");
+	printf("\t              counters from the single database, their daily or\n");
+	printf("\t              monthly aggregates, their aggregates over a window\n");
+	printf("\t              configured in database.windows (e.g. 15m), or the\n");
+	printf("\t              delta between recorded values of cumulative\n");
+	printf("\t              counters (defaults to raw)\n");
 	printf("\t-o <file>     Write output to <file>\n");
 	printf("\t              (defaults to stdout)\n");
 	printf("\t-i <interval> Interval in seconds to output data for (relative to the\n");
@@ -85,7 +95,12 @@ void usage(void)
 	printf("\t-x            Output GNUPlot x-range statement based on timestamps\n");
 	printf("\t              (requires -r)\n");
 	printf("\t-r <file>     File to write GNUPlot range statements to\n");
-	printf("\t-j <seconds>  Skip <seconds> between each query results\n");
+	printf("\t-j <seconds>  Output one value per <seconds>\n");
+	printf("\t-J <mode>     Value to output per interval with -j; one of first,\n");
+	printf("\t              avg, min, max or sum (defaults to first). Use -R daily\n");
+	printf("\t              or -R monthly to read the daily or monthly aggregates\n");
+	printf("\t              and -R delta -J sum to output the consumption per\n");
+	printf("\t              interval; the average of windows is weighted by time\n");
 	printf("\t-t <seconds>  Offset timestamps by <seconds>\n");
 	printf("\n");
 	printf("\t-h            Print this help message\n");
@@ -93,14 +108,13 @@ void usage(void)
 	printf("\t-v            Print the version number\n");
 }
 
-void meterd_output(sel_counter* sel_counters, const char* dbname, const char* outfile, const int format, const int additive, const int interval, const char* range_file, const int give_y_range, const long double y_offset, const int give_x_range, const int skip_time, const int timeofs)
+void meterd_output(sel_counter* sel_counters, const char* dbname, const char* outfile, const int format, const int additive, const int interval, const char* range_file, const int give_y_range, const long double y_offset, const int give_x_range, const int skip_time, const int sample_mode, const int timeofs)
 {
-	db_res_ctr**	results		= NULL;
-	db_res_ctr**	result_it	= NULL;
-	db_res_ctr**	result_tmp	= NULL;
+	db_res_series*	results		= NULL;
+	size_t		row_count	= 0;
+	size_t		row		= 0;
 	int		ctr_count	= 0;
 	int		i		= 0;
-	int		iterating	= 1;
 	sel_counter*	ctr_it		= 0;
 	void*		db_handle	= NULL;
 	int		select_from	= ((int) time(NULL)) - interval;
@@ -110,6 +124,7 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 	long double	min_y		= 100000000.0f;
 	int		min_x		= 0x7fffffff;
 	int		max_x		= 0;
+	char*		staging_dir	= NULL;
 
 	if (outfile != NULL)
 	{
@@ -153,19 +168,36 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 		return;
 	}
 
+	/* Include measurements that meterd has not merged from its staging database yet */
+	if (meterd_conf_get_string("database", "staging_dir", &staging_dir, NULL) != MRV_OK)
+	{
+		WARNING_MSG("Failed to retrieve the staging directory from the configuration");
+	}
+
+	if (staging_dir != NULL)
+	{
+		char*	staging_name	= meterd_db_staging_name(staging_dir, dbname);
+
+		if ((staging_name != NULL) && (meterd_db_attach_staging(db_handle, staging_name) != MRV_OK))
+		{
+			WARNING_MSG("Failed to read staged measurements from %s", staging_name);
+		}
+
+		free(staging_name);
+		free(staging_dir);
+	}
+
 	/* Allocate space for results from the database */
 	LL_COUNT(sel_counters, ctr_it, ctr_count);
 
-	results 	= (db_res_ctr**) calloc(ctr_count, sizeof(db_res_ctr*));
-	result_it	= (db_res_ctr**) calloc(ctr_count, sizeof(db_res_ctr*));
-	result_tmp	= (db_res_ctr**) calloc(ctr_count, sizeof(db_res_ctr*));
+	results 	= (db_res_series*) calloc(ctr_count, sizeof(db_res_series));
 
 	/* Retrieve results from the database */
 	i = 0;
 
 	LL_FOREACH(sel_counters, ctr_it)
 	{
-		if (meterd_db_get_results(db_handle, ctr_it->id, ctr_it->invert, &results[i++], select_from, skip_time) != MRV_OK)
+		if (meterd_db_get_results(db_handle, ctr_it->id, ctr_it->invert, &results[i++], select_from, skip_time, sample_mode) != MRV_OK)
 		{
 			ERROR_MSG("Failed to retrieve results for %s from database %s", ctr_it->id, dbname);
 
@@ -179,6 +211,17 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 		}
 	}
 
+	/* Only output rows for which all series have a value */
+	row_count = (ctr_count > 0) ? results[0].count : 0;
+
+	for (i = 1; i < ctr_count; i++)
+	{
+		if (results[i].count < row_count)
+		{
+			row_count = results[i].count;
+		}
+	}
+
 	/* Output the data */
 	if (format == FORMAT_CSV)
 	{
@@ -208,39 +251,21 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 
 		fprintf(out, "\n");
 
-		/* Set iterators to start of list */
-		for (i = 0; i < ctr_count; i++)
-		{
-			result_it[i] = results[i];
-		}
-
-		while(iterating)
+		for (row = 0; row < row_count; row++)
 		{
 			added = 0.0f;
 
-			/* Have we reached the end of one of the result lists? */
-			for (i = 0; i < ctr_count; i++)
-			{
-				if (result_it[i] == NULL)
-				{
-					iterating = 0;
-					break;
-				}
-			}
-
-			if (!iterating) break;
-
-			/* Print one result for each result list */
+			/* Print one result for each result series */
 			for (i = 0; i < ctr_count; i++)
 			{
 				if (i == 0)
 				{
 					/* 
-					 * Output the timestamp of the first result list;
+					 * Output the timestamp of the first result series;
 					 * because of the way data is written to the database,
 					 * timestamps are the same in all tables per row
 					 */
-					int ts = result_it[i]->timestamp + timeofs;
+					int ts = results[i].timestamps[row] + timeofs;
 
 					fprintf(out, "%d", ts);
 
@@ -256,20 +281,20 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 
 				if (!additive)
 				{
-					fprintf(out, ",%0.3Lf", result_it[i]->value);
+					fprintf(out, ",%0.3f", results[i].values[row]);
 
-					if (result_it[i]->value < min_y)
+					if (results[i].values[row] < min_y)
 					{
-						min_y = result_it[i]->value;
+						min_y = results[i].values[row];
 					}
-					else if (result_it[i]->value > max_y)
+					else if (results[i].values[row] > max_y)
 					{
-						max_y = result_it[i]->value;
+						max_y = results[i].values[row];
 					}
 				}
 				else
 				{
-					added += result_it[i]->value;
+					added += results[i].values[row];
 				}
 			}
 
@@ -288,53 +313,25 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 			}
 
 			fprintf(out, "\n");
-
-			/* Advance all lists one step and discard processed results */
-			for (i = 0; i < ctr_count; i++)
-			{
-				result_tmp[i] = result_it[i];
-				result_it[i] = result_it[i]->next;
-
-				free(result_tmp[i]->unit);
-				free(result_tmp[i]);
-			}
 		}
 	}
 	else if (format == FORMAT_GNUPLOT)
 	{
-		/* Set iterators to start of list */
-		for (i = 0; i < ctr_count; i++)
-		{
-			result_it[i] = results[i];
-		}
-
-		while(iterating)
+		for (row = 0; row < row_count; row++)
 		{
 			added = 0.0f;
 
-			/* Have we reached the end of one of the result lists? */
-			for (i = 0; i < ctr_count; i++)
-			{
-				if (result_it[i] == NULL)
-				{
-					iterating = 0;
-					break;
-				}
-			}
-
-			if (!iterating) break;
-
-			/* Print one result for each result list */
+			/* Print one result for each result series */
 			for (i = 0; i < ctr_count; i++)
 			{
 				if (i == 0)
 				{
 					/* 
-					 * Output the timestamp of the first result list;
+					 * Output the timestamp of the first result series;
 					 * because of the way data is written to the database,
 					 * timestamps are the same in all tables per row
 					 */
-					int ts = result_it[i]->timestamp + timeofs;
+					int ts = results[i].timestamps[row] + timeofs;
 
 					fprintf(out, "%10d", ts);
 
@@ -350,20 +347,20 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 
 				if (!additive)
 				{
-					fprintf(out, "  %3.3Lf", result_it[i]->value);
+					fprintf(out, "  %3.3f", results[i].values[row]);
 
-					if (result_it[i]->value < min_y)
+					if (results[i].values[row] < min_y)
 					{
-						min_y = result_it[i]->value;
+						min_y = results[i].values[row];
 					}
-					else if (result_it[i]->value > max_y)
+					else if (results[i].values[row] > max_y)
 					{
-						max_y = result_it[i]->value;
+						max_y = results[i].values[row];
 					}
 				}
 				else
 				{
-					added += result_it[i]->value;
+					added += results[i].values[row];
 				}
 			}
 
@@ -382,35 +379,16 @@ void meterd_output(sel_counter* sel_counters, const char* dbname, const char* ou
 			}
 
 			fprintf(out, "\n");
-
-			/* Advance all lists one step and discard processed results */
-			for (i = 0; i < ctr_count; i++)
-			{
-				result_tmp[i] = result_it[i];
-				result_it[i] = result_it[i]->next;
-
-				free(result_tmp[i]->unit);
-				free(result_tmp[i]);
-			}
 		}
 	}
 
-	/* Clean up spurious results */
+	/* Release the results */
 	for (i = 0; i < ctr_count; i++)
 	{
-		while(result_it[i] != NULL)
-		{
-			result_tmp[i] = result_it[i];
-			result_it[i] = result_it[i]->next;
-
-			free(result_tmp[i]->unit);
-			free(result_tmp[i]);
-		}
+		meterd_db_free_results(&results[i]);
 	}
 
 	free(results);
-	free(result_it);
-	free(result_tmp);
 
 	/* Close the database connection */
 	meterd_db_close(db_handle);
@@ -461,9 +439,13 @@ int main(int argc, char* argv[])
 	int		give_x_range	= 0;
 	char*		range_file	= NULL;
 	int		skip_time	= 0;
+	int		sample_mode	= DB_SAMPLE_FIRST;
+	const char*	id_suffix	= "";
+	char		window_suffix[WINDOW_LABEL_LEN + 1]	= { 0 };
+	int		window_length	= 0;
 	int 		c 		= 0;
 	
-	while ((c = getopt(argc, argv, "c:qapCs:S:d:o:i:r:xy:j:t:hv")) != -1)
+	while ((c = getopt(argc, argv, "c:qapCs:S:d:o:i:r:xy:j:J:R:t:hv")) != -1)
 	{
 		switch(c)
 		{
@@ -516,6 +498,75 @@ int main(int argc, char* argv[])
 		case 'j':
 			skip_time = atoi(optarg);
 			break;
+		case 'J':
+			if (!strcmp(optarg, "first"))
+			{
+				sample_mode = DB_SAMPLE_FIRST;
+			}
+			else if (!strcmp(optarg, "avg"))
+			{
+				sample_mode = DB_SAMPLE_AVG;
+			}
+			else if (!strcmp(optarg, "min"))
+			{
+				sample_mode = DB_SAMPLE_MIN;
+			}
+			else if (!strcmp(optarg, "max"))
+			{
+				sample_mode = DB_SAMPLE_MAX;
+			}
+			else if (!strcmp(optarg, "sum"))
+			{
+				sample_mode = DB_SAMPLE_SUM;
+			}
+			else
+			{
+				fprintf(stderr, "Invalid sampling mode %s\n", optarg);
+
+				return MRV_PARAM_INVALID;
+			}
+			break;
+		case 'R':
+			if (!strcmp(optarg, "raw"))
+			{
+				id_suffix = "";
+			}
+			else if (!strcmp(optarg, "5min"))
+			{
+				id_suffix = ID_SUFFIX_FIVEMIN;
+			}
+			else if (!strcmp(optarg, "hourly"))
+			{
+				id_suffix = ID_SUFFIX_HOURLY;
+			}
+			else if (!strcmp(optarg, "daily"))
+			{
+				id_suffix = ID_SUFFIX_DAILY;
+			}
+			else if (!strcmp(optarg, "monthly"))
+			{
+				id_suffix = ID_SUFFIX_MONTHLY;
+			}
+			else if (!strcmp(optarg, "delta"))
+			{
+				id_suffix = ID_SUFFIX_DELTA;
+			}
+			else if (meterd_conf_parse_window(optarg, &window_length) == MRV_OK)
+			{
+				/* Windows are stored under their label, so e.g. 900s selects 15m */
+				window_suffix[0] = '/';
+
+				meterd_conf_window_label(window_length, &window_suffix[1], WINDOW_LABEL_LEN);
+
+				id_suffix = window_suffix;
+			}
+			else
+			{
+				fprintf(stderr, "Invalid resolution %s\n", optarg);
+
+				return MRV_PARAM_INVALID;
+			}
+			break;
 		case 't':
 			timeofs = atoi(optarg);
 			break;
@@ -582,6 +633,14 @@ int main(int argc, char* argv[])
 		return MRV_PARAM_INVALID;
 	}
 
+	/* Default to the single database if one is configured */
+	if ((dbname == NULL) && (meterd_conf_get_string("database", "single_db", &dbname, NULL) != MRV_OK))
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.single_db");
+
+		return MRV_CONFIG_ERROR;
+	}
+
 	if (dbname == NULL)
 	{
 		ERROR_MSG("No database specified, bailing out");
@@ -596,11 +655,32 @@ int main(int argc, char* argv[])
 		return MRV_PARAM_INVALID;
 	}
 
+	/* Select the counters at the requested resolution */
+	if (id_suffix[0] != '\0')
+	{
+		LL_FOREACH(sel_counters, sel_ctr_it)
+		{
+			char*	suffixed_id	= (char*) malloc(strlen(sel_ctr_it->id) + strlen(id_suffix) + 1);
+
+			if (suffixed_id == NULL)
+			{
+				ERROR_MSG("Memory allocation error");
+
+				return MRV_MEMORY;
+			}
+
+			sprintf(suffixed_id, "%s%s", sel_ctr_it->id, id_suffix);
+
+			free(sel_ctr_it->id);
+			sel_ctr_it->id = suffixed_id;
+		}
+	}
+
 	INFO_MSG("Smart Meter Monitoring Daemon (meterd) version %s", VERSION);
 	INFO_MSG("Processing data output request");
 
 	/* Generate the requested output */
-	meterd_output(sel_counters, dbname, outfile, format_gnuplot ? FORMAT_GNUPLOT : FORMAT_CSV, additive, interval, range_file, give_y_range, y_offset, give_x_range, skip_time, timeofs);
+	meterd_output(sel_counters, dbname, outfile, format_gnuplot ? FORMAT_GNUPLOT : FORMAT_CSV, additive, interval, range_file, give_y_range, y_offset, give_x_range, skip_time, sample_mode, timeofs);
 
 	INFO_MSG("Finished processing data output request");
 
@@ -621,6 +701,8 @@ int main(int argc, char* argv[])
 		free(sel_ctr_it);
 	}
 
+	meterd_units_free();
+
 	return MRV_OK;
 }
 
@@ -35,40 +35,117 @@
 
 #include "config.h"
 #include <time.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define FLAG_SET(flags, flag) ((flags & flag) == flag)
 
 #define COUNTER_TYPE_RAW	0
 #define COUNTER_TYPE_CONSUMED	1
 #define COUNTER_TYPE_PRODUCED	2
+#define COUNTER_TYPE_FIVEMIN	3	/* 5-min averages in the single database layout */
+#define COUNTER_TYPE_HOURLY	4	/* Hourly averages in the single database layout */
+#define COUNTER_TYPE_DAILY	5	/* Daily aggregates */
+#define COUNTER_TYPE_MONTHLY	6	/* Monthly aggregates */
+#define COUNTER_TYPE_DELTA	7	/* Consumption/production between recorded cumulative values */
+#define COUNTER_TYPE_WINDOW	8	/* Aggregates over configurable windows aligned to the wall clock */
 
 #define TABLE_PREFIX_RAW	"RAW_"
 #define TABLE_PREFIX_PRODUCED	"PRODUCED_"
 #define TABLE_PREFIX_CONSUMED	"CONSUMED_"
+#define TABLE_PREFIX_FIVEMIN	"FIVEMIN_"
+#define TABLE_PREFIX_HOURLY	"HOURLY_"
+#define TABLE_PREFIX_DAILY	"DAILY_"
+#define TABLE_PREFIX_MONTHLY	"MONTHLY_"
+#define TABLE_PREFIX_DELTA	"DELTA_"
+#define TABLE_PREFIX_WINDOW	"WINDOW_"	/* Followed by the length of the window in seconds */
+
+/* Suffixes of the IDs of average values in the single database layout */
+#define ID_SUFFIX_FIVEMIN	"/5min"
+#define ID_SUFFIX_HOURLY	"/hourly"
+
+/* Suffixes of the IDs of daily and monthly aggregates */
+#define ID_SUFFIX_DAILY		"/daily"
+#define ID_SUFFIX_MONTHLY	"/monthly"
+
+/* Suffix of the IDs of the consumption/production per interval of cumulative counters */
+#define ID_SUFFIX_DELTA		"/delta"
+
+/* Maximum length of the label of an aggregation window (e.g. "15m") */
+#define WINDOW_LABEL_LEN	16
 
 /* Type for function return values */
 typedef unsigned long meterd_rv;
 
+/* Packed OBIS code (see obis.h) */
+typedef uint64_t obis_key;
+
+/* Interned unit (see obis.h) */
+typedef unsigned char meterd_unit;
+
+/* Fixed-point counter value in thousandths (see fixed.h) */
+typedef int64_t meterd_fixed;
+
+#define UNIT_NONE		0
+#define UNIT_KWH		1
+#define UNIT_KW			2
+#define UNIT_M3			3
+
+/* Aggregate of the values of a counter over a calendar day or month, or a configured window */
+typedef struct meterd_aggregate
+{
+	char*			table_name;	/* The database table name for the aggregate, NULL if not recorded */
+	int			length;		/* Length of the window in seconds, 0 for calendar days and months */
+	time_t			start;		/* Start of the period (local time) */
+	time_t			end;		/* Start of the next period */
+	size_t			count;		/* Number of values in the period */
+	meterd_fixed		sum;		/* Sum of the values */
+	meterd_fixed		min;		/* Lowest value */
+	meterd_fixed		max;		/* Highest value */
+	meterd_fixed		first;		/* First value */
+	meterd_fixed		last;		/* Last value */
+	time_t			last_ts;	/* Timestamp of the last value, 0 if it is not known */
+	time_t			duration;	/* Number of seconds in the period covered by the values */
+	meterd_fixed		weighted;	/* Sum of the values multiplied by the number of seconds they applied */
+	meterd_unit		unit;		/* Unit of the values */
+	int			dirty;		/* Changed since it was last stored */
+}
+meterd_aggregate;
+
 /* Counter specifications */
 typedef struct counter_spec
 {
 	char*			description;	/* Short text description of the counter */
 	char*			id;		/* Identifier of the counter */
+	obis_key		key;		/* Packed identifier of the counter */
 	char*			table_name;	/* The database table name for this counter */
+	char*			fivemin_table_name; /* The table name for 5-min average values */
+	char*			hourly_table_name; /* The table name for hourly average values */
 	int			type;		/* Counter type */
-	long double		last_val;	/* Last recorded value */
+	meterd_fixed		last_val;	/* Last recorded value */
 	time_t			last_ts;	/* Timestamp of last recorded value */
 
 	/* The fields below are only used for raw counters */
-	long double		fivemin_cumul;	/* Five minute average cumulative value */
+	meterd_fixed		fivemin_cumul;	/* Five minute average cumulative value */
 	size_t			fivemin_ctr;	/* Number of values accumulated in the 5-min avg. cumulative value */
 	time_t			fivemin_ts;	/* Timestamp of last 5-min average calculation */
-	long double		hourly_cumul;	/* Hourly average cumulative value */
+	meterd_fixed		hourly_cumul;	/* Hourly average cumulative value */
 	size_t			hourly_ctr;	/* Number of values accumulated in the hourly avg. cumulative value */
 	time_t			hourly_ts;	/* Timestamp of last hourly average calculation */
 
 	/* The fields below are only used for cumulative consumption/production counters */
 	time_t			cumul_rec_ts;	/* Timestamp of last recorded cumulative value */
+	char*			delta_table_name; /* The table name for the differences between recorded values, NULL if not recorded */
+	meterd_fixed		delta_base;	/* Last recorded cumulative value, the next difference is relative to this */
+	int			delta_base_set;	/* Whether the last recorded cumulative value is known */
+
+	/* Daily and monthly aggregates, kept in the database of the raw or cumulative values */
+	meterd_aggregate	daily;
+	meterd_aggregate	monthly;
+
+	/* Aggregates over the configured windows, kept in the same database as the daily and monthly aggregates */
+	meterd_aggregate*	windows;
+	int			window_count;
 
 	/* Database handles associated with this counter */
 	void*			raw_db_h;	/* Database handle for raw counter values */
@@ -80,28 +157,36 @@ typedef struct counter_spec
 }
 counter_spec;
 
-/* Telegram linked list */
-typedef struct telegram_ll
+/* Line in a telegram buffer */
+typedef struct telegram_line
 {
-	char*			t_line;
-	struct telegram_ll*	next;
+	size_t			offset;		/* Offset of the line in the telegram buffer */
+	size_t			len;		/* Length of the line, excluding CR/LF */
 }
-telegram_ll;
+telegram_line;
+
+/* P1 telegram; all lines are stored NUL-terminated in a single reusable buffer */
+typedef struct p1_telegram
+{
+	char*			buf;		/* Telegram data */
+	size_t			buf_len;	/* Number of bytes in use */
+	size_t			buf_size;	/* Number of bytes allocated */
+	telegram_line*		lines;		/* Line spans */
+	size_t			line_count;	/* Number of lines in use */
+	size_t			line_size;	/* Number of lines allocated */
+}
+p1_telegram;
 
 /* Smart counter data from a telegram */
 typedef struct smart_counter
 {
-	char*			id;
-	long double		value;
-	char*			unit;
+	obis_key		id;
+	meterd_fixed		value;
+	meterd_unit		unit;
 	struct smart_counter*	next;
 }
 smart_counter;
 
-#define UNIT_KW			"kW"
-#define UNIT_KWH		"kWh"
-#define UNIT_M3			"m3"
-
 /* Counter selection for output */
 typedef struct sel_counter
 {
@@ -111,15 +196,16 @@ typedef struct sel_counter
 }
 sel_counter;
 
-/* Counter values from the database */
-typedef struct db_res_ctr
+/* Series of counter values from the database */
+typedef struct db_res_series
 {
-	int			timestamp;
-	long double		value;
-	char*			unit;
-	struct db_res_ctr*	next;
+	int*			timestamps;	/* Timestamps of the values */
+	double*			values;		/* The values */
+	size_t			count;		/* Number of values in the series */
+	size_t			capacity;	/* Number of values allocated */
+	meterd_unit		unit;		/* Unit of the values */
 }
-db_res_ctr;
+db_res_series;
 
 /* Scheduled tasks */
 typedef struct scheduled_task
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Packed OBIS codes and interned units
+ */
+
+#include "config.h"
+#include "meterd_types.h"
+#include "meterd_error.h"
+#include "obis.h"
+#ifndef CMD_OUT
+#include "meterd_log.h"
+#else
+#define WARNING_MSG(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBIS_FIELD_MAX		0xFFFF
+#define OBIS_AB_MAX		0xFF
+#define UNIT_MAX		256
+
+/*
+ * Interned units; the first entries match the UNIT_* constants. New
+ * units are appended and never removed, so a unit that was handed out
+ * can be read without locking while new units are added.
+ */
+static char*		unit_names[UNIT_MAX]	= { "", "kWh", "kW", "m3", "V", "A", "kvarh", "kvar", "GJ", "s" };
+static int		unit_preset		= 10;
+static volatile int	unit_count		= 10;
+static int		unit_full_warned	= 0;
+
+/* Parse a decimal field of at most max, stopping at the end of the string */
+static const char* meterd_obis_field(const char* it, const char* end, unsigned long max, unsigned long* val)
+{
+	const char*	start	= it;
+
+	*val = 0;
+
+	while ((it < end) && (*it >= '0') && (*it <= '9'))
+	{
+		*val = (*val * 10) + (*it - '0');
+
+		if (*val > max)
+		{
+			return NULL;
+		}
+
+		it++;
+	}
+
+	return (it == start) ? NULL : it;
+}
+
+/* Convert a "C.D.E" or "A-B:C.D.E" string to a packed key */
+meterd_rv meterd_obis_from_string(const char* str, size_t len, obis_key* key)
+{
+	const char*	it	= str;
+	const char*	end	= str + len;
+	unsigned long	a	= 0;
+	unsigned long	b	= 0;
+	unsigned long	cde[3]	= { 0, 0, 0 };
+	int		i	= 0;
+
+	/* Optional A-B: prefix */
+	if (memchr(str, ':', len) != NULL)
+	{
+		if (((it = meterd_obis_field(it, end, OBIS_AB_MAX, &a)) == NULL) || (it >= end) || (*it++ != '-') ||
+		    ((it = meterd_obis_field(it, end, OBIS_AB_MAX, &b)) == NULL) || (it >= end) || (*it++ != ':'))
+		{
+			return MRV_PARAM_INVALID;
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		if ((it = meterd_obis_field(it, end, OBIS_FIELD_MAX, &cde[i])) == NULL)
+		{
+			return MRV_PARAM_INVALID;
+		}
+
+		if ((i < 2) && ((it >= end) || (*it++ != '.')))
+		{
+			return MRV_PARAM_INVALID;
+		}
+	}
+
+	if (it != end)
+	{
+		return MRV_PARAM_INVALID;
+	}
+
+	*key = OBIS_KEY(a, b, cde[0], cde[1], cde[2]);
+
+	return MRV_OK;
+}
+
+/* Write the C.D.E part of a packed key to the buffer (at least OBIS_STR_MAX bytes) */
+const char* meterd_obis_to_string(obis_key key, char* buf)
+{
+	snprintf(buf, OBIS_STR_MAX, "%u.%u.%u",
+		(unsigned int) ((key >> 32) & OBIS_FIELD_MAX),
+		(unsigned int) ((key >> 16) & OBIS_FIELD_MAX),
+		(unsigned int) (key & OBIS_FIELD_MAX));
+
+	return buf;
+}
+
+/* Return the interned unit for the specified unit string */
+meterd_unit meterd_unit_intern(const char* str, size_t len)
+{
+	int	i	= 0;
+	char*	name	= NULL;
+
+	for (i = 0; i < unit_count; i++)
+	{
+		if ((strncmp(unit_names[i], str, len) == 0) && (unit_names[i][len] == '\0'))
+		{
+			return (meterd_unit) i;
+		}
+	}
+
+	if (unit_count >= UNIT_MAX)
+	{
+		if (!unit_full_warned)
+		{
+			WARNING_MSG("Too many different units, recording unknown units without a unit");
+
+			unit_full_warned = 1;
+		}
+
+		return UNIT_NONE;
+	}
+
+	if ((name = (char*) malloc(len + 1)) == NULL)
+	{
+		return UNIT_NONE;
+	}
+
+	memcpy(name, str, len);
+	name[len] = '\0';
+
+	unit_names[unit_count] = name;
+
+	return (meterd_unit) unit_count++;
+}
+
+/* Return the name of an interned unit */
+const char* meterd_unit_name(meterd_unit unit)
+{
+	return (unit < unit_count) ? unit_names[unit] : "";
+}
+
+/* Release the interned units */
+void meterd_units_free(void)
+{
+	int	i	= 0;
+
+	for (i = unit_preset; i < unit_count; i++)
+	{
+		free(unit_names[i]);
+		unit_names[i] = NULL;
+	}
+
+	unit_count = unit_preset;
+}
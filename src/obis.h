@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Packed OBIS codes and interned units
+ */
+
+#ifndef _METERD_OBIS_H
+#define _METERD_OBIS_H
+
+#include "config.h"
+#include "meterd_types.h"
+
+/*
+ * An OBIS code A-B:C.D.E is packed into 64 bits as A (8 bits), B (8 bits)
+ * and C, D and E (16 bits each). Counters are configured and matched on
+ * the C.D.E part only.
+ */
+#define OBIS_KEY(a, b, c, d, e)	(((obis_key) (a) << 56) | ((obis_key) (b) << 48) | ((obis_key) (c) << 32) | ((obis_key) (d) << 16) | (obis_key) (e))
+#define OBIS_CDE(key)		((key) & 0x0000FFFFFFFFFFFFULL)
+
+/* Maximum length of a C.D.E string including the terminating NUL */
+#define OBIS_STR_MAX		18
+
+/* Convert a "C.D.E" or "A-B:C.D.E" string to a packed key */
+meterd_rv meterd_obis_from_string(const char* str, size_t len, obis_key* key);
+
+/* Write the C.D.E part of a packed key to the buffer (at least OBIS_STR_MAX bytes) */
+const char* meterd_obis_to_string(obis_key key, char* buf);
+
+/* Return the interned unit for the specified unit string */
+meterd_unit meterd_unit_intern(const char* str, size_t len);
+
+/* Return the name of an interned unit */
+const char* meterd_unit_name(meterd_unit unit);
+
+/* Release the interned units */
+void meterd_units_free(void);
+
+#endif /* !_METERD_OBIS_H */
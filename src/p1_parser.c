@@ -35,337 +35,944 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <regex.h>
 #include "utlist.h"
+#include "uthash.h"
 #ifndef CMD_OUT
 #include "meterd_log.h"
 #else
-#define DEBUG_MSG(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
+extern int testp1_verbose;
+#define DEBUG_MSG(...) if (testp1_verbose) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); }
 #define ERROR_MSG(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
 #define WARNING_MSG(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
 #define INFO_MSG(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
 #endif
 #include "meterd_error.h"
 #include "p1_parser.h"
+#include "telegram.h"
+#include "crc16.h"
+#include "obis.h"
+#include "fixed.h"
+
+/* The regular expression parser is only built on request and for the test tool */
+#if defined(METERD_REGEX_PARSER) || defined(CMD_OUT)
+#define P1_REGEX_ENGINE
+#include <regex.h>
+#endif
+
+#ifdef P1_REGEX_ENGINE
+#define P1_SCRATCH_INITIAL	256
+#endif /* P1_REGEX_ENGINE */
+#define P1_LINE_MAX		4095
+#define P1_IS_DIGIT(c)		(((c) >= '0') && ((c) <= '9'))
+#define P1_IS_ALNUM(c)		(P1_IS_DIGIT(c) || (((c) >= 'a') && ((c) <= 'z')) || (((c) >= 'A') && ((c) <= 'Z')))
+#define P1_HEX_VAL(c)		(P1_IS_DIGIT(c) ? ((c) - '0') : (((c) >= 'A') && ((c) <= 'F')) ? ((c) - 'A' + 10) : (((c) >= 'a') && ((c) <= 'f')) ? ((c) - 'a' + 10) : -1)
 
-meterd_rv meterd_parse_p1_telegram(telegram_ll* telegram, const char* gas_id, smart_counter** counters)
+/* Streaming parser states */
+#define P1_STATE_IDLE		0	/* Waiting for the start of a telegram */
+#define P1_STATE_FRAME		1	/* Receiving the lines of a telegram */
+
+/* Location of the OBIS code and value group in a telegram line */
+typedef struct
 {
-	assert(telegram != NULL);
-	assert(counters != NULL);
+	int		obis_a;		/* A group of the OBIS code */
+	int		obis_b;		/* B group of the OBIS code */
+	const char*	id;		/* Start of the OBIS code (C.D.E) */
+	size_t		id_len;		/* Length of the OBIS code */
+	const char*	val;		/* Start of the (last) value group */
+	size_t		val_len;	/* Length of the value group */
+}
+p1_line_scan;
+
+/* Location of the number and unit in a value group */
+typedef struct
+{
+	const char*	num;		/* Start of the numerical value */
+	size_t		num_len;	/* Length of the numerical value */
+	const char*	unit;		/* Start of the unit */
+	size_t		unit_len;	/* Length of the unit */
+}
+p1_value_scan;
+
+/* Counter ID that should be decoded */
+typedef struct
+{
+	obis_key	key;		/* Packed counter ID (C.D.E) */
+	UT_hash_handle	hh;
+}
+p1_filter_id;
+
+/* Parser context; holds the engine state and scratch space across telegrams */
+struct p1_parser_ctx
+{
+	int		engine;		/* The parser engine in use */
+	int		has_gas;	/* Set if a gas counter was specified */
+	obis_key	gas_key;	/* Identifier of the gas counter */
+	p1_filter_id*	filter;		/* Counter IDs to decode (all if NULL) */
+	int		next_is_gas;	/* Set if the next line holds the gas counter value */
+
+	/* Streaming state */
+	int		state;		/* Current streaming parser state */
+	int		line_start;	/* Set if the next byte starts a new line */
+	char		line_buf[P1_LINE_MAX + 1];
+	size_t		line_len;	/* Number of bytes in the line buffer */
+	p1_telegram*	record;		/* Telegram to store streamed lines in (may be NULL) */
+	uint16_t	crc;		/* CRC over the telegram received so far */
+	int		crc_done;	/* Set once the '!' that ends the CRC input was seen */
+	unsigned long long	good_frames;	/* Telegrams that passed the CRC check */
+	unsigned long long	bad_frames;	/* Telegrams that failed the CRC check */
+
+	/* Engine specific scanners */
+	int		(*scan_line)(struct p1_parser_ctx*, const char*, size_t, p1_line_scan*);
+	int		(*scan_gas)(struct p1_parser_ctx*, const char*, size_t, p1_line_scan*);
+	int		(*scan_value)(struct p1_parser_ctx*, const char*, size_t, p1_value_scan*);
+
+#ifdef P1_REGEX_ENGINE
+	regex_t		re_simple_c;	/* Compiled simple value expression */
+	regex_t		re_extended_c;	/* Compiled extended value expression */
+	regex_t		re_gas_c;	/* Compiled gas value expression */
+	regex_t		re_counterval_c;/* Compiled counter value expression */
+	char*		val_buf;	/* Scratch buffer for counter values */
+	size_t		scratch_size;	/* Size of the scratch buffer */
+#endif /* P1_REGEX_ENGINE */
+};
+
+#ifdef P1_REGEX_ENGINE
+/* Make sure the scratch buffer can hold a string of the specified length */
+static meterd_rv meterd_p1_parser_reserve(p1_parser_ctx* ctx, size_t len)
+{
+	char*	new_val_buf	= NULL;
+	size_t	new_size	= ctx->scratch_size;
+
+	if (len < ctx->scratch_size)
+	{
+		return MRV_OK;
+	}
+
+	while (new_size <= len)
+	{
+		new_size *= 2;
+	}
+
+	new_val_buf = (char*) realloc(ctx->val_buf, new_size * sizeof(char));
+
+	if (new_val_buf == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	ctx->val_buf		= new_val_buf;
+	ctx->scratch_size	= new_size;
+
+	return MRV_OK;
+}
+#endif /* P1_REGEX_ENGINE */
+
+/*
+ * Single-pass scanner
+ *
+ * Recognises the same lines as the regular expressions used by the
+ * original parser, but does so in one left-to-right pass over the line:
+ *
+ * - the OBIS code is the first "A-B:C.D.E(" in the line
+ * - the value of a line with multiple value groups is the last group
+ *   (the greedy extended expression matches up to the last ")(")
+ * - the value of a line with a single group runs up to the last ')'
+ */
+static int meterd_p1_scan_line(p1_parser_ctx* ctx, const char* line, size_t len, p1_line_scan* scan)
+{
+	const char*	end		= line + len;
+	const char*	it		= NULL;
+	const char*	open		= NULL;
+	const char*	last_close	= NULL;
+	const char*	pair		= NULL;
+	const char*	last_pair	= NULL;
+
+	/* Find the OBIS code */
+	for (it = line; (it + 3) < end; it++)
+	{
+		const char*	id	= NULL;
+		int		groups	= 0;
+
+		if (!P1_IS_DIGIT(it[0]) || (it[1] != '-') || !P1_IS_DIGIT(it[2]) || (it[3] != ':'))
+		{
+			continue;
+		}
+
+		id = it + 4;
+		open = id;
+
+		/* Three groups of digits separated by dots */
+		for (groups = 0; groups < 3; groups++)
+		{
+			const char* digits = open;
+
+			while ((open < end) && P1_IS_DIGIT(*open)) open++;
+
+			if (open == digits) break;
+
+			if (groups < 2)
+			{
+				if ((open < end) && (*open == '.'))
+				{
+					open++;
+				}
+				else
+				{
+					break;
+				}
+			}
+		}
 
-	const char*	re_simple	= "[0-9]-[0-9]:([0-9]+\\.[0-9]+\\.[0-9]+)[(](.*)[)]";
-	const char*	re_extended	= "[0-9]-[0-9]:([0-9]+\\.[0-9]+\\.[0-9]+)[(](.*)[)][(](.*)[)]";
-	const char*	re_gas		= "[(](.*)[)]";
-	const char*	re_counterval	= "([0-9.]*)[*]([A-Za-z0-9]*)";
+		if ((groups == 3) && (open < end) && (*open == '('))
+		{
+			scan->obis_a	= it[0] - '0';
+			scan->obis_b	= it[2] - '0';
+			scan->id	= id;
+			scan->id_len	= open - id;
+
+			break;
+		}
+
+		open = NULL;
+	}
+
+	if (open == NULL)
+	{
+		return 0;
+	}
+
+	/* Find the last value group */
+	for (it = open + 1; it < end; it++)
+	{
+		if (*it == ')')
+		{
+			if ((pair != NULL) && (it >= (pair + 2)))
+			{
+				last_pair = pair;
+			}
+
+			last_close = it;
+
+			if (((it + 1) < end) && (it[1] == '('))
+			{
+				pair = it;
+			}
+		}
+	}
+
+	if (last_close == NULL)
+	{
+		return 0;
+	}
+
+	if (last_pair != NULL)
+	{
+		DEBUG_MSG("Parsing extended value '%.*s'", (int) len, line);
+
+		scan->val = last_pair + 2;
+	}
+	else
+	{
+		DEBUG_MSG("Parsing simple value '%.*s'", (int) len, line);
+
+		scan->val = open + 1;
+	}
+
+	scan->val_len = last_close - scan->val;
+
+	return 1;
+}
+
+/* Find the value on a gas meter line */
+static int meterd_p1_scan_gas(p1_parser_ctx* ctx, const char* line, size_t len, p1_line_scan* scan)
+{
+	const char*	end		= line + len;
+	const char*	it		= NULL;
+	const char*	open		= NULL;
+	const char*	last_close	= NULL;
+
+	for (it = line; it < end; it++)
+	{
+		if ((open == NULL) && (*it == '('))
+		{
+			open = it;
+		}
+		else if ((open != NULL) && (*it == ')'))
+		{
+			last_close = it;
+		}
+	}
+
+	if (last_close == NULL)
+	{
+		return 0;
+	}
+
+	scan->val	= open + 1;
+	scan->val_len	= last_close - scan->val;
+
+	return 1;
+}
+
+/* Split a value group into a number and a unit ("<number>*<unit>") */
+static int meterd_p1_scan_value(p1_parser_ctx* ctx, const char* val, size_t len, p1_value_scan* scan)
+{
+	const char*	end	= val + len;
+	const char*	it	= NULL;
+	const char*	num	= val;
+
+	for (it = val; it < end; it++)
+	{
+		if (*it == '*')
+		{
+			scan->num	= num;
+			scan->num_len	= it - num;
+			scan->unit	= ++it;
+
+			while ((it < end) && P1_IS_ALNUM(*it)) it++;
+
+			scan->unit_len	= it - scan->unit;
+
+			return 1;
+		}
+
+		if (!P1_IS_DIGIT(*it) && (*it != '.'))
+		{
+			num = it + 1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef P1_REGEX_ENGINE
+
+/*
+ * Regular expression parser
+ */
+
+static const char*	re_simple	= "[0-9]-[0-9]:([0-9]+\\.[0-9]+\\.[0-9]+)[(](.*)[)]";
+static const char*	re_extended	= "[0-9]-[0-9]:([0-9]+\\.[0-9]+\\.[0-9]+)[(](.*)[)][(](.*)[)]";
+static const char*	re_gas		= "[(](.*)[)]";
+static const char*	re_counterval	= "([0-9.]*)[*]([A-Za-z0-9]*)";
+
+/* Match a telegram line against the simple and extended expressions */
+static int meterd_p1_regex_line(p1_parser_ctx* ctx, const char* line, size_t len, p1_line_scan* scan)
+{
 	regmatch_t	simple_m[3];
 	regmatch_t	extended_m[4];
+
+	if (regexec(&ctx->re_extended_c, line, 4, extended_m, 0) == 0)
+	{
+		DEBUG_MSG("Parsing extended value '%s'", line);
+
+		scan->obis_a	= line[extended_m[0].rm_so] - '0';
+		scan->obis_b	= line[extended_m[0].rm_so + 2] - '0';
+		scan->id	= &line[extended_m[1].rm_so];
+		scan->id_len	= extended_m[1].rm_eo - extended_m[1].rm_so;
+		scan->val	= &line[extended_m[3].rm_so];
+		scan->val_len	= extended_m[3].rm_eo - extended_m[3].rm_so;
+
+		return 1;
+	}
+	else if (regexec(&ctx->re_simple_c, line, 3, simple_m, 0) == 0)
+	{
+		DEBUG_MSG("Parsing simple value '%s'", line);
+
+		scan->obis_a	= line[simple_m[0].rm_so] - '0';
+		scan->obis_b	= line[simple_m[0].rm_so + 2] - '0';
+		scan->id	= &line[simple_m[1].rm_so];
+		scan->id_len	= simple_m[1].rm_eo - simple_m[1].rm_so;
+		scan->val	= &line[simple_m[2].rm_so];
+		scan->val_len	= simple_m[2].rm_eo - simple_m[2].rm_so;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Match a gas meter line against the gas expression */
+static int meterd_p1_regex_gas(p1_parser_ctx* ctx, const char* line, size_t len, p1_line_scan* scan)
+{
 	regmatch_t	gas_m[2];
+
+	if (regexec(&ctx->re_gas_c, line, 2, gas_m, 0) == 0)
+	{
+		scan->val	= &line[gas_m[1].rm_so];
+		scan->val_len	= gas_m[1].rm_eo - gas_m[1].rm_so;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Match a value group against the counter value expression */
+static int meterd_p1_regex_value(p1_parser_ctx* ctx, const char* val, size_t len, p1_value_scan* scan)
+{
 	regmatch_t	counterval_m[3];
-	int		next_is_gas	= 0;
-	regex_t		re_simple_c	= { 0 };
-	regex_t		re_extended_c	= { 0 };
-	regex_t		re_gas_c	= { 0 };
-	regex_t		re_counterval_c	= { 0 };
-	int		rv		= 0;
-	telegram_ll*	telegram_it	= NULL;
 
-	/* Set up regular expressions */
-	if ((rv = regcomp(&re_simple_c, re_simple, REG_EXTENDED)) != 0)
+	/* The expression needs a NUL-terminated string */
+	if (meterd_p1_parser_reserve(ctx, len) != MRV_OK)
+	{
+		return 0;
+	}
+
+	memcpy(ctx->val_buf, val, len);
+	ctx->val_buf[len] = '\0';
+
+	if (regexec(&ctx->re_counterval_c, ctx->val_buf, 3, counterval_m, 0) == 0)
+	{
+		scan->num	= &ctx->val_buf[counterval_m[1].rm_so];
+		scan->num_len	= counterval_m[1].rm_eo - counterval_m[1].rm_so;
+		scan->unit	= &ctx->val_buf[counterval_m[2].rm_so];
+		scan->unit_len	= counterval_m[2].rm_eo - counterval_m[2].rm_so;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Compile the regular expressions */
+static meterd_rv meterd_p1_regex_init(p1_parser_ctx* ctx)
+{
+	int	rv	= 0;
+
+	if ((rv = regcomp(&ctx->re_simple_c, re_simple, REG_EXTENDED)) != 0)
 	{
 		DEBUG_MSG("Regex failed to compile: %d\n", rv);
 
 		return MRV_GENERAL_ERROR;
 	}
 
-	if ((rv = regcomp(&re_extended_c, re_extended, REG_EXTENDED)) != 0)
+	if ((rv = regcomp(&ctx->re_extended_c, re_extended, REG_EXTENDED)) != 0)
 	{
 		DEBUG_MSG("Regex failed to compile: %d\n", rv);
 
-		regfree(&re_simple_c);
+		regfree(&ctx->re_simple_c);
 
 		return MRV_GENERAL_ERROR;
 	}
 
-	if ((rv = regcomp(&re_gas_c, re_gas, REG_EXTENDED)) != 0)
+	if ((rv = regcomp(&ctx->re_gas_c, re_gas, REG_EXTENDED)) != 0)
 	{
 		DEBUG_MSG("Regex failed to compile: %d\n", rv);
 
-		regfree(&re_simple_c);
-		regfree(&re_extended_c);
+		regfree(&ctx->re_simple_c);
+		regfree(&ctx->re_extended_c);
 
 		return MRV_GENERAL_ERROR;
 	}
 
-	if ((rv = regcomp(&re_counterval_c, re_counterval, REG_EXTENDED)) != 0)
+	if ((rv = regcomp(&ctx->re_counterval_c, re_counterval, REG_EXTENDED)) != 0)
 	{
 		DEBUG_MSG("Regex failed to compile: %d\n", rv);
 
-		regfree(&re_simple_c);
-		regfree(&re_extended_c);
-		regfree(&re_gas_c);
+		regfree(&ctx->re_simple_c);
+		regfree(&ctx->re_extended_c);
+		regfree(&ctx->re_gas_c);
 
 		return MRV_GENERAL_ERROR;
 	}
 
-	/* Parse the telegram */
-	LL_FOREACH(telegram, telegram_it)
+	/* Values are copied into a scratch buffer to match them */
+	ctx->scratch_size	= P1_SCRATCH_INITIAL;
+	ctx->val_buf		= (char*) malloc(ctx->scratch_size * sizeof(char));
+
+	if (ctx->val_buf == NULL)
+	{
+		regfree(&ctx->re_simple_c);
+		regfree(&ctx->re_extended_c);
+		regfree(&ctx->re_gas_c);
+		regfree(&ctx->re_counterval_c);
+
+		return MRV_MEMORY;
+	}
+
+	ctx->scan_line	= meterd_p1_regex_line;
+	ctx->scan_gas	= meterd_p1_regex_gas;
+	ctx->scan_value	= meterd_p1_regex_value;
+
+	return MRV_OK;
+}
+
+#endif /* P1_REGEX_ENGINE */
+
+/* Create a parser context for the specified gas counter (may be NULL) */
+meterd_rv meterd_p1_parser_create(const char* gas_id, int engine, p1_parser_ctx** ctx)
+{
+	assert(ctx != NULL);
+
+	p1_parser_ctx*	new_ctx	= NULL;
+
+	if (engine == P1_ENGINE_DEFAULT)
 	{
-		if (next_is_gas)
+#ifdef METERD_REGEX_PARSER
+		engine = P1_ENGINE_REGEX;
+#else
+		engine = P1_ENGINE_SCANNER;
+#endif /* METERD_REGEX_PARSER */
+	}
+
+#ifndef P1_REGEX_ENGINE
+	if (engine == P1_ENGINE_REGEX)
+	{
+		ERROR_MSG("The regular expression parser is not available in this build");
+
+		return MRV_PARAM_INVALID;
+	}
+#endif /* !P1_REGEX_ENGINE */
+
+	new_ctx = (p1_parser_ctx*) calloc(1, sizeof(p1_parser_ctx));
+
+	if (new_ctx == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	new_ctx->engine		= engine;
+	new_ctx->state		= P1_STATE_IDLE;
+	new_ctx->line_start	= 1;
+
+	meterd_crc16_init();
+	new_ctx->scan_line	= meterd_p1_scan_line;
+	new_ctx->scan_gas	= meterd_p1_scan_gas;
+	new_ctx->scan_value	= meterd_p1_scan_value;
+
+	if (gas_id != NULL)
+	{
+		if (meterd_obis_from_string(gas_id, strlen(gas_id), &new_ctx->gas_key) != MRV_OK)
 		{
-			next_is_gas = 0;
+			ERROR_MSG("Invalid gas counter ID %s", gas_id);
 
-			if ((rv = regexec(&re_gas_c, telegram_it->t_line, 2, gas_m, 0)) == 0)
-			{
-				size_t		val_len		= gas_m[1].rm_eo - gas_m[1].rm_so;
-				char		val_buf[256]	= { 0 };
-				smart_counter*	new_counter	= NULL;
+			free(new_ctx);
 
-				if (val_len >= 256)
-				{
-					ERROR_MSG("Invalid gas counter data of length %zd", val_len);
-				}
-				else
-				{
-					/* Copy value */
-					strncpy(val_buf, &telegram_it->t_line[gas_m[1].rm_so], val_len);
+			return MRV_PARAM_INVALID;
+		}
 
-					/* Add new counter */
-					new_counter = (smart_counter*) malloc(sizeof(smart_counter));
+		new_ctx->gas_key	= OBIS_CDE(new_ctx->gas_key);
+		new_ctx->has_gas	= 1;
+	}
 
-					if (new_counter == NULL)
-					{
-						regfree(&re_simple_c);
-						regfree(&re_extended_c);
-						regfree(&re_gas_c);
-						regfree(&re_counterval_c);
+#ifdef P1_REGEX_ENGINE
+	if ((engine == P1_ENGINE_REGEX) && (meterd_p1_regex_init(new_ctx) != MRV_OK))
+	{
+		free(new_ctx);
 
-						/* Return memory error */
-						return MRV_MEMORY;
-					}
+		return MRV_GENERAL_ERROR;
+	}
+#endif /* P1_REGEX_ENGINE */
 
-					new_counter->id = strdup(gas_id);
-					new_counter->unit = strdup(UNIT_M3);
-					new_counter->value = strtold(val_buf, NULL);
+	*ctx = new_ctx;
 
-					LL_APPEND((*counters), new_counter);
-				}
-			}
-			else
-			{
-				ERROR_MSG("Gas meter parse error");
-			}
+	return MRV_OK;
+}
+
+/* Only decode counters with the specified ID; all counters are decoded if no IDs are added */
+meterd_rv meterd_p1_parser_add_filter(p1_parser_ctx* ctx, obis_key id)
+{
+	assert(ctx != NULL);
+
+	p1_filter_id*	filter_id	= NULL;
+
+	id = OBIS_CDE(id);
+
+	HASH_FIND(hh, ctx->filter, &id, sizeof(obis_key), filter_id);
+
+	if (filter_id != NULL)
+	{
+		return MRV_OK;
+	}
+
+	filter_id = (p1_filter_id*) malloc(sizeof(p1_filter_id));
+
+	if (filter_id == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	filter_id->key = id;
+
+	HASH_ADD(hh, ctx->filter, key, sizeof(obis_key), filter_id);
+
+	return MRV_OK;
+}
+
+/* Add a counter with the specified ID, value and unit to the list */
+static meterd_rv meterd_p1_add_counter(obis_key id, const char* value, size_t value_len, meterd_unit unit, smart_counter** counters)
+{
+	smart_counter*	new_counter	= NULL;
+	meterd_fixed	fixed_val	= 0;
+
+	if (meterd_fixed_parse(value, value_len, &fixed_val) != MRV_OK)
+	{
+		ERROR_MSG("Counter value '%.*s' is out of range", (int) value_len, value);
+
+		return MRV_OK;
+	}
+
+	new_counter = (smart_counter*) malloc(sizeof(smart_counter));
+
+	if (new_counter == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	new_counter->id		= id;
+	new_counter->unit	= unit;
+	new_counter->value	= fixed_val;
+
+	LL_APPEND((*counters), new_counter);
+
+	return MRV_OK;
+}
+
+/* Decode a single telegram line and add the counter it holds (if any) to the list */
+static meterd_rv meterd_p1_parse_line(p1_parser_ctx* ctx, const char* line, size_t line_len, smart_counter** counters)
+{
+	p1_line_scan	line_scan;
+	p1_value_scan	value_scan;
+	obis_key	key	= 0;
+
+	if (ctx->next_is_gas)
+	{
+		ctx->next_is_gas = 0;
+
+		if (ctx->scan_gas(ctx, line, line_len, &line_scan))
+		{
+			/* Add new counter */
+			return meterd_p1_add_counter(ctx->gas_key, line_scan.val, line_scan.val_len, UNIT_M3, counters);
 		}
-		else if ((rv = regexec(&re_extended_c, telegram_it->t_line, 4, extended_m, 0)) == 0)
+		else
 		{
-			size_t 		id_len 		= extended_m[1].rm_eo - extended_m[1].rm_so;
-			size_t 		val_len		= extended_m[3].rm_eo - extended_m[3].rm_so;
-			smart_counter*	new_counter	= NULL;
-			char*		new_id		= (char*) malloc((id_len + 1) * sizeof(char));
-			char*		new_val		= (char*) malloc((val_len+1) * sizeof(char));
+			ERROR_MSG("Gas meter parse error");
+		}
 
-			DEBUG_MSG("Parsing extended value '%s'", telegram_it->t_line);
+		return MRV_OK;
+	}
 
-			if ((new_id == NULL) || (new_val == NULL))
-			{
-				/* Return memory error */
-				regfree(&re_simple_c);
-				regfree(&re_extended_c);
-				regfree(&re_gas_c);
-				regfree(&re_counterval_c);
+	if (!ctx->scan_line(ctx, line, line_len, &line_scan))
+	{
+		DEBUG_MSG("No counter found in '%s'", line);
 
-				free(new_id);
-				free(new_val);
+		return MRV_OK;
+	}
 
-				return MRV_MEMORY;
-			}
+	if (meterd_obis_from_string(line_scan.id, line_scan.id_len, &key) != MRV_OK)
+	{
+		DEBUG_MSG("Invalid counter ID %.*s", (int) line_scan.id_len, line_scan.id);
 
-			/* Copy ID */
-			memset(new_id, 0, id_len + 1);
-			strncpy(new_id, &telegram_it->t_line[extended_m[1].rm_so], id_len);
+		return MRV_OK;
+	}
 
-			DEBUG_MSG("Processing ID %s", new_id);
+	if (ctx->has_gas && (key == ctx->gas_key))
+	{
+		/* This is a gas meter counter, the actual value is on the next line */
+		ctx->next_is_gas = 1;
 
-			if ((gas_id != NULL) && (strlen(gas_id) == id_len) && (strcmp(gas_id, new_id) == 0))
-			{
-				/* This is a gas meter counter, the actual value is on the next line */
-				next_is_gas = 1;
+		DEBUG_MSG("Next is gas");
 
-				DEBUG_MSG("Next is gas");
+		return MRV_OK;
+	}
 
-				free(new_id);
-			}
-			else
-			{
-				/* And get the value */
-				memset(new_val, 0, val_len + 1);
-				strncpy(new_val, &telegram_it->t_line[extended_m[3].rm_so], val_len);
-	
-				if ((rv = regexec(&re_counterval_c, new_val, 3, counterval_m, 0)) == 0)
-				{
-					size_t	ctr_len		= counterval_m[1].rm_eo - counterval_m[1].rm_so;
-					size_t	unit_len	= counterval_m[2].rm_eo - counterval_m[2].rm_so;
-					char	ctr_buf[256]	= { 0 };
-					char	unit_buf[256]	= { 0 };
-	
-					if ((ctr_len >= 256) || (unit_len >= 256))
-					{
-						ERROR_MSG("Invalid counter ID (%zd bytes) or unit (%zd bytes) length", ctr_len, unit_len);
-					}
-					else
-					{
-						/* Copy counter value and unit information */
-						strncpy(ctr_buf, &new_val[counterval_m[1].rm_so], ctr_len);
-						strncpy(unit_buf, &new_val[counterval_m[2].rm_so], unit_len);
-	
-						/* Add this new counter to the list */
-						new_counter = (smart_counter*) malloc(sizeof(smart_counter));
-		
-						if (new_counter == NULL)
-						{
-							/* Return memory error! */
-							regfree(&re_simple_c);
-							regfree(&re_extended_c);
-							regfree(&re_gas_c);
-							regfree(&re_counterval_c);
-							free(new_id);
-							free(new_val);
-		
-							return MRV_MEMORY;
-						}
-	
-						new_counter->unit 	= strdup(unit_buf);
-						new_counter->id 	= new_id;
-						new_counter->value 	= strtold(&ctr_buf[0], NULL);
-	
-						LL_APPEND((*counters), new_counter);
-					}
-				}
-				else
-				{
-					free(new_id);
-				}
-	
-				free(new_val);
-			}
+	/* Skip counters that were not asked for before doing any further work */
+	if (ctx->filter != NULL)
+	{
+		p1_filter_id*	filter_id	= NULL;
+
+		HASH_FIND(hh, ctx->filter, &key, sizeof(obis_key), filter_id);
+
+		if (filter_id == NULL)
+		{
+			DEBUG_MSG("Skipping ID %.*s", (int) line_scan.id_len, line_scan.id);
+
+			return MRV_OK;
 		}
-		else if ((rv = regexec(&re_simple_c, telegram_it->t_line, 3, simple_m, 0)) == 0)
+	}
+
+	DEBUG_MSG("Processing ID %.*s", (int) line_scan.id_len, line_scan.id);
+
+	if (ctx->scan_value(ctx, line_scan.val, line_scan.val_len, &value_scan))
+	{
+		key |= OBIS_KEY(line_scan.obis_a, line_scan.obis_b, 0, 0, 0);
+
+		return meterd_p1_add_counter(key, value_scan.num, value_scan.num_len, meterd_unit_intern(value_scan.unit, value_scan.unit_len), counters);
+	}
+
+	return MRV_OK;
+}
+
+/* Parse the supplied P1 telegram */
+meterd_rv meterd_parse_p1_telegram(p1_parser_ctx* ctx, const p1_telegram* telegram, smart_counter** counters)
+{
+	assert(ctx != NULL);
+	assert(telegram != NULL);
+	assert(counters != NULL);
+
+	meterd_rv	rv	= MRV_OK;
+	size_t		i	= 0;
+
+	ctx->next_is_gas = 0;
+
+	/* Parse the telegram */
+	for (i = 0; i < telegram->line_count; i++)
+	{
+		if ((rv = meterd_p1_parse_line(ctx, TELEGRAM_LINE(telegram, i), TELEGRAM_LINE_LEN(telegram, i), counters)) != MRV_OK)
 		{
-			size_t 		id_len 		= simple_m[1].rm_eo - simple_m[1].rm_so;
-			size_t 		val_len		= simple_m[2].rm_eo - simple_m[2].rm_so;
-			smart_counter*	new_counter	= NULL;
-			char*		new_id		= (char*) malloc((id_len + 1) * sizeof(char));
-			char*		new_val		= NULL;
+			return rv;
+		}
+	}
+
+	return MRV_OK;
+}
 
-			DEBUG_MSG("Parsing simple value '%s'", telegram_it->t_line);
+/* Start receiving a new telegram, discarding anything received so far */
+static void meterd_p1_parser_begin(p1_parser_ctx* ctx, smart_counter** counters)
+{
+	meterd_p1_counters_free(*counters);
+	*counters = NULL;
 
-			if (new_id == NULL)
-			{
-				/* Return memory error */
-				regfree(&re_simple_c);
-				regfree(&re_extended_c);
-				regfree(&re_gas_c);
-				regfree(&re_counterval_c);
+	if (ctx->record != NULL)
+	{
+		meterd_telegram_reset(ctx->record);
+	}
 
-				return MRV_MEMORY;
-			}
+	ctx->next_is_gas	= 0;
+	ctx->line_len		= 0;
+	ctx->crc		= 0;
+	ctx->crc_done		= 0;
+}
 
-			/* First, copy the ID of the counter so we can check if this is a gas meter */
-			memset(new_id, 0, id_len + 1);
-			strncpy(new_id, &telegram_it->t_line[simple_m[1].rm_so], id_len);
+/*
+ * Check the CRC in the closing line of the telegram ("!XXXX"); older
+ * (DSMR 2.2/3) meters do not send a CRC, these telegrams are accepted
+ */
+static int meterd_p1_parser_check_crc(p1_parser_ctx* ctx)
+{
+	const char*	it	= &ctx->line_buf[1];
+	uint16_t	crc	= 0;
+	int		i	= 0;
 
-			DEBUG_MSG("Processing ID %s", new_id);
+	if (*it == '\0')
+	{
+		return 1;
+	}
 
-			if ((gas_id != NULL) && (strlen(gas_id) == id_len) && (strcmp(gas_id, new_id) == 0))
-			{
-				/* This is a gas meter counter, the actual value is on the next line */
-				next_is_gas = 1;
+	for (i = 0; i < 4; i++)
+	{
+		int	val	= P1_HEX_VAL(it[i]);
 
-				DEBUG_MSG("Next is gas");
+		if (val < 0)
+		{
+			WARNING_MSG("Malformed CRC in closing line '%s'", ctx->line_buf);
 
-				free(new_id);
-			}
-			else
+			return 0;
+		}
+
+		crc = (crc << 4) | val;
+	}
+
+	if (crc != ctx->crc)
+	{
+		WARNING_MSG("CRC mismatch in telegram (received %04X, calculated %04X)", crc, ctx->crc);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Process a complete line from the line buffer */
+static meterd_rv meterd_p1_parser_line(p1_parser_ctx* ctx, smart_counter** counters)
+{
+	const char*	cr	= memchr(ctx->line_buf, '\r', ctx->line_len);
+	size_t		len	= (cr != NULL) ? (size_t) (cr - ctx->line_buf) : ctx->line_len;
+	meterd_rv	rv	= MRV_OK;
+
+	ctx->line_buf[len]	= '\0';
+	ctx->line_len		= 0;
+
+	if (ctx->record != NULL)
+	{
+		char*	dst	= meterd_telegram_reserve(ctx->record, len);
+
+		if (dst == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		memcpy(dst, ctx->line_buf, len);
+
+		if ((rv = meterd_telegram_commit_line(ctx->record, len)) != MRV_OK)
+		{
+			return rv;
+		}
+	}
+
+	return meterd_p1_parse_line(ctx, ctx->line_buf, len, counters);
+}
+
+/* Feed received bytes to the parser */
+meterd_rv meterd_p1_parser_push(p1_parser_ctx* ctx, const char* data, size_t len, size_t* consumed, smart_counter** counters)
+{
+	assert(ctx != NULL);
+	assert((data != NULL) || (len == 0));
+	assert(consumed != NULL);
+	assert(counters != NULL);
+
+	size_t		i		= 0;
+	size_t		crc_from	= 0;	/* Start of the CRC input in this chunk */
+	meterd_rv	rv		= MRV_OK;
+
+	for (i = 0; i < len; i++)
+	{
+		char	c	= data[i];
+
+		if (ctx->state == P1_STATE_IDLE)
+		{
+			/* Skip everything up to a line starting with '/' */
+			if ((c != '/') || !ctx->line_start)
 			{
-				/* This is a regular counter */
-				new_val = (char*) malloc((val_len + 1) * sizeof(char));
+				ctx->line_start = (c == '\n');
 
-				if (new_val == NULL)
-				{
-					/* Return memory error */
-					free(new_id);
-					regfree(&re_simple_c);
-					regfree(&re_extended_c);
-					regfree(&re_gas_c);
-					regfree(&re_counterval_c);
-
-					return MRV_MEMORY;
-				}
+				continue;
+			}
+
+			meterd_p1_parser_begin(ctx, counters);
+
+			ctx->state	= P1_STATE_FRAME;
+			crc_from	= i;
+		}
+		else if ((c == '/') && (ctx->line_len == 0))
+		{
+			WARNING_MSG("Discarding incomplete telegram");
 
-				memset(new_val, 0, val_len + 1);
-				strncpy(new_val, &telegram_it->t_line[simple_m[2].rm_so], val_len);
+			meterd_p1_parser_begin(ctx, counters);
 
-				/* Match the value */
-				if ((rv = regexec(&re_counterval_c, new_val, 3, counterval_m, 0)) == 0)
+			crc_from = i;
+		}
+		else if ((c == '!') && (ctx->line_len == 0))
+		{
+			/* The CRC covers everything up to and including the '!' */
+			ctx->crc	= meterd_crc16_update(ctx->crc, &data[crc_from], i + 1 - crc_from);
+			ctx->crc_done	= 1;
+		}
+
+		if (c == '\n')
+		{
+			/* The line starting with '!' ends the telegram */
+			int	last_line	= (ctx->line_len > 0) && (ctx->line_buf[0] == '!');
+
+			if ((rv = meterd_p1_parser_line(ctx, counters)) != MRV_OK)
+			{
+				ERROR_MSG("Failed to process telegram line, discarding telegram");
+
+				meterd_p1_parser_begin(ctx, counters);
+			}
+			else if (last_line)
+			{
+				if (meterd_p1_parser_check_crc(ctx))
 				{
-					size_t	ctr_len		= counterval_m[1].rm_eo - counterval_m[1].rm_so;
-					size_t	unit_len	= counterval_m[2].rm_eo - counterval_m[2].rm_so;
-					char	ctr_buf[256]	= { 0 };
-					char	unit_buf[256]	= { 0 };
-
-					if ((ctr_len >= 256) || (unit_len >= 256))
-					{
-						ERROR_MSG("Invalid counter ID (%zd bytes) or unit (%zd bytes) length", ctr_len, unit_len);
-					}
-					else
-					{
-						/* Copy counter value and unit information */
-						strncpy(ctr_buf, &new_val[counterval_m[1].rm_so], ctr_len);
-						strncpy(unit_buf, &new_val[counterval_m[2].rm_so], unit_len);
-
-						/* Add this new counter to the list */
-						new_counter = (smart_counter*) malloc(sizeof(smart_counter));
-	
-						if (new_counter == NULL)
-						{
-							/* Return memory error! */
-							regfree(&re_simple_c);
-							regfree(&re_extended_c);
-							regfree(&re_gas_c);
-							regfree(&re_counterval_c);
-							free(new_id);
-							free(new_val);
-	
-							return MRV_MEMORY;
-						}
-
-						new_counter->unit 	= strdup(unit_buf);
-						new_counter->id 	= new_id;
-						new_counter->value 	= strtold(&ctr_buf[0], NULL);
-
-						LL_APPEND((*counters), new_counter);
-					}
+					ctx->good_frames++;
 				}
 				else
 				{
-					free(new_id);
+					ctx->bad_frames++;
+
+					meterd_p1_parser_begin(ctx, counters);
+
+					rv = MRV_P1_CRC_ERROR;
 				}
+			}
+
+			if ((rv != MRV_OK) || last_line)
+			{
+				ctx->state	= P1_STATE_IDLE;
+				ctx->line_start	= 1;
 
-				free(new_val);
+				*consumed = i + 1;
+
+				return rv;
 			}
+
+			continue;
 		}
-		else
+
+		if (ctx->line_len >= P1_LINE_MAX)
 		{
-			DEBUG_MSG("No regular expression matches '%s'", telegram_it->t_line);
+			WARNING_MSG("Telegram line exceeds %d bytes, discarding telegram", P1_LINE_MAX);
+
+			meterd_p1_parser_begin(ctx, counters);
+
+			ctx->state	= P1_STATE_IDLE;
+			ctx->line_start	= 0;
+
+			continue;
 		}
+
+		ctx->line_buf[ctx->line_len++] = c;
+	}
+
+	/* Add the part of the telegram in this chunk to the CRC */
+	if ((ctx->state == P1_STATE_FRAME) && !ctx->crc_done)
+	{
+		ctx->crc = meterd_crc16_update(ctx->crc, &data[crc_from], len - crc_from);
 	}
 
-	/* Clean up regular expression parser */
-	regfree(&re_simple_c);
-	regfree(&re_extended_c);
-	regfree(&re_gas_c);
-	regfree(&re_counterval_c);
+	*consumed = len;
 
-	return MRV_OK;
+	return MRV_P1_MORE_DATA;
+}
+
+/* Also store the lines of streamed telegrams in the specified telegram (may be NULL) */
+void meterd_p1_parser_record(p1_parser_ctx* ctx, p1_telegram* telegram)
+{
+	assert(ctx != NULL);
+
+	ctx->record = telegram;
+}
+
+/* Get the number of streamed telegrams that passed and failed the CRC check */
+void meterd_p1_parser_get_stats(p1_parser_ctx* ctx, unsigned long long* good, unsigned long long* bad)
+{
+	assert(ctx != NULL);
+	assert(good != NULL);
+	assert(bad != NULL);
+
+	*good	= ctx->good_frames;
+	*bad	= ctx->bad_frames;
+}
+
+/* Destroy a parser context */
+void meterd_p1_parser_destroy(p1_parser_ctx* ctx)
+{
+	p1_filter_id*	filter_it	= NULL;
+	p1_filter_id*	filter_tmp	= NULL;
+
+	if (ctx == NULL) return;
+
+#ifdef P1_REGEX_ENGINE
+	if (ctx->engine == P1_ENGINE_REGEX)
+	{
+		regfree(&ctx->re_simple_c);
+		regfree(&ctx->re_extended_c);
+		regfree(&ctx->re_gas_c);
+		regfree(&ctx->re_counterval_c);
+	}
+
+	free(ctx->val_buf);
+#endif /* P1_REGEX_ENGINE */
+
+	HASH_ITER(hh, ctx->filter, filter_it, filter_tmp)
+	{
+		HASH_DEL(ctx->filter, filter_it);
+
+		free(filter_it);
+	}
+
+	free(ctx);
 }
 
 /* Free a linked list of counters*/
@@ -376,8 +983,6 @@ void meterd_p1_counters_free(smart_counter* counters)
 
 	LL_FOREACH_SAFE(counters, ctr_it, ctr_tmp)
 	{
-		free(ctr_it->id);
-		free(ctr_it->unit);
 		free(ctr_it);
 	}
 }
@@ -36,8 +36,41 @@
 #include "config.h"
 #include "meterd_types.h"
 
-/* Parse the supplied P1 telegram and look for the specified gas counter */
-meterd_rv meterd_parse_p1_telegram(telegram_ll* telegram, const char* gas_id, smart_counter** counters);
+/* Parser engines */
+#define P1_ENGINE_DEFAULT	0	/* Scanner, or regular expressions if configured with --enable-regex-parser */
+#define P1_ENGINE_SCANNER	1	/* Hand-written single-pass scanner */
+#define P1_ENGINE_REGEX		2	/* POSIX regular expressions */
+
+/* Parser context; set up once and reused for every telegram */
+typedef struct p1_parser_ctx p1_parser_ctx;
+
+/* Create a parser context for the specified gas counter (may be NULL) */
+meterd_rv meterd_p1_parser_create(const char* gas_id, int engine, p1_parser_ctx** ctx);
+
+/* Only decode counters with the specified ID; all counters are decoded if no IDs are added */
+meterd_rv meterd_p1_parser_add_filter(p1_parser_ctx* ctx, obis_key id);
+
+/* Parse the supplied P1 telegram */
+meterd_rv meterd_parse_p1_telegram(p1_parser_ctx* ctx, const p1_telegram* telegram, smart_counter** counters);
+
+/*
+ * Feed received bytes to the parser; counters are appended to the list
+ * as soon as their line is complete. Returns MRV_OK when the end of a
+ * telegram was reached and MRV_P1_MORE_DATA if more data is needed; the
+ * number of bytes used is returned in consumed. Telegrams that fail the
+ * CRC check are discarded (including their counters) and reported as
+ * MRV_P1_CRC_ERROR.
+ */
+meterd_rv meterd_p1_parser_push(p1_parser_ctx* ctx, const char* data, size_t len, size_t* consumed, smart_counter** counters);
+
+/* Also store the lines of streamed telegrams in the specified telegram (may be NULL) */
+void meterd_p1_parser_record(p1_parser_ctx* ctx, p1_telegram* telegram);
+
+/* Get the number of streamed telegrams that passed and failed the CRC check */
+void meterd_p1_parser_get_stats(p1_parser_ctx* ctx, unsigned long long* good, unsigned long long* bad);
+
+/* Destroy a parser context */
+void meterd_p1_parser_destroy(p1_parser_ctx* ctx);
 
 /* Free a linked list of counters*/
 void meterd_p1_counters_free(smart_counter* counters);
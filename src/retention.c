@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Data retention
+ */
+
+#include "config.h"
+#include "retention.h"
+#include "meterd_types.h"
+#include "meterd_config.h"
+#include "meterd_log.h"
+#include "meterd_error.h"
+#include "db.h"
+#include "utlist.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Retention policy for the data tables of a type in a database */
+typedef struct retention_policy
+{
+	char*				db_name;
+	int				type;		/* Table type, -1 for all tables */
+	int				max_age;	/* Seconds */
+	struct retention_policy*	next;
+}
+retention_policy;
+
+/* Default interval between maintenance runs (seconds) */
+#define RETENTION_DEFAULT_INTERVAL	3600
+
+/* Default number of rows to delete from a table at a time */
+#define RETENTION_DEFAULT_BATCH		1000
+
+/* Number of free pages to return to the file system at a time */
+#define RETENTION_VACUUM_PAGES		256
+
+/* Module variables */
+static pthread_t		retention_thread;
+static volatile int		retention_run		= 1;
+static retention_policy*	policies		= NULL;
+static int			retention_interval	= RETENTION_DEFAULT_INTERVAL;
+static int			retention_batch		= RETENTION_DEFAULT_BATCH;
+
+/* Add a retention policy for the specified data using the number of days configured for db_type */
+static meterd_rv meterd_retention_add_policy(const char* db_name, const char* db_type, int type, const char* description)
+{
+	retention_policy*	new_policy	= NULL;
+	int			days		= 0;
+	meterd_rv		rv		= MRV_OK;
+
+	if ((rv = meterd_conf_get_int("database.retention", db_type, &days, 0)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.retention.%s", db_type);
+
+		return rv;
+	}
+
+	/* Data is kept forever unless configured otherwise */
+	if (days <= 0)
+	{
+		return MRV_OK;
+	}
+
+	new_policy = (retention_policy*) malloc(sizeof(retention_policy));
+
+	if (new_policy == NULL)
+	{
+		return MRV_MEMORY;
+	}
+
+	new_policy->db_name	= strdup(db_name);
+	new_policy->type	= type;
+	new_policy->max_age	= days * 86400;
+
+	LL_APPEND(policies, new_policy);
+
+	INFO_MSG("Keeping %s data in %s for %d day(s)", description, db_name, days);
+
+	return MRV_OK;
+}
+
+/* Initialise data retention */
+meterd_rv meterd_retention_init(void)
+{
+	const char*	db_types[4]	= { "raw_db", "fivemin_avg", "hourly_avg", "total_consumed" };
+	char*		single_db_name	= NULL;
+	char*		db_name		= NULL;
+	int		i		= 0;
+	meterd_rv	rv		= MRV_OK;
+
+	if (((rv = meterd_conf_get_int("database.retention", "interval", &retention_interval, RETENTION_DEFAULT_INTERVAL)) != MRV_OK) ||
+	    ((rv = meterd_conf_get_int("database.retention", "batch_size", &retention_batch, RETENTION_DEFAULT_BATCH)) != MRV_OK))
+	{
+		ERROR_MSG("Failed to retrieve data retention configuration");
+
+		return rv;
+	}
+
+	if ((retention_interval <= 0) || (retention_batch <= 0))
+	{
+		ERROR_MSG("Invalid data retention interval (%d) or batch size (%d)", retention_interval, retention_batch);
+
+		return MRV_CONFIG_ERROR;
+	}
+
+	if ((rv = meterd_conf_get_string("database", "single_db", &single_db_name, NULL)) != MRV_OK)
+	{
+		ERROR_MSG("Failed to retrieve configuration option database.single_db");
+
+		return rv;
+	}
+
+	if (single_db_name != NULL)
+	{
+		/* All data is in a single database, apply the policies per table type */
+		if (((rv = meterd_retention_add_policy(single_db_name, "raw_db", COUNTER_TYPE_RAW, "raw")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "fivemin_avg", COUNTER_TYPE_FIVEMIN, "5 minute average")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "hourly_avg", COUNTER_TYPE_HOURLY, "hourly average")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "total_consumed", COUNTER_TYPE_CONSUMED, "consumption counter")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "total_consumed", COUNTER_TYPE_PRODUCED, "production counter")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "total_consumed", COUNTER_TYPE_DELTA, "consumption/production delta")) != MRV_OK) ||
+		    ((rv = meterd_retention_add_policy(single_db_name, "windows", COUNTER_TYPE_WINDOW, "aggregation window")) != MRV_OK))
+		{
+			free(single_db_name);
+
+			return rv;
+		}
+
+		free(single_db_name);
+
+		return MRV_OK;
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		if ((rv = meterd_conf_get_string("database", db_types[i], &db_name, NULL)) != MRV_OK)
+		{
+			ERROR_MSG("Failed to retrieve configuration option database.%s", db_types[i]);
+
+			return rv;
+		}
+
+		if (db_name == NULL) continue;
+
+		rv = meterd_retention_add_policy(db_name, db_types[i], -1, db_types[i]);
+
+		/* Windows are kept in the database of the raw or cumulative values */
+		if ((rv == MRV_OK) && (!strcmp(db_types[i], "raw_db") || !strcmp(db_types[i], "total_consumed")))
+		{
+			rv = meterd_retention_add_policy(db_name, "windows", COUNTER_TYPE_WINDOW, "aggregation window");
+		}
+
+		free(db_name);
+
+		if (rv != MRV_OK)
+		{
+			return rv;
+		}
+	}
+
+	return MRV_OK;
+}
+
+/* Delete expired data according to the specified policy and return free space to the file system */
+static void meterd_retention_apply(retention_policy* policy, time_t now)
+{
+	void*			db_handle	= NULL;
+	unsigned long long	total_deleted	= 0;
+	long long		total_reclaimed	= 0;
+	long long		reclaimed	= 0;
+	int			deleted		= 0;
+	meterd_rv		rv		= MRV_OK;
+
+	if (meterd_db_open(policy->db_name, 0, &db_handle) != MRV_OK)
+	{
+		ERROR_MSG("Failed to open %s to delete expired data", policy->db_name);
+
+		return;
+	}
+
+	/* Delete in small batches so the measurement loop can write in between */
+	do
+	{
+		rv = meterd_db_expire(db_handle, policy->type, (int) (now - policy->max_age), retention_batch, &deleted);
+
+		total_deleted += deleted;
+	}
+	while (retention_run && (rv == MRV_OK) && (deleted > 0));
+
+	/* Return the space that was freed to the file system */
+	while (retention_run && (rv == MRV_OK))
+	{
+		rv = meterd_db_vacuum(db_handle, RETENTION_VACUUM_PAGES, &reclaimed);
+
+		if (reclaimed <= 0) break;
+
+		total_reclaimed += reclaimed;
+	}
+
+	if (rv == MRV_DB_BUSY)
+	{
+		INFO_MSG("Database %s is busy, continuing data expiry during the next run", policy->db_name);
+	}
+
+	if ((total_deleted > 0) || (total_reclaimed > 0))
+	{
+		INFO_MSG("Deleted %llu expired row(s) from %s, reclaimed %lld bytes", total_deleted, policy->db_name, total_reclaimed);
+	}
+	else
+	{
+		DEBUG_MSG("No expired data in %s", policy->db_name);
+	}
+
+	meterd_db_close(db_handle);
+}
+
+/* Main thread procedure */
+void* meterd_retention_threadproc(void* param)
+{
+	retention_policy*	policy_it	= NULL;
+	time_t			last_run	= 0;
+	time_t			now		= 0;
+	sigset_t		signals;
+
+	/* Signals are handled by the measurement loop */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	INFO_MSG("Entering data retention thread");
+
+	while(retention_run)
+	{
+		now = time(NULL);
+
+		if ((now - last_run) >= retention_interval)
+		{
+			LL_FOREACH(policies, policy_it)
+			{
+				if (!retention_run) break;
+
+				meterd_retention_apply(policy_it, now);
+			}
+
+			last_run = now;
+		}
+
+		sleep(1);
+	}
+
+	INFO_MSG("Leaving data retention thread");
+
+	return NULL;
+}
+
+/* Start the data retention thread */
+void meterd_retention_start(void)
+{
+	pthread_attr_t	retention_t_attr;
+
+	/* Only start the data retention thread if there are policies configured */
+	if (policies != NULL)
+	{
+		INFO_MSG("Launching data retention thread, running every %d second(s)", retention_interval);
+
+		pthread_attr_init(&retention_t_attr);
+		pthread_attr_setdetachstate(&retention_t_attr, PTHREAD_CREATE_JOINABLE);
+
+		if (pthread_create(&retention_thread, &retention_t_attr, meterd_retention_threadproc, NULL) != 0)
+		{
+			ERROR_MSG("Failed to start data retention thread");
+
+			retention_run = 0;
+		}
+	}
+	else
+	{
+		INFO_MSG("No data retention configured, keeping all data");
+		retention_run = 0;
+	}
+}
+
+/* Stop the data retention thread */
+void meterd_retention_stop(void)
+{
+	if (retention_run)
+	{
+		retention_run = 0;
+
+		pthread_join(retention_thread, NULL);
+	}
+}
+
+/* Uninitialise data retention */
+meterd_rv meterd_retention_finalize(void)
+{
+	retention_policy*	policy_it	= NULL;
+	retention_policy*	policy_tmp	= NULL;
+
+	LL_FOREACH_SAFE(policies, policy_it, policy_tmp)
+	{
+		LL_DELETE(policies, policy_it);
+
+		free(policy_it->db_name);
+		free(policy_it);
+	}
+
+	return MRV_OK;
+}
+
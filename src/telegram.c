@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * P1 telegram buffer
+ */
+
+#include "config.h"
+#include "meterd_types.h"
+#include "meterd_error.h"
+#include "telegram.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define TELEGRAM_INITIAL_SIZE	4096
+#define TELEGRAM_INITIAL_LINES	64
+
+/* Initialise an empty telegram */
+void meterd_telegram_init(p1_telegram* telegram)
+{
+	assert(telegram != NULL);
+
+	memset(telegram, 0, sizeof(p1_telegram));
+}
+
+/* Discard the lines in the telegram but keep the allocated space */
+void meterd_telegram_reset(p1_telegram* telegram)
+{
+	assert(telegram != NULL);
+
+	telegram->buf_len	= 0;
+	telegram->line_count	= 0;
+}
+
+/* Make room for a line of up to len bytes and return where it should be written */
+char* meterd_telegram_reserve(p1_telegram* telegram, size_t len)
+{
+	assert(telegram != NULL);
+
+	size_t	new_size	= (telegram->buf_size > 0) ? telegram->buf_size : TELEGRAM_INITIAL_SIZE;
+
+	/* Leave room for the terminating NUL */
+	while ((new_size - telegram->buf_len) < (len + 1))
+	{
+		new_size *= 2;
+	}
+
+	if (new_size != telegram->buf_size)
+	{
+		char*	new_buf	= (char*) realloc(telegram->buf, new_size * sizeof(char));
+
+		if (new_buf == NULL)
+		{
+			return NULL;
+		}
+
+		telegram->buf		= new_buf;
+		telegram->buf_size	= new_size;
+	}
+
+	return &telegram->buf[telegram->buf_len];
+}
+
+/* Add the line of len bytes written to the reserved space; the line ends at the first CR or LF */
+meterd_rv meterd_telegram_commit_line(p1_telegram* telegram, size_t len)
+{
+	assert(telegram != NULL);
+	assert((telegram->buf_len + len) < telegram->buf_size);
+
+	char*	line		= &telegram->buf[telegram->buf_len];
+	size_t	line_len	= 0;
+
+	if (telegram->line_count == telegram->line_size)
+	{
+		size_t		new_size	= (telegram->line_size > 0) ? (telegram->line_size * 2) : TELEGRAM_INITIAL_LINES;
+		telegram_line*	new_lines	= (telegram_line*) realloc(telegram->lines, new_size * sizeof(telegram_line));
+
+		if (new_lines == NULL)
+		{
+			return MRV_MEMORY;
+		}
+
+		telegram->lines		= new_lines;
+		telegram->line_size	= new_size;
+	}
+
+	/* Remove \r and \n */
+	while ((line_len < len) && (line[line_len] != '\r') && (line[line_len] != '\n'))
+	{
+		line_len++;
+	}
+
+	line[line_len] = '\0';
+
+	telegram->lines[telegram->line_count].offset	= telegram->buf_len;
+	telegram->lines[telegram->line_count].len	= line_len;
+	telegram->line_count++;
+
+	telegram->buf_len += line_len + 1;
+
+	return MRV_OK;
+}
+
+/* Release the space held by the telegram */
+void meterd_telegram_free(p1_telegram* telegram)
+{
+	if (telegram == NULL) return;
+
+	free(telegram->buf);
+	free(telegram->lines);
+
+	meterd_telegram_init(telegram);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * P1 telegram buffer
+ */
+
+#ifndef _METERD_TELEGRAM_H
+#define _METERD_TELEGRAM_H
+
+#include "config.h"
+#include "meterd_types.h"
+
+/* Views on the lines in a telegram */
+#define TELEGRAM_LINE(t, i)		(&(t)->buf[(t)->lines[(i)].offset])
+#define TELEGRAM_LINE_LEN(t, i)		((t)->lines[(i)].len)
+
+/* Initialise an empty telegram */
+void meterd_telegram_init(p1_telegram* telegram);
+
+/* Discard the lines in the telegram but keep the allocated space */
+void meterd_telegram_reset(p1_telegram* telegram);
+
+/* Make room for a line of up to len bytes and return where it should be written */
+char* meterd_telegram_reserve(p1_telegram* telegram, size_t len);
+
+/* Add the line of len bytes written to the reserved space; the line ends at the first CR or LF */
+meterd_rv meterd_telegram_commit_line(p1_telegram* telegram, size_t len);
+
+/* Release the space held by the telegram */
+void meterd_telegram_free(p1_telegram* telegram);
+
+#endif /* !_METERD_TELEGRAM_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SMRVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Check that the database writer keeps averages, counter values and
+ * aggregates when it drops raw values because the queue fills up
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "meterd_types.h"
+#include "meterd_error.h"
+#include "db.h"
+#include "dbwriter.h"
+#include "fixed.h"
+#include "utlist.h"
+
+/* Queue size and the number of raw values queued before the writer runs */
+#define TEST_QUEUE_SIZE		64
+#define TEST_RAW_COUNT		60
+#define TEST_RAW_KEPT		(TEST_QUEUE_SIZE - TEST_QUEUE_SIZE / 4)
+
+/* Count the rows in the specified table */
+static int testdbwriter_count(sqlite3* db, const char* table_name)
+{
+	sqlite3_stmt*	stmt		= NULL;
+	char		sql_buf[256]	= { 0 };
+	int		count		= -1;
+
+	snprintf(sql_buf, 256, "SELECT COUNT(*) FROM %s;", table_name);
+
+	if (sqlite3_prepare_v2(db, sql_buf, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		fprintf(stderr, "Failed to count the rows in %s (%s)\n", table_name, sqlite3_errmsg(db));
+
+		return -1;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		count = sqlite3_column_int(stmt, 0);
+	}
+
+	sqlite3_finalize(stmt);
+
+	return count;
+}
+
+/* Check the number of rows in the specified table */
+static int testdbwriter_expect(sqlite3* db, const char* table_name, int expected)
+{
+	int	count	= testdbwriter_count(db, table_name);
+
+	if (count != expected)
+	{
+		fprintf(stderr, "Table %s has %d row(s), expected %d\n", table_name, count, expected);
+
+		return 0;
+	}
+
+	printf("Table %s has %d row(s)\n", table_name, count);
+
+	return 1;
+}
+
+int main(void)
+{
+	counter_spec		raw		= { 0 };
+	counter_spec		fivemin		= { 0 };
+	counter_spec		hourly		= { 0 };
+	counter_spec		counter		= { 0 };
+	counter_spec		daily		= { 0 };
+	counter_spec*		counters	= NULL;
+	meterd_aggregate	agg		= { 0 };
+	dbwriter_stats		stats		= { 0 };
+	char			db_name[]	= "/tmp/testdbwriter.XXXXXX";
+	void*			db_handle	= NULL;
+	sqlite3*		db		= NULL;
+	int			fd		= -1;
+	int			ok		= 1;
+	int			i		= 0;
+
+	if ((fd = mkstemp(db_name)) < 0)
+	{
+		fprintf(stderr, "Failed to create a temporary database file\n");
+
+		return 1;
+	}
+
+	close(fd);
+
+	raw.id			= "1.7.0";
+	raw.description		= "Raw";
+	raw.table_name		= "RAW_1_7_0";
+	raw.type		= COUNTER_TYPE_RAW;
+
+	fivemin.id		= "1.7.0/5min";
+	fivemin.description	= "5 minute average";
+	fivemin.table_name	= "FIVEMIN_1_7_0";
+	fivemin.type		= COUNTER_TYPE_FIVEMIN;
+
+	hourly.id		= "1.7.0/hourly";
+	hourly.description	= "Hourly average";
+	hourly.table_name	= "HOURLY_1_7_0";
+	hourly.type		= COUNTER_TYPE_HOURLY;
+
+	counter.id		= "1.8.1";
+	counter.description	= "Counter";
+	counter.table_name	= "CONSUMED_1_8_1";
+	counter.type		= COUNTER_TYPE_CONSUMED;
+
+	daily.id		= "1.7.0/daily";
+	daily.description	= "Daily aggregate";
+	daily.table_name	= "DAILY_1_7_0";
+	daily.type		= COUNTER_TYPE_DAILY;
+
+	LL_APPEND(counters, &raw);
+	LL_APPEND(counters, &fivemin);
+	LL_APPEND(counters, &hourly);
+	LL_APPEND(counters, &counter);
+	LL_APPEND(counters, &daily);
+
+	if ((meterd_db_init() != MRV_OK) ||
+	    (meterd_db_create(db_name, 1, &db_handle) != MRV_OK) ||
+	    (meterd_db_create_tables(db_handle, counters) != MRV_OK) ||
+	    (meterd_dbwriter_init(TEST_QUEUE_SIZE, WRITE_OVERLOAD_DROP_RAW) != MRV_OK))
+	{
+		fprintf(stderr, "Failed to set up the test database %s\n", db_name);
+
+		unlink(db_name);
+
+		return 1;
+	}
+
+	/* Fill the queue before the writer runs, so raw values are dropped */
+	for (i = 0; i < TEST_RAW_COUNT; i++)
+	{
+		meterd_dbwriter_record(db_handle, raw.table_name, i * FIXED_SCALE, UNIT_KW, 1000 + i, WRITE_PRIO_LOW);
+	}
+
+	/* Queue the other values with the priorities the measurement loop uses */
+	meterd_dbwriter_record(db_handle, fivemin.table_name, 1 * FIXED_SCALE, UNIT_KW, 1300, WRITE_PRIO_HIGH);
+	meterd_dbwriter_record(db_handle, fivemin.table_name, 2 * FIXED_SCALE, UNIT_KW, 1600, WRITE_PRIO_HIGH);
+	meterd_dbwriter_record(db_handle, hourly.table_name, 3 * FIXED_SCALE, UNIT_KW, 4600, WRITE_PRIO_HIGH);
+	meterd_dbwriter_record(db_handle, counter.table_name, 4 * FIXED_SCALE, UNIT_KWH, 1000, WRITE_PRIO_HIGH);
+
+	agg.table_name	= daily.table_name;
+	agg.start	= 0;
+	agg.end		= 86400;
+	agg.count	= TEST_RAW_COUNT;
+	agg.min		= 0 * FIXED_SCALE;
+	agg.max		= (TEST_RAW_COUNT - 1) * FIXED_SCALE;
+
+	meterd_dbwriter_store_aggregate(db_handle, &agg, UNIT_KW);
+
+	if (meterd_dbwriter_start() != MRV_OK)
+	{
+		fprintf(stderr, "Failed to start the database writer\n");
+
+		ok = 0;
+	}
+
+	meterd_dbwriter_stop();
+	meterd_dbwriter_get_stats(&stats);
+	meterd_dbwriter_finalize();
+	meterd_db_close(db_handle);
+	meterd_db_finalize();
+
+	if (stats.dropped != (TEST_RAW_COUNT - TEST_RAW_KEPT))
+	{
+		fprintf(stderr, "Dropped %llu value(s), expected %d\n", (unsigned long long) stats.dropped, TEST_RAW_COUNT - TEST_RAW_KEPT);
+
+		ok = 0;
+	}
+
+	if (sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		fprintf(stderr, "Failed to open %s\n", db_name);
+
+		ok = 0;
+	}
+	else
+	{
+		ok &= testdbwriter_expect(db, raw.table_name, TEST_RAW_KEPT);
+		ok &= testdbwriter_expect(db, fivemin.table_name, 2);
+		ok &= testdbwriter_expect(db, hourly.table_name, 1);
+		ok &= testdbwriter_expect(db, counter.table_name, 1);
+		ok &= testdbwriter_expect(db, daily.table_name, 1);
+	}
+
+	sqlite3_close(db);
+
+	unlink(db_name);
+
+	printf("%s\n", ok ? "PASS" : "FAIL");
+
+	return ok ? 0 : 1;
+}
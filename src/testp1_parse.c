@@ -29,33 +29,115 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include "p1_parser.h"
+#include "telegram.h"
+#include "obis.h"
+#include "fixed.h"
 #include "meterd_error.h"
 #include "utlist.h"
 
-int main(int argc, char* argv[])
+/* Controls debug output from the parser */
+int testp1_verbose = 1;
+
+/* Corpus of test telegrams */
+typedef struct test_telegram
 {
-	telegram_ll*	telegram	= NULL;
-	telegram_ll*	tel_it		= NULL;
-	telegram_ll*	tel_tmp		= NULL;
-	smart_counter*	counters	= NULL;
-	smart_counter*	ctr_it		= NULL;
-	smart_counter*	ctr_tmp		= NULL;
-	FILE*		in		= NULL;
-	char		buf[4096]	= { 0 };
+	char*			source;		/* File the telegram was read from */
+	p1_telegram		telegram;	/* The telegram */
+	struct test_telegram*	next;
+}
+test_telegram;
+
+static const char*	engine_names[3]	= { "default", "scanner", "regex" };
+
+/* Counter IDs to decode (all if none are specified) */
+#define MAX_FILTER_IDS	64
+
+static char*		filter_ids[MAX_FILTER_IDS];
+static int		filter_count	= 0;
+
+void usage(void)
+{
+	printf("Usage:\n");
+	printf("\ttestp1-parse [-g <gas id>] [-f <id> ...] [-r] <telegram file> [...]\n");
+	printf("\ttestp1-parse [-g <gas id>] -c [-n <iterations>] <telegram file> [...]\n");
+	printf("\ttestp1-parse [-g <gas id>] -n <iterations> <telegram file> [...]\n");
+	printf("\ttestp1-parse [-g <gas id>] [-r] -s <chunk size> [-n <iterations>] <telegram file> [...]\n");
+	printf("\n");
+	printf("\t-g <gas id>     Gas counter ID (defaults to 24.3.0)\n");
+	printf("\t-r              Use the regular expression parser\n");
+	printf("\t-c              Check that both parsers produce the same counters\n");
+	printf("\t-n <iterations> Report the parser speed over <iterations> runs\n");
+	printf("\t-f <id>         Only decode the counter with the specified ID (may be repeated)\n");
+	printf("\t-s <chunk size> Stream the raw files to the parser in chunks of <chunk size> bytes\n");
+	printf("\n");
+	printf("Files may contain more than one telegram; each telegram starts with '/'\n");
+}
+
+/* Return the current monotonic time in microseconds */
+static long double now_us(void)
+{
+	struct timespec	ts;
 
-	if (argc != 2)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long double) ts.tv_sec * 1000000.0f) + ((long double) ts.tv_nsec / 1000.0f);
+}
+
+/* Create a parser context that only decodes the selected counters */
+static meterd_rv create_parser(const char* gas_id, int engine, p1_parser_ctx** ctx)
+{
+	meterd_rv	rv	= MRV_OK;
+	int		i	= 0;
+
+	if ((rv = meterd_p1_parser_create(gas_id, engine, ctx)) != MRV_OK)
 	{
-		fprintf(stderr, "Please specify the filename of the test telegram on the command line\n");
-		
-		return -1;
+		return rv;
 	}
 
-	in = fopen(argv[1], "r");
+	for (i = 0; i < filter_count; i++)
+	{
+		obis_key	key	= 0;
+
+		if ((rv = meterd_obis_from_string(filter_ids[i], strlen(filter_ids[i]), &key)) != MRV_OK)
+		{
+			fprintf(stderr, "Invalid counter ID %s\n", filter_ids[i]);
+		}
+
+		if ((rv != MRV_OK) || ((rv = meterd_p1_parser_add_filter(*ctx, key)) != MRV_OK))
+		{
+			meterd_p1_parser_destroy(*ctx);
+			*ctx = NULL;
+
+			return rv;
+		}
+	}
+
+	return MRV_OK;
+}
+
+/* Print a decoded counter */
+static void print_counter(const smart_counter* ctr)
+{
+	char	id_buf[OBIS_STR_MAX];
+
+	printf("id = %s, value = %0.5Lf, unit = %s\n", meterd_obis_to_string(ctr->id, id_buf), FIXED_TO_LDOUBLE(ctr->value), meterd_unit_name(ctr->unit));
+}
+
+/* Read all telegrams from the specified file and add them to the corpus */
+static int load_telegrams(const char* filename, test_telegram** corpus, int* count)
+{
+	FILE*		in		= NULL;
+	char		buf[4096]	= { 0 };
+	test_telegram*	current		= NULL;
+
+	in = fopen(filename, "r");
 
 	if (in == NULL)
 	{
-		fprintf(stderr, "Failed to open '%s' for reading\n", argv[1]);
+		fprintf(stderr, "Failed to open '%s' for reading\n", filename);
 
 		return -1;
 	}
@@ -64,39 +146,474 @@ int main(int argc, char* argv[])
 	{
 		if (fgets(buf, 4096, in) != NULL)
 		{
-			telegram_ll*	new_line	= (telegram_ll*) malloc(sizeof(telegram_ll));
+			size_t	len	= strlen(buf);
+
+			/* A '/' starts a new telegram */
+			if ((current == NULL) || (buf[0] == '/'))
+			{
+				current = (test_telegram*) calloc(1, sizeof(test_telegram));
+
+				current->source = strdup(filename);
+				meterd_telegram_init(&current->telegram);
 
-			/* Strip CR/LF */
-			while (strrchr(buf, '\r') != NULL) *strrchr(buf, '\r') = '\0';
-			while (strrchr(buf, '\n') != NULL) *strrchr(buf, '\n') = '\0';
+				LL_APPEND(*corpus, current);
 
-			new_line->t_line = strdup(buf);
+				(*count)++;
+			}
 
-			LL_APPEND(telegram, new_line);
+			/* The line is cut off at CR/LF when it is added */
+			memcpy(meterd_telegram_reserve(&current->telegram, len), buf, len);
+			meterd_telegram_commit_line(&current->telegram, len);
 		}
 	}
 
-	/* Parse the test telegram */
-	if (meterd_parse_p1_telegram(telegram, "24.3.0", &counters) != MRV_OK)
+	fclose(in);
+
+	return 0;
+}
+
+/* Free the corpus */
+static void free_telegrams(test_telegram* corpus)
+{
+	test_telegram*	tt_it	= NULL;
+	test_telegram*	tt_tmp	= NULL;
+
+	LL_FOREACH_SAFE(corpus, tt_it, tt_tmp)
 	{
-		fprintf(stderr, "Parsing of P1 telegram returned and error\n");
+		meterd_telegram_free(&tt_it->telegram);
+		free(tt_it->source);
+		free(tt_it);
 	}
+}
 
-	LL_FOREACH_SAFE(counters, ctr_it, ctr_tmp)
+/* Time the specified parser with and without reusing the parser context */
+static void benchmark(test_telegram* corpus, int count, const char* gas_id, int engine, int iterations)
+{
+	p1_parser_ctx*	ctx		= NULL;
+	smart_counter*	counters	= NULL;
+	test_telegram*	tt_it		= NULL;
+	long double	start		= 0.0f;
+	long double	per_tel_once	= 0.0f;
+	long double	per_tel_reuse	= 0.0f;
+	int		i		= 0;
+
+	testp1_verbose = 0;
+
+	/* Set up a new context for every telegram */
+	start = now_us();
+
+	for (i = 0; i < iterations; i++)
 	{
-		printf("id = %s, value = %0.5Lf, unit = %s\n", ctr_it->id, ctr_it->value, ctr_it->unit);
+		LL_FOREACH(corpus, tt_it)
+		{
+			if (create_parser(gas_id, engine, &ctx) != MRV_OK)
+			{
+				fprintf(stderr, "Failed to create %s parser context\n", engine_names[engine]);
+
+				return;
+			}
 
-		free(ctr_it->id);
-		free(ctr_it->unit);
-		free(ctr_it);
+			meterd_parse_p1_telegram(ctx, &tt_it->telegram, &counters);
+			meterd_p1_counters_free(counters);
+			counters = NULL;
+
+			meterd_p1_parser_destroy(ctx);
+			ctx = NULL;
+		}
 	}
 
-	LL_FOREACH_SAFE(telegram, tel_it, tel_tmp)
+	per_tel_once = (now_us() - start) / (long double) (iterations * count);
+
+	/* Reuse a single context for all telegrams */
+	if (create_parser(gas_id, engine, &ctx) != MRV_OK)
 	{
-		free(tel_it->t_line);
-		free(tel_it);
+		fprintf(stderr, "Failed to create %s parser context\n", engine_names[engine]);
+
+		return;
 	}
 
-	return 0;
+	start = now_us();
+
+	for (i = 0; i < iterations; i++)
+	{
+		LL_FOREACH(corpus, tt_it)
+		{
+			meterd_parse_p1_telegram(ctx, &tt_it->telegram, &counters);
+			meterd_p1_counters_free(counters);
+			counters = NULL;
+		}
+	}
+
+	per_tel_reuse = (now_us() - start) / (long double) (iterations * count);
+
+	meterd_p1_parser_destroy(ctx);
+
+	printf("%-7s parser, context per telegram: %10.3Lf us/telegram (%10.0Lf telegrams/s)\n", engine_names[engine], per_tel_once, 1000000.0f / per_tel_once);
+	printf("%-7s parser, reused context:       %10.3Lf us/telegram (%10.0Lf telegrams/s)\n", engine_names[engine], per_tel_reuse, 1000000.0f / per_tel_reuse);
+}
+
+/* Check that both parsers produce the same counters for every telegram in the corpus */
+static int compare(test_telegram* corpus, const char* gas_id)
+{
+	p1_parser_ctx*	scan_ctx	= NULL;
+	p1_parser_ctx*	regex_ctx	= NULL;
+	test_telegram*	tt_it		= NULL;
+	int		telegram_no	= 0;
+	int		mismatches	= 0;
+	int		counter_count	= 0;
+
+	if ((create_parser(gas_id, P1_ENGINE_SCANNER, &scan_ctx) != MRV_OK) ||
+	    (create_parser(gas_id, P1_ENGINE_REGEX, &regex_ctx) != MRV_OK))
+	{
+		fprintf(stderr, "Failed to create parser contexts\n");
+
+		meterd_p1_parser_destroy(scan_ctx);
+
+		return -1;
+	}
+
+	testp1_verbose = 0;
+
+	LL_FOREACH(corpus, tt_it)
+	{
+		smart_counter*	scan_ctrs	= NULL;
+		smart_counter*	regex_ctrs	= NULL;
+		smart_counter*	scan_it		= NULL;
+		smart_counter*	regex_it	= NULL;
+
+		telegram_no++;
+
+		meterd_parse_p1_telegram(scan_ctx, &tt_it->telegram, &scan_ctrs);
+		meterd_parse_p1_telegram(regex_ctx, &tt_it->telegram, &regex_ctrs);
+
+		for (scan_it = scan_ctrs, regex_it = regex_ctrs; (scan_it != NULL) && (regex_it != NULL); scan_it = scan_it->next, regex_it = regex_it->next)
+		{
+			counter_count++;
+
+			if ((scan_it->id != regex_it->id) || (scan_it->unit != regex_it->unit) || (scan_it->value != regex_it->value))
+			{
+				char	scan_id[OBIS_STR_MAX];
+				char	regex_id[OBIS_STR_MAX];
+
+				printf("%s, telegram %d: scanner (%s, %0.5Lf, %s) != regex (%s, %0.5Lf, %s)\n",
+					tt_it->source, telegram_no,
+					meterd_obis_to_string(scan_it->id, scan_id), FIXED_TO_LDOUBLE(scan_it->value), meterd_unit_name(scan_it->unit),
+					meterd_obis_to_string(regex_it->id, regex_id), FIXED_TO_LDOUBLE(regex_it->value), meterd_unit_name(regex_it->unit));
+
+				mismatches++;
+			}
+		}
+
+		if ((scan_it != NULL) || (regex_it != NULL))
+		{
+			printf("%s, telegram %d: scanner and regex return a different number of counters\n", tt_it->source, telegram_no);
+
+			mismatches++;
+		}
+
+		meterd_p1_counters_free(scan_ctrs);
+		meterd_p1_counters_free(regex_ctrs);
+	}
+
+	meterd_p1_parser_destroy(scan_ctx);
+	meterd_p1_parser_destroy(regex_ctx);
+
+	printf("Compared %d counters in %d telegrams, %d mismatches\n", counter_count, telegram_no, mismatches);
+
+	return (mismatches == 0) ? 0 : -1;
+}
+
+/* Read the raw contents of the specified file */
+static char* load_raw(const char* filename, size_t* len)
+{
+	FILE*	in	= fopen(filename, "r");
+	char*	data	= NULL;
+	long	size	= 0;
+
+	if (in == NULL)
+	{
+		fprintf(stderr, "Failed to open '%s' for reading\n", filename);
+
+		return NULL;
+	}
+
+	if ((fseek(in, 0, SEEK_END) != 0) || ((size = ftell(in)) < 0) || (fseek(in, 0, SEEK_SET) != 0))
+	{
+		fclose(in);
+
+		return NULL;
+	}
+
+	data = (char*) malloc(size + 1);
+
+	if ((data != NULL) && (fread(data, 1, size, in) != (size_t) size))
+	{
+		free(data);
+		data = NULL;
+	}
+
+	fclose(in);
+
+	*len = size;
+
+	return data;
+}
+
+/* Push the raw data to the streaming parser in chunks; returns the number of telegrams */
+static int stream(p1_parser_ctx* ctx, const char* data, size_t len, size_t chunk, int print)
+{
+	smart_counter*	counters	= NULL;
+	smart_counter*	ctr_it		= NULL;
+	size_t		pos		= 0;
+	int		telegrams	= 0;
+
+	while (pos < len)
+	{
+		size_t		avail		= ((len - pos) < chunk) ? (len - pos) : chunk;
+		size_t		consumed	= 0;
+		meterd_rv	rv		= meterd_p1_parser_push(ctx, &data[pos], avail, &consumed, &counters);
+
+		pos += consumed;
+
+		if (rv == MRV_P1_MORE_DATA)
+		{
+			continue;
+		}
+
+		if (rv == MRV_P1_CRC_ERROR)
+		{
+			fprintf(stderr, "Telegram failed the CRC check\n");
+		}
+		else if (rv != MRV_OK)
+		{
+			fprintf(stderr, "Parsing of P1 telegram returned an error\n");
+		}
+		else
+		{
+			telegrams++;
+		}
+
+		if (print)
+		{
+			LL_FOREACH(counters, ctr_it)
+			{
+				print_counter(ctr_it);
+			}
+		}
+
+		meterd_p1_counters_free(counters);
+		counters = NULL;
+	}
+
+	/* Counters of an incomplete telegram at the end of the data */
+	meterd_p1_counters_free(counters);
+
+	return telegrams;
 }
 
+/* Stream all files to the parser and optionally time it */
+static int stream_files(char* files[], int file_count, const char* gas_id, int engine, size_t chunk, int iterations)
+{
+	p1_parser_ctx*	ctx		= NULL;
+	char**		data		= (char**) calloc(file_count, sizeof(char*));
+	size_t*		len		= (size_t*) calloc(file_count, sizeof(size_t));
+	int		telegrams	= 0;
+	int		rv		= 0;
+	int		i		= 0;
+	int		j		= 0;
+
+	if ((data == NULL) || (len == NULL) || (create_parser(gas_id, engine, &ctx) != MRV_OK))
+	{
+		fprintf(stderr, "Failed to create parser context\n");
+
+		free(data);
+		free(len);
+
+		return -1;
+	}
+
+	for (i = 0; i < file_count; i++)
+	{
+		if ((data[i] = load_raw(files[i], &len[i])) == NULL)
+		{
+			rv = -1;
+
+			break;
+		}
+	}
+
+	if ((rv == 0) && (iterations > 0))
+	{
+		long double	start		= 0.0f;
+		long double	per_tel		= 0.0f;
+
+		testp1_verbose = 0;
+
+		start = now_us();
+
+		for (j = 0; j < iterations; j++)
+		{
+			for (i = 0; i < file_count; i++)
+			{
+				telegrams += stream(ctx, data[i], len[i], chunk, 0);
+			}
+		}
+
+		if (telegrams > 0)
+		{
+			per_tel = (now_us() - start) / (long double) telegrams;
+
+			printf("%-7s parser, streaming %zd byte chunks: %10.3Lf us/telegram (%10.0Lf telegrams/s)\n", engine_names[engine], chunk, per_tel, 1000000.0f / per_tel);
+		}
+	}
+	else if (rv == 0)
+	{
+		unsigned long long	good	= 0;
+		unsigned long long	bad	= 0;
+
+		for (i = 0; i < file_count; i++)
+		{
+			stream(ctx, data[i], len[i], chunk, 1);
+		}
+
+		meterd_p1_parser_get_stats(ctx, &good, &bad);
+
+		fprintf(stderr, "%llu telegrams passed and %llu telegrams failed the CRC check\n", good, bad);
+	}
+
+	for (i = 0; i < file_count; i++)
+	{
+		free(data[i]);
+	}
+
+	free(data);
+	free(len);
+
+	meterd_p1_parser_destroy(ctx);
+
+	return rv;
+}
+
+int main(int argc, char* argv[])
+{
+	test_telegram*	corpus		= NULL;
+	test_telegram*	tt_it		= NULL;
+	int		count		= 0;
+	smart_counter*	counters	= NULL;
+	smart_counter*	ctr_it		= NULL;
+	p1_parser_ctx*	ctx		= NULL;
+	char*		gas_id		= "24.3.0";
+	int		engine		= P1_ENGINE_DEFAULT;
+	int		check		= 0;
+	int		iterations	= 0;
+	size_t		chunk		= 0;
+	int		rv		= 0;
+	int		c		= 0;
+
+	while ((c = getopt(argc, argv, "g:rcn:f:s:h")) != -1)
+	{
+		switch(c)
+		{
+		case 'g':
+			gas_id = optarg;
+			break;
+		case 'r':
+			engine = P1_ENGINE_REGEX;
+			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'f':
+			if (filter_count >= MAX_FILTER_IDS)
+			{
+				fprintf(stderr, "Too many counter IDs specified\n");
+
+				return -1;
+			}
+
+			filter_ids[filter_count++] = optarg;
+			break;
+		case 's':
+			chunk = (size_t) atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			return 0;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Please specify the filename of the test telegram on the command line\n");
+		
+		return -1;
+	}
+
+	if (chunk > 0)
+	{
+		return stream_files(&argv[optind], argc - optind, gas_id, engine, chunk, iterations);
+	}
+
+	for (; optind < argc; optind++)
+	{
+		if (load_telegrams(argv[optind], &corpus, &count) != 0)
+		{
+			free_telegrams(corpus);
+
+			return -1;
+		}
+	}
+
+	if (check)
+	{
+		rv = compare(corpus, gas_id);
+
+		if (iterations > 0)
+		{
+			benchmark(corpus, count, gas_id, P1_ENGINE_SCANNER, iterations);
+			benchmark(corpus, count, gas_id, P1_ENGINE_REGEX, iterations);
+		}
+	}
+	else if (iterations > 0)
+	{
+		benchmark(corpus, count, gas_id, engine, iterations);
+	}
+	else
+	{
+		/* Parse the test telegrams */
+		if (create_parser(gas_id, engine, &ctx) != MRV_OK)
+		{
+			fprintf(stderr, "Failed to create parser context\n");
+
+			free_telegrams(corpus);
+
+			return -1;
+		}
+
+		LL_FOREACH(corpus, tt_it)
+		{
+			if (meterd_parse_p1_telegram(ctx, &tt_it->telegram, &counters) != MRV_OK)
+			{
+				fprintf(stderr, "Parsing of P1 telegram returned and error\n");
+			}
+
+			LL_FOREACH(counters, ctr_it)
+			{
+				print_counter(ctr_it);
+			}
+
+			meterd_p1_counters_free(counters);
+			counters = NULL;
+		}
+
+		meterd_p1_parser_destroy(ctx);
+	}
+
+	free_telegrams(corpus);
+
+	return rv;
+}
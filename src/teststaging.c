@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2015-2019 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SMRVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Smart Meter Monitoring Daemon (meterd)
+ * Check that merging the staged measurements truncates the WAL of the
+ * staging database when the database is checkpointed manually
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "meterd_types.h"
+#include "meterd_error.h"
+#include "db.h"
+#include "fixed.h"
+#include "utlist.h"
+
+/* Number of measurements staged, each in its own transaction */
+#define TEST_STAGED_COUNT	2000
+
+/* Get the size of the specified file, -1 if it does not exist */
+static long long teststaging_size(const char* file_name)
+{
+	struct stat	st;
+
+	if (stat(file_name, &st) != 0)
+	{
+		return -1;
+	}
+
+	return (long long) st.st_size;
+}
+
+int main(void)
+{
+	counter_spec	raw			= { 0 };
+	char		db_name[]		= "/tmp/teststaging.XXXXXX";
+	char		staging_name[64]	= { 0 };
+	char		wal_name[128]		= { 0 };
+	void*		db_handle		= NULL;
+	long long	wal_size		= 0;
+	int		merged			= 0;
+	int		fd			= -1;
+	int		ok			= 1;
+	int		i			= 0;
+
+	if ((fd = mkstemp(db_name)) < 0)
+	{
+		fprintf(stderr, "Failed to create a temporary database file\n");
+
+		return 1;
+	}
+
+	close(fd);
+
+	snprintf(staging_name, 64, "%s.staging", db_name);
+	snprintf(wal_name, 128, "%s-wal", staging_name);
+
+	raw.id			= "1.7.0";
+	raw.description		= "Raw";
+	raw.table_name		= "RAW_1_7_0";
+	raw.type		= COUNTER_TYPE_RAW;
+
+	if ((meterd_db_init() != MRV_OK) ||
+	    (meterd_db_create(db_name, 1, &db_handle) != MRV_OK) ||
+	    (meterd_db_create_tables(db_handle, &raw) != MRV_OK) ||
+	    (meterd_db_manual_checkpoints(db_handle, 4096 * 1024) != MRV_OK) ||
+	    (meterd_db_stage(db_handle, staging_name) != MRV_OK))
+	{
+		fprintf(stderr, "Failed to set up the test database %s\n", db_name);
+
+		unlink(db_name);
+
+		return 1;
+	}
+
+	for (i = 0; i < TEST_STAGED_COUNT; i++)
+	{
+		meterd_db_begin(db_handle);
+		meterd_db_record(db_handle, raw.table_name, i * FIXED_SCALE, UNIT_KW, 1000 + i);
+		meterd_db_commit(db_handle);
+
+		/* The first measurement also stores the unit in the database */
+		if (i == 0)
+		{
+			wal_size = meterd_db_wal_size(db_handle);
+		}
+	}
+
+	/* Only commits to the database itself count towards its WAL */
+	if (meterd_db_wal_size(db_handle) != wal_size)
+	{
+		fprintf(stderr, "The WAL of the database grew from %lld to %lld byte(s) while staging\n", wal_size, meterd_db_wal_size(db_handle));
+
+		ok = 0;
+	}
+
+	printf("The WAL of the staging database has %lld byte(s) before merging\n", teststaging_size(wal_name));
+
+	if ((meterd_db_merge(db_handle, &merged) != MRV_OK) || (merged != TEST_STAGED_COUNT))
+	{
+		fprintf(stderr, "Merged %d row(s), expected %d\n", merged, TEST_STAGED_COUNT);
+
+		ok = 0;
+	}
+
+	if ((wal_size = teststaging_size(wal_name)) != 0)
+	{
+		fprintf(stderr, "The WAL of the staging database has %lld byte(s) after merging, expected none\n", wal_size);
+
+		ok = 0;
+	}
+	else
+	{
+		printf("The WAL of the staging database is empty after merging\n");
+	}
+
+	meterd_db_unstage(db_handle);
+	meterd_db_close(db_handle);
+	meterd_db_finalize();
+
+	unlink(db_name);
+	unlink(staging_name);
+
+	snprintf(wal_name, 128, "%s-wal", db_name);
+	unlink(wal_name);
+
+	snprintf(wal_name, 128, "%s-shm", db_name);
+	unlink(wal_name);
+
+	printf("%s\n", ok ? "PASS" : "FAIL");
+
+	return ok ? 0 : 1;
+}